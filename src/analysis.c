@@ -0,0 +1,526 @@
+#include "analysis.h"
+#include <string.h>
+#include "bytebeat.h"
+#include "fpu.h"
+#include "sampler.h"
+
+#define ANALYSIS_MAX_PENDING 256
+
+#define ANALYSIS_OP(opcode) ((opcode) & 0x1f)
+#define ANALYSIS_FLAG_SHORT 0x20
+#define ANALYSIS_FLAG_RETURN 0x40
+#define ANALYSIS_FLAG_KEEP 0x80
+
+enum {
+	ANALYSIS_BRK  = 0x00,
+	ANALYSIS_JCI  = 0x20,
+	ANALYSIS_JMI  = 0x40,
+	ANALYSIS_JSI  = 0x60,
+	ANALYSIS_LIT  = 0x80,
+	ANALYSIS_LIT2 = 0xa0,
+	ANALYSIS_LITr = 0xc0,
+	ANALYSIS_LIT2r = 0xe0,
+	ANALYSIS_POPk = 0x82,
+	ANALYSIS_LDZ  = 0x10,
+	ANALYSIS_LDZ2 = 0x30,
+};
+
+enum {
+	ANALYSIS_OP_JMP = 0x0c,
+	ANALYSIS_OP_JCN = 0x0d,
+	ANALYSIS_OP_JSR = 0x0e,
+	ANALYSIS_OP_STH = 0x0f,
+	ANALYSIS_OP_LDZ = 0x10,
+	ANALYSIS_OP_STZ = 0x11,
+	ANALYSIS_OP_LDR = 0x12,
+	ANALYSIS_OP_STR = 0x13,
+	ANALYSIS_OP_LDA = 0x14,
+	ANALYSIS_OP_STA = 0x15,
+	ANALYSIS_OP_DEI = 0x16,
+	ANALYSIS_OP_DEO = 0x17,
+};
+
+typedef struct {
+	const rom_t* rom;
+	analysis_t* analysis;
+
+	uint8_t visited[65536 / 8];
+	uint8_t targets[65536 / 8];
+
+	// JMP2r is assumed to return after a call, which only holds when nothing
+	// but calls puts addresses on the return stack
+	bool has_returns;
+	bool pushes_return_data;
+
+	int num_pending;
+	uint16_t pending[ANALYSIS_MAX_PENDING];
+} analysis_ctx_t;
+
+static inline uint8_t
+analysis_read(const rom_t* rom, uint16_t addr) {
+	if (addr < 0x100 || addr - 0x100 >= rom->size) { return 0; }
+	return rom->content[addr - 0x100];
+}
+
+static inline uint16_t
+analysis_read2(const rom_t* rom, uint16_t addr) {
+	return (uint16_t)(analysis_read(rom, addr) << 8 | analysis_read(rom, addr + 1));
+}
+
+static inline bool
+analysis_bit(const uint8_t* bits, uint16_t addr) {
+	return (bits[addr / 8] & (1 << (addr % 8))) != 0;
+}
+
+static inline void
+analysis_set_bit(uint8_t* bits, uint16_t addr) {
+	bits[addr / 8] |= 1 << (addr % 8);
+}
+
+static void
+analysis_branch(analysis_ctx_t* ctx, uint16_t target) {
+	analysis_set_bit(ctx->targets, target);
+	if (analysis_bit(ctx->visited, target)) { return; }
+
+	if (ctx->num_pending < ANALYSIS_MAX_PENDING) {
+		ctx->pending[ctx->num_pending++] = target;
+	} else {
+		ctx->analysis->complete = false;
+	}
+}
+
+static void
+analysis_mark_written(analysis_t* analysis, uint16_t addr, bool is_short) {
+	if (addr < 0x100) {
+		analysis_set_bit(analysis->written_zp, addr);
+	}
+	if (is_short && addr + 1 < 0x100) {
+		analysis_set_bit(analysis->written_zp, addr + 1);
+	}
+}
+
+static void
+analysis_mark_read(analysis_t* analysis, uint16_t addr, bool is_short) {
+	for (int i = 0; i < (is_short ? 2 : 1); ++i) {
+		uint16_t read_addr = addr + i;
+		if (read_addr < 0x100) {
+			analysis_set_bit(analysis->read_zp, read_addr);
+			continue;
+		}
+
+		bool found = false;
+		for (int j = 0; j < analysis->num_reads; ++j) {
+			found |= analysis->reads[j] == read_addr;
+		}
+		if (found) { continue; }
+
+		if (analysis->num_reads < ANALYSIS_MAX_READS) {
+			analysis->reads[analysis->num_reads++] = read_addr;
+		} else {
+			analysis->reads_truncated = true;
+		}
+	}
+}
+
+static void
+analysis_dei(analysis_t* analysis, uint8_t port, bool is_short) {
+	switch (port & 0xf0) {
+		case BYTEBEAT_VECTOR:
+			for (int i = 0; i < (is_short ? 2 : 1); ++i) {
+				uint8_t read_port = port + i;
+				if (read_port == BYTEBEAT_T || read_port == BYTEBEAT_T + 1) {
+					analysis->reads_t_port = true;
+				} else {
+					analysis->reads_ports = true;
+				}
+			}
+			break;
+		// Results only depend on what was written to the device
+		case BUXN_DEVICE_FPU:
+		// Sample banks are treated like data in the rom
+		case SAMPLER_BANK:
+			break;
+		default:
+			analysis->has_side_effects = true;
+			break;
+	}
+}
+
+static void
+analysis_deo(analysis_t* analysis, uint8_t port) {
+	switch (port & 0xf0) {
+		case BUXN_DEVICE_FPU:
+		case SAMPLER_BANK:
+			break;
+		default:
+			analysis->has_side_effects = true;
+			break;
+	}
+}
+
+// Loads, stores and device access which decide the purity of the vector
+static void
+analysis_track_access(
+	analysis_t* analysis,
+	uint16_t pc,
+	uint8_t opcode,
+	bool has_addr,
+	bool has_addr2,
+	uint8_t addr,
+	uint16_t addr2
+) {
+	uint8_t op = ANALYSIS_OP(opcode);
+	bool is_short = (opcode & ANALYSIS_FLAG_SHORT) != 0;
+	bool has_addr8 = has_addr && !has_addr2;
+	switch (op) {
+		case ANALYSIS_OP_LDZ:
+			if (has_addr8) {
+				analysis_mark_read(analysis, addr, is_short);
+			} else {
+				analysis->reads_unknown = true;
+			}
+			break;
+		case ANALYSIS_OP_LDR:
+			if (has_addr8) {
+				analysis_mark_read(analysis, pc + 1 + (int8_t)addr, is_short);
+			} else {
+				analysis->reads_unknown = true;
+			}
+			break;
+		case ANALYSIS_OP_LDA:
+			if (has_addr2) {
+				analysis_mark_read(analysis, addr2, is_short);
+			} else {
+				analysis->reads_unknown = true;
+			}
+			break;
+		case ANALYSIS_OP_STZ:
+		case ANALYSIS_OP_STR:
+		case ANALYSIS_OP_STA:
+			analysis->writes_memory = true;
+			break;
+		case ANALYSIS_OP_DEI:
+			if (has_addr8) {
+				analysis_dei(analysis, addr, is_short);
+			} else {
+				analysis->has_side_effects = true;
+			}
+			break;
+		case ANALYSIS_OP_DEO:
+			if (has_addr8) {
+				analysis_deo(analysis, addr);
+			} else {
+				analysis->has_side_effects = true;
+			}
+			break;
+	}
+}
+
+// Whether an instruction puts a new value on the return stack, as opposed to
+// moving the return addresses which are already there
+static bool
+analysis_pushes_return_data(uint8_t opcode) {
+	if (opcode == ANALYSIS_LITr || opcode == ANALYSIS_LIT2r) { return true; }
+
+	uint8_t op = ANALYSIS_OP(opcode);
+	if (!(opcode & ANALYSIS_FLAG_RETURN)) { return op == ANALYSIS_OP_STH; }
+
+	switch (op) {
+		case 0x01:  // INC
+		case 0x08:  // EQU
+		case 0x09:  // NEQ
+		case 0x0a:  // GTH
+		case 0x0b:  // LTH
+		case ANALYSIS_OP_LDZ:
+		case ANALYSIS_OP_LDR:
+		case ANALYSIS_OP_LDA:
+		case ANALYSIS_OP_DEI:
+			return true;
+		default:
+			// Arithmetic
+			return op >= 0x18;
+	}
+}
+
+static analysis_purity_t
+analysis_classify(const analysis_t* analysis) {
+	if (!analysis->complete || analysis->writes_memory || analysis->has_side_effects) {
+		return ANALYSIS_STATEFUL;
+	}
+
+	bool reads_zp = analysis->reads_unknown || analysis->reads_ports;
+	for (int i = 0; i < (int)sizeof(analysis->read_zp); ++i) {
+		reads_zp |= analysis->read_zp[i] != 0;
+	}
+	return reads_zp ? ANALYSIS_PURE_ZP : ANALYSIS_PURE;
+}
+
+static void
+analysis_walk(analysis_ctx_t* ctx, uint16_t pc) {
+	const rom_t* rom = ctx->rom;
+	analysis_t* analysis = ctx->analysis;
+
+	// The previous instruction if it was a literal
+	bool has_lit = false;
+	uint16_t lit_addr = 0;
+	uint8_t lit = 0;
+
+	while (!analysis_bit(ctx->visited, pc)) {
+		analysis_set_bit(ctx->visited, pc);
+		// A branch may reach this instruction with anything on the stack
+		if (analysis_bit(ctx->targets, pc)) {
+			has_lit = false;
+		}
+
+		uint8_t opcode = analysis_read(rom, pc);
+		uint16_t next = pc + 1;
+		bool is_lit = false;
+		ctx->pushes_return_data |= analysis_pushes_return_data(opcode);
+
+		switch (opcode) {
+			case ANALYSIS_BRK:
+				return;
+			case ANALYSIS_JCI:
+				analysis_branch(ctx, pc + 3 + analysis_read2(rom, pc + 1));
+				next = pc + 3;
+				break;
+			case ANALYSIS_JMI:
+				analysis_branch(ctx, pc + 3 + analysis_read2(rom, pc + 1));
+				return;
+			case ANALYSIS_JSI:
+				analysis_branch(ctx, pc + 3 + analysis_read2(rom, pc + 1));
+				next = pc + 3;
+				break;
+			case ANALYSIS_LIT:
+			case ANALYSIS_LITr:
+				is_lit = true;
+				next = pc + 2;
+				break;
+			case ANALYSIS_LIT2:
+			case ANALYSIS_LIT2r:
+				is_lit = true;
+				next = pc + 3;
+				break;
+			default: {
+				uint8_t op = ANALYSIS_OP(opcode);
+				bool is_short = (opcode & ANALYSIS_FLAG_SHORT) != 0;
+				bool is_return = (opcode & ANALYSIS_FLAG_RETURN) != 0;
+				// Whether the address operand is a literal on the same stack
+				bool has_addr = has_lit
+					&& (lit & ANALYSIS_FLAG_RETURN) == (opcode & ANALYSIS_FLAG_RETURN);
+				bool has_addr2 = has_addr && (lit & ANALYSIS_FLAG_SHORT);
+				uint16_t addr2 = has_addr2 ? analysis_read2(rom, lit_addr + 1) : 0;
+				uint8_t addr = has_addr
+					? analysis_read(rom, lit_addr + ((lit & ANALYSIS_FLAG_SHORT) ? 2 : 1))
+					: 0;
+				analysis_track_access(analysis, pc, opcode, has_addr, has_addr2, addr, addr2);
+
+				if (op == ANALYSIS_OP_JMP || op == ANALYSIS_OP_JCN || op == ANALYSIS_OP_JSR) {
+					bool known_target = true;
+					uint16_t target = 0;
+					if (is_short && has_addr2) {
+						target = addr2;
+					} else if (!is_short && has_addr && !has_addr2) {
+						target = pc + 1 + (int8_t)addr;
+					} else {
+						known_target = false;
+					}
+
+					if (known_target) {
+						analysis_branch(ctx, target);
+					} else if (op == ANALYSIS_OP_JMP && is_return && is_short) {
+						ctx->has_returns = true;
+					} else {
+						// Anything but a return (JMP2r) is a computed jump,
+						// including the relative JMPr
+						analysis->complete = false;
+					}
+
+					if (op == ANALYSIS_OP_JMP) { return; }
+				} else if (op == ANALYSIS_OP_STZ) {
+					if (has_addr && !has_addr2) {
+						analysis_mark_written(analysis, addr, is_short);
+					} else {
+						analysis->writes_unknown = true;
+					}
+				} else if (op == ANALYSIS_OP_STA) {
+					if (has_addr2) {
+						analysis_mark_written(analysis, addr2, is_short);
+					} else {
+						analysis->writes_unknown = true;
+					}
+				} else if (op == ANALYSIS_OP_DEO) {
+					// The System device can copy memory
+					if (!has_addr || has_addr2 || (addr & 0xf0) == 0x00) {
+						analysis->writes_unknown = true;
+					}
+				} else if (
+					(opcode == ANALYSIS_LDZ || opcode == ANALYSIS_LDZ2)
+					&& has_lit && lit_addr + ((lit & ANALYSIS_FLAG_SHORT) ? 3 : 2) == pc
+					&& (lit == ANALYSIS_LIT || (lit == ANALYSIS_LIT2 && opcode == ANALYSIS_LDZ))
+					&& analysis->num_zp_loads < ANALYSIS_MAX_ZP_LOADS
+				) {
+					analysis->zp_loads[analysis->num_zp_loads++] = (analysis_zp_load_t){
+						.addr = lit_addr,
+						.lit = lit,
+						.load = opcode,
+						.zp_addr = addr,
+						.high_byte = analysis_read(rom, lit_addr + 1),
+					};
+				}
+			} break;
+		}
+
+		has_lit = is_lit;
+		lit_addr = pc;
+		lit = opcode;
+		pc = next;
+	}
+}
+
+void
+analysis_run(analysis_t* analysis, const rom_t* rom, uint16_t vector) {
+	analysis_ctx_t ctx = {
+		.rom = rom,
+		.analysis = analysis,
+	};
+
+	// A target is only known once a branch to it was walked, which may be
+	// after the code falling through into it.
+	// The first pass collects all targets and the second one runs with them
+	// known from the start.
+	// It can only find fewer targets since it assumes fewer literals.
+	for (int pass = 0; pass < 2; ++pass) {
+		memset(analysis, 0, sizeof(*analysis));
+		memset(ctx.visited, 0, sizeof(ctx.visited));
+		analysis->vector = vector;
+		analysis->complete = true;
+
+		ctx.has_returns = false;
+		ctx.pushes_return_data = false;
+		ctx.num_pending = 0;
+		ctx.pending[ctx.num_pending++] = vector;
+		while (ctx.num_pending > 0) {
+			analysis_walk(&ctx, ctx.pending[--ctx.num_pending]);
+		}
+	}
+
+	// A return may then jump anywhere
+	if (ctx.has_returns && ctx.pushes_return_data) {
+		analysis->complete = false;
+	}
+
+	// A load cannot be rewritten if something jumps into the middle of it
+	int num_zp_loads = 0;
+	for (int i = 0; i < analysis->num_zp_loads; ++i) {
+		analysis_zp_load_t load = analysis->zp_loads[i];
+		int size = load.lit == ANALYSIS_LIT2 ? 4 : 3;
+		bool is_target = false;
+		for (int j = 1; j < size; ++j) {
+			is_target |= analysis_bit(ctx.targets, load.addr + j);
+		}
+
+		if (!is_target) {
+			analysis->zp_loads[num_zp_loads++] = load;
+		}
+	}
+	analysis->num_zp_loads = num_zp_loads;
+
+	analysis->purity = analysis_classify(analysis);
+}
+
+const char*
+analysis_purity_name(analysis_purity_t purity) {
+	switch (purity) {
+		case ANALYSIS_PURE:
+			return "pure";
+		case ANALYSIS_PURE_ZP:
+			return "pure in the zero page";
+		case ANALYSIS_STATEFUL:
+			return "stateful";
+	}
+
+	return "unknown";
+}
+
+void
+analysis_add_zp_writes(analysis_zp_writes_t* writes, const analysis_t* analysis) {
+	// Code which was not found may write anywhere
+	if (!analysis->complete || analysis->writes_unknown) {
+		writes->unknown = true;
+		return;
+	}
+
+	for (int i = 0; i < (int)sizeof(writes->zp); ++i) {
+		writes->zp[i] |= analysis->written_zp[i];
+	}
+}
+
+static bool
+analysis_zp_writes_contain(const analysis_zp_writes_t* writes, uint8_t addr) {
+	return (writes->zp[addr / 8] & (1 << (addr % 8))) != 0;
+}
+
+int
+analysis_specialize_zp(
+	const analysis_t* analysis,
+	const analysis_zp_writes_t* writes,
+	const uint8_t* zero_page,
+	analysis_patch_t* patches,
+	int max_patches
+) {
+	if (!analysis->complete || writes->unknown) { return 0; }
+
+	int num_patches = 0;
+	for (int i = 0; i < analysis->num_zp_loads && num_patches < max_patches; ++i) {
+		const analysis_zp_load_t* load = &analysis->zp_loads[i];
+		uint8_t zp_addr = load->zp_addr;
+		uint8_t next_zp_addr = zp_addr + 1;
+
+		if (analysis_zp_writes_contain(writes, zp_addr)) { continue; }
+
+		analysis_patch_t* patch = &patches[num_patches];
+		patch->addr = load->addr;
+		patch->zp_addr = zp_addr;
+		patch->zp_size = 1;
+		if (load->lit == ANALYSIS_LIT2) {
+			// LIT2 hh aa LDZ -> LIT2 hh vv POPk
+			patch->size = 4;
+			patch->bytes[0] = ANALYSIS_LIT2;
+			patch->bytes[1] = load->high_byte;
+			patch->bytes[2] = zero_page[zp_addr];
+			patch->bytes[3] = ANALYSIS_POPk;
+		} else if (load->load == ANALYSIS_LDZ2) {
+			// LIT aa LDZ2 -> LIT2 vv vv
+			if (analysis_zp_writes_contain(writes, next_zp_addr)) { continue; }
+			patch->zp_size = 2;
+			patch->size = 3;
+			patch->bytes[0] = ANALYSIS_LIT2;
+			patch->bytes[1] = zero_page[zp_addr];
+			patch->bytes[2] = zero_page[next_zp_addr];
+		} else {
+			// LIT aa LDZ -> LIT vv POPk
+			patch->size = 3;
+			patch->bytes[0] = ANALYSIS_LIT;
+			patch->bytes[1] = zero_page[zp_addr];
+			patch->bytes[2] = ANALYSIS_POPk;
+		}
+		++num_patches;
+	}
+
+	return num_patches;
+}
+
+analysis_patch_t
+analysis_unpatch(const rom_t* rom, const analysis_patch_t* patch) {
+	analysis_patch_t original = {
+		.addr = patch->addr,
+		.size = patch->size,
+		.zp_addr = patch->zp_addr,
+		.zp_size = patch->zp_size,
+	};
+	for (int i = 0; i < patch->size; ++i) {
+		original.bytes[i] = analysis_read(rom, patch->addr + i);
+	}
+	return original;
+}
@@ -0,0 +1,119 @@
+#ifndef UBEAT_ANALYSIS_H
+#define UBEAT_ANALYSIS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "asm.h"
+
+#define ANALYSIS_MAX_ZP_LOADS 256
+#define ANALYSIS_MAX_READS 64
+
+// What the output of a vector depends on, from the most to the least
+// restrictive
+typedef enum {
+	// Only t
+	ANALYSIS_PURE,
+	// t and state which only the main thread changes: the zero page and the
+	// ports of the Bytebeat device
+	ANALYSIS_PURE_ZP,
+	// Memory or devices carry state from one sample to the next, or the code
+	// could not be fully analyzed
+	ANALYSIS_STATEFUL,
+} analysis_purity_t;
+
+// A zero-page load from a constant address: `LIT aa LDZ`, `LIT aa LDZ2` or
+// `LIT2 hh aa LDZ`
+typedef struct {
+	uint16_t addr;  // Address of the literal
+	uint8_t lit;
+	uint8_t load;
+	uint8_t zp_addr;
+	uint8_t high_byte;  // Of LIT2
+} analysis_zp_load_t;
+
+typedef struct {
+	uint16_t addr;
+	uint8_t size;
+	uint8_t bytes[4];
+	// The zero-page bytes whose value is folded into the patch
+	uint8_t zp_addr;
+	uint8_t zp_size;
+} analysis_patch_t;
+
+typedef struct {
+	uint16_t vector;
+
+	// Whether all reachable code was found.
+	// It is false when there are computed jumps.
+	bool complete;
+	// Whether there are stores which may write to an unknown address
+	bool writes_unknown;
+	uint8_t written_zp[256 / 8];
+
+	analysis_purity_t purity;
+	bool writes_memory;
+	// Device access which is not a pure function of its inputs
+	bool has_side_effects;
+	// Whether t is read from Bytebeat/t instead of the stack
+	bool reads_t_port;
+	bool reads_ports;  // Other ports of the Bytebeat device
+	bool reads_unknown;  // Loads from computed addresses
+	uint8_t read_zp[256 / 8];
+	// Constant addresses outside of the zero page
+	bool reads_truncated;
+	int num_reads;
+	uint16_t reads[ANALYSIS_MAX_READS];
+
+	int num_zp_loads;
+	analysis_zp_load_t zp_loads[ANALYSIS_MAX_ZP_LOADS];
+} analysis_t;
+
+void
+analysis_run(analysis_t* analysis, const rom_t* rom, uint16_t vector);
+
+static inline bool
+analysis_zp_is_written(const analysis_t* analysis, uint8_t addr) {
+	return (analysis->written_zp[addr / 8] & (1 << (addr % 8))) != 0;
+}
+
+static inline bool
+analysis_zp_is_read(const analysis_t* analysis, uint8_t addr) {
+	return (analysis->read_zp[addr / 8] & (1 << (addr % 8))) != 0;
+}
+
+// Zero-page bytes which any of several vectors may write
+typedef struct {
+	bool unknown;
+	uint8_t zp[256 / 8];
+} analysis_zp_writes_t;
+
+const char*
+analysis_purity_name(analysis_purity_t purity);
+
+void
+analysis_add_zp_writes(analysis_zp_writes_t* writes, const analysis_t* analysis);
+
+// Generate patches which replace zero-page loads with the given values.
+// Patched code is shared by every voice but each one writes to its own VM so
+// writes must cover all vectors which may run it, including this one.
+// Returns the number of patches.
+int
+analysis_specialize_zp(
+	const analysis_t* analysis,
+	const analysis_zp_writes_t* writes,
+	const uint8_t* zero_page,
+	analysis_patch_t* patches,
+	int max_patches
+);
+
+// Generate a patch which restores the original content.
+// It covers the same zero-page bytes as the patch.
+analysis_patch_t
+analysis_unpatch(const rom_t* rom, const analysis_patch_t* patch);
+
+static inline bool
+analysis_patch_folds(const analysis_patch_t* patch, uint8_t addr) {
+	return (uint8_t)(addr - patch->zp_addr) < patch->zp_size;
+}
+
+#endif
@@ -1,14 +1,68 @@
+#define _GNU_SOURCE
 #include "asm.h"
 #include <bresmon.h>
 #include <barena.h>
 #include <bhash.h>
 #include <buxn/asm/asm.h>
 #include <blog.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "trace.h"
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Assembled roms are cached along with the content hash of every file which
+// went into them
+#define CACHE_MAGIC "UBEATROM"
+#define CACHE_VERSION 1
+// The output of the assembler may change between builds.
+// The Makefile derives the id from every source of the build.
+#ifndef UBEAT_BUILD_ID
+#	define UBEAT_BUILD_ID __DATE__ " " __TIME__
+#endif
+#define CACHE_BUILD_ID UBEAT_BUILD_ID
+
+typedef struct {
+	ubeat_symtab_t public;
+
+	int capacity;
+	ubeat_symbol_t* symbols;
+	barena_t arena;  // For names
+} symtab_storage_t;
+
+// A file which went into the rom, hashed while the assembler read it so the
+// cache describes what was assembled even if the file changed since
+typedef struct asm_input_s {
+	struct asm_input_s* next;
+	const char* filename;
+	uint64_t hash;
+} asm_input_t;
+
+typedef struct {
+	FILE* file;
+	asm_input_t* input;  // NULL when inputs are not tracked
+} asm_file_t;
 
 struct buxn_asm_ctx_s {
 	rom_t* rom;
 	barena_t* arena;
+	symtab_storage_t* symtab;
+	asm_input_t* inputs;
+	// Only the thread which reloads watches inputs
+	bool watch;
+};
+
+struct ubeat_prepared_rom_s {
+	rom_t rom;
+	symtab_storage_t symtab;
+	asm_input_t* inputs;
+	// The shared arenas belong to the thread which reloads
+	barena_pool_t pool;
+	barena_t arena;  // For inputs
 };
 
 typedef BHASH_TABLE(char*, bresmon_watch_t*) watch_table_t;
@@ -22,6 +76,11 @@ static barena_t arenas[2];
 static barena_t* current_arena = &arenas[0];
 static int loaded_version = 0;
 static int current_version = 0;
+// The symbols of the loaded rom are kept until the next successful reload
+static symtab_storage_t symtabs[2];
+static symtab_storage_t* current_symtab = &symtabs[0];
+static bool cache_enabled = true;
+static char cache_dir[PATH_MAX];
 
 static bhash_hash_t
 str_hash(const void* key, size_t size) {
@@ -43,17 +102,404 @@ arena_strdup(barena_t* arena, const char* str) {
 	return copy;
 }
 
+static int
+symbol_cmp(const void* lhs, const void* rhs) {
+	const ubeat_symbol_t* lsym = lhs;
+	const ubeat_symbol_t* rsym = rhs;
+	return (int)lsym->addr - (int)rsym->addr;
+}
+
 static void
 ubeat_file_changed(const char* filename, void* userdata) {
 	BLOG_DEBUG("%s updated", (char*)userdata);  // userdata is the latest copy
 	++current_version;
 }
 
+// Every watched file is an input of the current rom
+static void
+watch_file(const char* filename) {
+	bhash_alloc_result_t result = bhash_alloc(current_watch_table, (char*){ (char*)filename });
+	if (!result.is_new) { return; }
+
+	char* name_copy = arena_strdup(current_arena, filename);
+	current_watch_table->keys[result.index] = name_copy;
+
+	// Copy watch from the previous table or create a new one
+	watch_table_t* previous_watch_table = current_watch_table == &watch_tables[0] ? &watch_tables[1] : &watch_tables[0];
+	bhash_index_t previous_index = bhash_find(previous_watch_table, (char*){ (char*)filename });
+	if (bhash_is_valid(previous_index)) {
+		bresmon_watch_t* watch = previous_watch_table->values[previous_index];
+		bresmon_set_watch_callback(watch, ubeat_file_changed, name_copy);
+		current_watch_table->values[result.index] = watch;
+	} else {
+		BLOG_DEBUG("Watching %s", filename);
+		current_watch_table->values[result.index] = bresmon_watch(
+			monitor, filename, ubeat_file_changed, name_copy
+		);
+	}
+}
+
+static void
+watch_inputs(const asm_input_t* inputs) {
+	for (const asm_input_t* input = inputs; input != NULL; input = input->next) {
+		watch_file(input->filename);
+	}
+}
+
+static void
+add_input(barena_t* arena, asm_input_t** inputs, const char* filename, uint64_t hash) {
+	asm_input_t* input = barena_memalign(arena, sizeof(asm_input_t), _Alignof(asm_input_t));
+	input->filename = arena_strdup(arena, filename);
+	input->hash = hash;
+	input->next = *inputs;
+	*inputs = input;
+}
+
+static void
+symtab_add(symtab_storage_t* symtab, uint16_t addr, const char* name) {
+	if (symtab->public.num_symbols == symtab->capacity) {
+		int capacity = symtab->capacity > 0 ? symtab->capacity * 2 : 64;
+		ubeat_symbol_t* symbols = realloc(symtab->symbols, sizeof(symbols[0]) * capacity);
+		if (symbols == NULL) { return; }
+		symtab->symbols = symbols;
+		symtab->capacity = capacity;
+	}
+
+	symtab->symbols[symtab->public.num_symbols++] = (ubeat_symbol_t){
+		.addr = addr,
+		.name = arena_strdup(&symtab->arena, name),
+	};
+}
+
+// FNV-1a
+static uint64_t
+hash_bytes(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* bytes = data;
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ull
+
+// Map a whole file read-only.
+// Empty files are returned as a non-NULL pointer which must not be read.
+static const uint8_t*
+map_file(const char* filename, size_t* size) {
+	static const uint8_t empty = 0;
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) { return NULL; }
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	*size = (size_t)info.st_size;
+	if (*size == 0) {
+		close(fd);
+		return &empty;
+	}
+
+	void* data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) { return NULL; }
+
+	madvise(data, *size, MADV_SEQUENTIAL);
+	return data;
+}
+
+static void
+unmap_file(const uint8_t* data, size_t size) {
+	if (size > 0) {
+		munmap((void*)data, size);
+	}
+}
+
+static bool
+hash_file(const char* filename, uint64_t* hash) {
+	size_t size;
+	const uint8_t* data = map_file(filename, &size);
+	if (data == NULL) { return false; }
+
+	*hash = hash_bytes(HASH_INIT, data, size);
+	unmap_file(data, size);
+	return true;
+}
+
+static bool
+is_rom_file(const char* filename) {
+	size_t len = strlen(filename);
+	return len > 4 && strcmp(filename + len - 4, ".rom") == 0;
+}
+
+// Labels written by uxnasm and drifblim: a big endian address followed by a
+// null terminated name
+static void
+load_sym_file(const char* rom_filename, symtab_storage_t* symtab) {
+	char filename[PATH_MAX];
+	snprintf(filename, sizeof(filename), "%s.sym", rom_filename);
+
+	size_t size;
+	const uint8_t* data = map_file(filename, &size);
+	if (data == NULL) { return; }
+
+	size_t offset = 0;
+	while (offset + 2 < size) {
+		uint16_t addr = (uint16_t)(data[offset] << 8 | data[offset + 1]);
+		const uint8_t* name = data + offset + 2;
+		const uint8_t* terminator = memchr(name, 0, size - offset - 2);
+		if (terminator == NULL) { break; }
+
+		symtab_add(symtab, addr, (const char*)name);
+		offset = (size_t)(terminator - data) + 1;
+	}
+	unmap_file(data, size);
+
+	BLOG_DEBUG("Loaded %d symbols from %s", symtab->public.num_symbols, filename);
+}
+
+static bool
+read_rom_file(const char* filename, rom_t* rom) {
+	size_t size;
+	const uint8_t* data = map_file(filename, &size);
+	if (data == NULL) {
+		BLOG_ERROR("Could not open %s: %s", filename, strerror(errno));
+		return false;
+	}
+
+	if (size == 0 || size > sizeof(rom->content)) {
+		BLOG_ERROR("%s is not a valid rom (%zu bytes)", filename, size);
+		unmap_file(data, size);
+		return false;
+	}
+
+	memcpy(rom->content, data, size);
+	rom->size = (uint16_t)size;
+	unmap_file(data, size);
+	return true;
+}
+
+// Prebuilt roms are used as is
+static bool
+load_rom_file(rom_t* rom, symtab_storage_t* symtab) {
+	// The file is still watched so a fixed rom is picked up
+	watch_file(entry_file);
+	if (!read_rom_file(entry_file, rom)) { return false; }
+
+	load_sym_file(entry_file, symtab);
+	return true;
+}
+
+static bool
+cache_path(const char* filename, char* path, size_t size) {
+	char entry_path[PATH_MAX];
+	if (realpath(filename, entry_path) == NULL) { return false; }
+
+	uint64_t hash = hash_bytes(HASH_INIT, entry_path, strlen(entry_path));
+	int length = snprintf(path, size, "%s/%016llx.rom", cache_dir, (unsigned long long)hash);
+	return length > 0 && (size_t)length < size;
+}
+
+static bool
+cache_read(const uint8_t** cursor, const uint8_t* end, void* data, size_t size) {
+	if ((size_t)(end - *cursor) < size) { return false; }
+
+	memcpy(data, *cursor, size);
+	*cursor += size;
+	return true;
+}
+
+// A string from the cache, which is not null terminated
+static bool
+cache_read_string(const uint8_t** cursor, const uint8_t* end, char* buffer, size_t buffer_size) {
+	uint32_t length;
+	if (!cache_read(cursor, end, &length, sizeof(length))) { return false; }
+	if (length >= buffer_size) { return false; }
+	if (!cache_read(cursor, end, buffer, length)) { return false; }
+
+	buffer[length] = '\0';
+	return true;
+}
+
+// Inputs are only returned once the whole rom was read
+static bool
+parse_cached_rom(
+	const uint8_t* cursor,
+	const uint8_t* end,
+	rom_t* rom,
+	symtab_storage_t* symtab,
+	barena_t* arena,
+	asm_input_t** inputs
+) {
+	char magic[sizeof(CACHE_MAGIC) - 1];
+	uint32_t version;
+	char build_id[64];
+	if (!cache_read(&cursor, end, magic, sizeof(magic))) { return false; }
+	if (!cache_read(&cursor, end, &version, sizeof(version))) { return false; }
+	if (!cache_read_string(&cursor, end, build_id, sizeof(build_id))) { return false; }
+	if (
+		memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0
+		|| version != CACHE_VERSION
+		|| strcmp(build_id, CACHE_BUILD_ID) != 0
+	) {
+		return false;
+	}
+
+	// Check every input before touching anything
+	uint32_t num_files;
+	if (!cache_read(&cursor, end, &num_files, sizeof(num_files))) { return false; }
+	const uint8_t* files = cursor;
+	for (uint32_t i = 0; i < num_files; ++i) {
+		char filename[PATH_MAX];
+		uint64_t expected_hash, actual_hash;
+		if (!cache_read_string(&cursor, end, filename, sizeof(filename))) { return false; }
+		if (!cache_read(&cursor, end, &expected_hash, sizeof(expected_hash))) { return false; }
+		if (!hash_file(filename, &actual_hash) || actual_hash != expected_hash) {
+			BLOG_DEBUG("%s has changed since the rom was cached", filename);
+			return false;
+		}
+	}
+
+	uint16_t rom_size;
+	if (!cache_read(&cursor, end, &rom_size, sizeof(rom_size))) { return false; }
+	if (rom_size > sizeof(rom->content)) { return false; }
+	if (!cache_read(&cursor, end, rom->content, rom_size)) { return false; }
+	rom->size = rom_size;
+
+	uint32_t num_symbols;
+	if (!cache_read(&cursor, end, &num_symbols, sizeof(num_symbols))) { return false; }
+	for (uint32_t i = 0; i < num_symbols; ++i) {
+		uint16_t addr;
+		char name[1024];
+		if (!cache_read(&cursor, end, &addr, sizeof(addr))) { return false; }
+		if (!cache_read_string(&cursor, end, name, sizeof(name))) { return false; }
+		symtab_add(symtab, addr, name);
+	}
+
+	cursor = files;
+	for (uint32_t i = 0; i < num_files; ++i) {
+		char filename[PATH_MAX];
+		uint64_t hash;
+		cache_read_string(&cursor, end, filename, sizeof(filename));
+		cache_read(&cursor, end, &hash, sizeof(hash));
+		add_input(arena, inputs, filename, hash);
+	}
+
+	return true;
+}
+
+static bool
+load_cached_rom(
+	const char* filename,
+	rom_t* rom,
+	symtab_storage_t* symtab,
+	barena_t* arena,
+	asm_input_t** inputs
+) {
+	char path[PATH_MAX];
+	if (!cache_path(filename, path, sizeof(path))) { return false; }
+
+	size_t size;
+	const uint8_t* data = map_file(path, &size);
+	if (data == NULL) { return false; }
+
+	bool success = parse_cached_rom(data, data + size, rom, symtab, arena, inputs);
+	unmap_file(data, size);
+	if (!success) {
+		// Leave no half loaded symbols behind
+		symtab->public.num_symbols = 0;
+		barena_reset(&symtab->arena);
+	}
+
+	return success;
+}
+
+static void
+cache_write_string(FILE* file, const char* str) {
+	uint32_t length = (uint32_t)strlen(str);
+	fwrite(&length, sizeof(length), 1, file);
+	fwrite(str, 1, length, file);
+}
+
+static void
+store_cached_rom(const rom_t* rom, const symtab_storage_t* symtab, const asm_input_t* inputs) {
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX + 4];
+	if (!cache_path(entry_file, path, sizeof(path))) { return; }
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	FILE* file = fopen(tmp_path, "wb");
+	if (file == NULL) {
+		BLOG_WARN("Could not write %s: %s", tmp_path, strerror(errno));
+		return;
+	}
+
+	uint32_t version = CACHE_VERSION;
+	fwrite(CACHE_MAGIC, 1, sizeof(CACHE_MAGIC) - 1, file);
+	fwrite(&version, sizeof(version), 1, file);
+	cache_write_string(file, CACHE_BUILD_ID);
+
+	uint32_t num_files = 0;
+	for (const asm_input_t* input = inputs; input != NULL; input = input->next) {
+		++num_files;
+	}
+	fwrite(&num_files, sizeof(num_files), 1, file);
+	for (const asm_input_t* input = inputs; input != NULL; input = input->next) {
+		cache_write_string(file, input->filename);
+		fwrite(&input->hash, sizeof(input->hash), 1, file);
+	}
+
+	fwrite(&rom->size, sizeof(rom->size), 1, file);
+	fwrite(rom->content, 1, rom->size, file);
+
+	uint32_t num_symbols = (uint32_t)symtab->public.num_symbols;
+	fwrite(&num_symbols, sizeof(num_symbols), 1, file);
+	for (uint32_t i = 0; i < num_symbols; ++i) {
+		fwrite(&symtab->symbols[i].addr, sizeof(symtab->symbols[i].addr), 1, file);
+		cache_write_string(file, symtab->symbols[i].name);
+	}
+
+	bool success = !ferror(file);
+	success = fclose(file) == 0 && success;
+	// Readers never see a partial file
+	if (!success || rename(tmp_path, path) != 0) {
+		BLOG_WARN("Could not write %s", path);
+		remove(tmp_path);
+	}
+}
+
+// $XDG_CACHE_HOME/ubeat or ~/.cache/ubeat
+static bool
+init_cache_dir(void) {
+	const char* xdg_cache_home = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	char root[PATH_MAX];
+	if (xdg_cache_home != NULL && xdg_cache_home[0] != '\0') {
+		snprintf(root, sizeof(root), "%s", xdg_cache_home);
+	} else if (home != NULL) {
+		snprintf(root, sizeof(root), "%s/.cache", home);
+	} else {
+		return false;
+	}
+	snprintf(cache_dir, sizeof(cache_dir), "%s/ubeat", root);
+
+	if (mkdir(root, 0755) != 0 && errno != EEXIST) { return false; }
+	if (mkdir(cache_dir, 0755) != 0 && errno != EEXIST) { return false; }
+
+	return true;
+}
+
 void
 ubeat_asm_init(void) {
 	barena_pool_init(&arena_pool, 1);
 	barena_init(&arenas[0], &arena_pool);
 	barena_init(&arenas[1], &arena_pool);
+	barena_init(&symtabs[0].arena, &arena_pool);
+	barena_init(&symtabs[1].arena, &arena_pool);
 
 	monitor = bresmon_create(NULL);
 
@@ -64,6 +510,16 @@ ubeat_asm_init(void) {
 
 	bhash_init(&watch_tables[0], config);
 	bhash_init(&watch_tables[1], config);
+
+	if (cache_enabled && !init_cache_dir()) {
+		BLOG_WARN("Could not create the cache directory, roms will not be cached");
+		cache_enabled = false;
+	}
+}
+
+void
+ubeat_asm_set_cache_enabled(bool enabled) {
+	cache_enabled = enabled;
 }
 
 void
@@ -79,16 +535,29 @@ ubeat_asm_should_reload(void) {
 	return entry_file != NULL && loaded_version != current_version;
 }
 
-bool
-ubeat_asm_reload(rom_t* rom) {
-	if (entry_file == NULL) { return false; }
-
-	buxn_asm_ctx_t basm = {
-		.rom = rom,
-		.arena = current_arena,
-	};
+// Symbols are loaded into the table which is not current so that a failed
+// reload keeps the previous ones
+static symtab_storage_t*
+begin_reload(void) {
+	symtab_storage_t* next_symtab = current_symtab == &symtabs[0] ? &symtabs[1] : &symtabs[0];
+	barena_reset(&next_symtab->arena);
+	next_symtab->public.num_symbols = 0;
+	return next_symtab;
+}
 
-	bool success = buxn_asm(&basm, entry_file);
+static void
+finish_reload(symtab_storage_t* next_symtab, bool success) {
+	if (success) {
+		qsort(
+			next_symtab->symbols,
+			next_symtab->public.num_symbols,
+			sizeof(next_symtab->symbols[0]),
+			symbol_cmp
+		);
+		next_symtab->public.symbols = next_symtab->symbols;
+		next_symtab->public.version = current_symtab->public.version + 1;
+		current_symtab = next_symtab;
+	}
 
 	watch_table_t* previous_watch_table = current_watch_table == &watch_tables[0] ? &watch_tables[1] : &watch_tables[0];
 	for (bhash_index_t i = 0; i < bhash_len(previous_watch_table); ++i) {
@@ -116,10 +585,135 @@ ubeat_asm_reload(rom_t* rom) {
 	bhash_clear(current_watch_table);
 
 	loaded_version = current_version;
+}
+
+bool
+ubeat_asm_reload(rom_t* rom) {
+	if (entry_file == NULL) { return false; }
+
+	uint64_t trace_start = trace_begin();
+	symtab_storage_t* next_symtab = begin_reload();
+
+	bool success;
+	asm_input_t* inputs = NULL;
+	if (is_rom_file(entry_file)) {
+		success = load_rom_file(rom, next_symtab);
+	} else if (cache_enabled && load_cached_rom(entry_file, rom, next_symtab, current_arena, &inputs)) {
+		BLOG_INFO("Loaded %s from the cache", entry_file);
+		watch_inputs(inputs);
+		success = true;
+	} else {
+		buxn_asm_ctx_t basm = {
+			.rom = rom,
+			.arena = current_arena,
+			.symtab = next_symtab,
+			.watch = true,
+		};
+		success = buxn_asm(&basm, entry_file);
+		if (success && cache_enabled) {
+			store_cached_rom(rom, next_symtab, basm.inputs);
+		}
+	}
+
+	finish_reload(next_symtab, success);
+	trace_end("ubeat_asm_reload", trace_start);
 
 	return success;
 }
 
+ubeat_prepared_rom_t*
+ubeat_asm_prepare(const char* filename) {
+	uint64_t trace_start = trace_begin();
+	ubeat_prepared_rom_t* prepared = calloc(1, sizeof(ubeat_prepared_rom_t));
+	barena_pool_init(&prepared->pool, 1);
+	barena_init(&prepared->arena, &prepared->pool);
+	barena_init(&prepared->symtab.arena, &prepared->pool);
+
+	bool success;
+	if (is_rom_file(filename)) {
+		uint64_t hash;
+		success = read_rom_file(filename, &prepared->rom) && hash_file(filename, &hash);
+		if (success) {
+			load_sym_file(filename, &prepared->symtab);
+			add_input(&prepared->arena, &prepared->inputs, filename, hash);
+		}
+	} else if (
+		cache_enabled
+		&& load_cached_rom(filename, &prepared->rom, &prepared->symtab, &prepared->arena, &prepared->inputs)
+	) {
+		success = true;
+	} else {
+		// Only the inputs are kept from what the assembler allocates
+		barena_pool_t pool;
+		barena_t arena;
+		barena_pool_init(&pool, 1);
+		barena_init(&arena, &pool);
+		buxn_asm_ctx_t basm = {
+			.rom = &prepared->rom,
+			.arena = &arena,
+			.symtab = &prepared->symtab,
+		};
+		success = buxn_asm(&basm, filename);
+		for (const asm_input_t* input = basm.inputs; input != NULL; input = input->next) {
+			add_input(&prepared->arena, &prepared->inputs, input->filename, input->hash);
+		}
+		barena_reset(&arena);
+		barena_pool_cleanup(&pool);
+	}
+	trace_end("ubeat_asm_prepare", trace_start);
+
+	if (!success) {
+		ubeat_asm_free_prepared(prepared);
+		return NULL;
+	}
+	return prepared;
+}
+
+const rom_t*
+ubeat_prepared_rom(const ubeat_prepared_rom_t* prepared) {
+	return &prepared->rom;
+}
+
+bool
+ubeat_asm_reload_prepared(const ubeat_prepared_rom_t* prepared, rom_t* rom) {
+	if (entry_file == NULL) { return false; }
+
+	uint64_t trace_start = trace_begin();
+	// Anything which changed since has to be assembled again
+	for (const asm_input_t* input = prepared->inputs; input != NULL; input = input->next) {
+		uint64_t hash;
+		if (!hash_file(input->filename, &hash) || hash != input->hash) {
+			BLOG_DEBUG("%s has changed since the rom was prepared", input->filename);
+			trace_end("ubeat_asm_reload_prepared", trace_start);
+			return false;
+		}
+	}
+
+	symtab_storage_t* next_symtab = begin_reload();
+	for (int i = 0; i < prepared->symtab.public.num_symbols; ++i) {
+		symtab_add(next_symtab, prepared->symtab.symbols[i].addr, prepared->symtab.symbols[i].name);
+	}
+	watch_inputs(prepared->inputs);
+	rom->size = prepared->rom.size;
+	memcpy(rom->content, prepared->rom.content, prepared->rom.size);
+
+	finish_reload(next_symtab, true);
+	trace_end("ubeat_asm_reload_prepared", trace_start);
+
+	return true;
+}
+
+void
+ubeat_asm_free_prepared(ubeat_prepared_rom_t* prepared) {
+	if (prepared == NULL) { return; }
+
+	free(prepared->symtab.symbols);
+	barena_reset(&prepared->symtab.arena);
+	barena_reset(&prepared->arena);
+	barena_pool_cleanup(&prepared->pool);
+	free(prepared);
+}
+
 void
 ubeat_asm_cleanup(void) {
 	bhash_cleanup(&watch_tables[1]);
@@ -127,11 +721,37 @@ ubeat_asm_cleanup(void) {
 
 	bresmon_destroy(monitor);
 
+	for (int i = 0; i < 2; ++i) {
+		free(symtabs[i].symbols);
+		barena_reset(&symtabs[i].arena);
+	}
 	barena_reset(&arenas[1]);
 	barena_reset(&arenas[0]);
 	barena_pool_cleanup(&arena_pool);
 }
 
+const ubeat_symtab_t*
+ubeat_asm_symbols(void) {
+	return &current_symtab->public;
+}
+
+int
+ubeat_symtab_find(const ubeat_symtab_t* symtab, uint16_t addr) {
+	// Last symbol whose address is not greater than addr
+	int lo = 0;
+	int hi = symtab->num_symbols;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (symtab->symbols[mid].addr <= addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo - 1;
+}
+
 void*
 buxn_asm_alloc(buxn_asm_ctx_t* ctx, size_t size, size_t alignment) {
 	return barena_memalign(ctx->arena, size, alignment);
@@ -177,44 +797,54 @@ buxn_asm_put_rom(buxn_asm_ctx_t* ctx, uint16_t addr, uint8_t value) {
 
 void
 buxn_asm_put_symbol(buxn_asm_ctx_t* ctx, uint16_t addr, const buxn_asm_sym_t* sym) {
+	if (ctx->symtab == NULL) { return; }
+	if (sym->type != BUXN_ASM_SYM_LABEL || sym->name_is_generated) { return; }
+
+	symtab_add(ctx->symtab, addr, sym->name);
 }
 
 buxn_asm_file_t*
 buxn_asm_fopen(buxn_asm_ctx_t* ctx, const char* filename) {
 	FILE* file = fopen(filename, "rb");
-	if (file != NULL) {
-		bhash_alloc_result_t result = bhash_alloc(current_watch_table, (char*){ (char*)filename });
-		if (result.is_new) {
-			char* name_copy = arena_strdup(current_arena, filename);
-			current_watch_table->keys[result.index] = name_copy;
-
-			// Copy watch from the previous table or create a new one
-			watch_table_t* previous_watch_table = current_watch_table == &watch_tables[0] ? &watch_tables[1] : &watch_tables[0];
-			bhash_index_t previous_index = bhash_find(previous_watch_table, (char*){ (char*)filename });
-			if (bhash_is_valid(previous_index)) {
-				bresmon_watch_t* watch = previous_watch_table->values[previous_index];
-				bresmon_set_watch_callback(watch, ubeat_file_changed, name_copy);
-				current_watch_table->values[result.index] = watch;
-			} else {
-				BLOG_DEBUG("Watching %s", filename);
-				current_watch_table->values[result.index] = bresmon_watch(
-					monitor, filename, ubeat_file_changed, name_copy
-				);
-			}
+	if (file == NULL) { return NULL; }
+
+	asm_file_t* asm_file = barena_memalign(ctx->arena, sizeof(asm_file_t), _Alignof(asm_file_t));
+	asm_file->file = file;
+	asm_file->input = NULL;
+	if (ctx->symtab != NULL) {
+		if (ctx->watch) {
+			watch_file(filename);
 		}
+
+		add_input(ctx->arena, &ctx->inputs, filename, HASH_INIT);
+		asm_file->input = ctx->inputs;
 	}
 
-	return (void*)file;
+	return (void*)asm_file;
 }
 
 void
 buxn_asm_fclose(buxn_asm_ctx_t* ctx, buxn_asm_file_t* file) {
-	fclose((void*)file);
+	asm_file_t* asm_file = (void*)file;
+	// The cache compares whole files
+	if (asm_file->input != NULL) {
+		int ch;
+		while ((ch = fgetc(asm_file->file)) != EOF) {
+			uint8_t byte = (uint8_t)ch;
+			asm_file->input->hash = hash_bytes(asm_file->input->hash, &byte, 1);
+		}
+	}
+	fclose(asm_file->file);
 }
 
 int
 buxn_asm_fgetc(buxn_asm_ctx_t* ctx, buxn_asm_file_t* file) {
-	int result = fgetc((void*)file);
+	asm_file_t* asm_file = (void*)file;
+	int result = fgetc(asm_file->file);
+	if (result >= 0 && asm_file->input != NULL) {
+		uint8_t byte = (uint8_t)result;
+		asm_file->input->hash = hash_bytes(asm_file->input->hash, &byte, 1);
+	}
 	if (result == EOF) {
 		return BUXN_ASM_IO_EOF;
 	} else if (result < 0) {
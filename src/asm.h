@@ -10,9 +10,27 @@ typedef struct {
 	uint8_t content[UINT16_MAX + 1 - 256];
 } rom_t;
 
+typedef struct {
+	uint16_t addr;
+	const char* name;
+} ubeat_symbol_t;
+
+// Labels of the last successfully assembled rom, sorted by address
+typedef struct {
+	int version;
+	int num_symbols;
+	const ubeat_symbol_t* symbols;
+} ubeat_symtab_t;
+
 void
 ubeat_asm_init(void);
 
+// Assembled roms are cached in $XDG_CACHE_HOME/ubeat unless disabled.
+// Must be called before ubeat_asm_init.
+void
+ubeat_asm_set_cache_enabled(bool enabled);
+
+// Either a .tal file which is assembled or a prebuilt .rom
 void
 ubeat_asm_set_entry_file(const char* filename);
 
@@ -22,7 +40,38 @@ ubeat_asm_should_reload(void);
 bool
 ubeat_asm_reload(rom_t* rom);
 
+// A rom built ahead along with its symbols and the hash of every input
+typedef struct ubeat_prepared_rom_s ubeat_prepared_rom_t;
+
+// Build a rom without watching its inputs or replacing the current symbols.
+// Roms are read from the cache but never written to it.
+// Unlike the other functions, this can be called from any thread.
+// Returns NULL on failure.
+ubeat_prepared_rom_t*
+ubeat_asm_prepare(const char* filename);
+
+const rom_t*
+ubeat_prepared_rom(const ubeat_prepared_rom_t* prepared);
+
+// Make a rom prepared from the entry file the current one without assembling
+// it again.
+// Fails without changing anything when one of its inputs changed since, in
+// which case ubeat_asm_reload should be used instead.
+bool
+ubeat_asm_reload_prepared(const ubeat_prepared_rom_t* prepared, rom_t* rom);
+
+void
+ubeat_asm_free_prepared(ubeat_prepared_rom_t* prepared);
+
 void
 ubeat_asm_cleanup(void);
 
+const ubeat_symtab_t*
+ubeat_asm_symbols(void);
+
+// Find the label containing the given address.
+// Returns -1 if the address is before the first label.
+int
+ubeat_symtab_find(const ubeat_symtab_t* symtab, uint16_t addr);
+
 #endif
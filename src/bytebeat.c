@@ -2,19 +2,24 @@
 
 uint8_t
 bytebeat_dei(buxn_vm_t* vm, bytebeat_t* device, uint8_t address) {
+	bytebeat_voice_t* voice = bytebeat_current_voice(device);
 	switch (address) {
 		case BYTEBEAT_VECTOR:
-			return (uint8_t)(device->vector >> 8);
+			return (uint8_t)(voice->vector >> 8);
 		case BYTEBEAT_VECTOR + 1:
-			return (uint8_t)(device->vector & 0xff);
+			return (uint8_t)(voice->vector & 0xff);
 		case BYTEBEAT_T:
-			return (uint8_t)(device->t >> 8);
+			return (uint8_t)(voice->t >> 8);
 		case BYTEBEAT_T + 1:
-			return (uint8_t)(device->t & 0xff);
+			return (uint8_t)(voice->t & 0xff);
 		case BYTEBEAT_V:
-			return (uint8_t)(device->v >> 8);
+			return (uint8_t)(voice->v >> 8);
 		case BYTEBEAT_V + 1:
-			return (uint8_t)(device->v & 0xff);
+			return (uint8_t)(voice->v & 0xff);
+		case BYTEBEAT_VOICE:
+			return device->voice;
+		case BYTEBEAT_GAIN:
+			return voice->gain;
 		default:
 			return vm->device[address];
 	}
@@ -22,18 +27,30 @@ bytebeat_dei(buxn_vm_t* vm, bytebeat_t* device, uint8_t address) {
 
 void
 bytebeat_deo(buxn_vm_t* vm, bytebeat_t* device, uint8_t address) {
+	bytebeat_voice_t* voice = bytebeat_current_voice(device);
 	switch (address) {
 		case BYTEBEAT_VECTOR:
-			device->vector = buxn_vm_dev_load2(vm, BYTEBEAT_VECTOR);
-			device->sync_bits |= BYTEBEAT_SYNC_VECTOR;
+			voice->vector = buxn_vm_dev_load2(vm, BYTEBEAT_VECTOR);
+			voice->sync_bits |= BYTEBEAT_SYNC_VECTOR;
 			break;
 		case BYTEBEAT_T:
-			device->t = buxn_vm_dev_load2(vm, BYTEBEAT_T);
-			device->sync_bits |= BYTEBEAT_SYNC_T;
+			voice->t = buxn_vm_dev_load2(vm, BYTEBEAT_T);
+			voice->sync_bits |= BYTEBEAT_SYNC_T;
 			break;
 		case BYTEBEAT_V:
-			device->v = buxn_vm_dev_load2(vm, BYTEBEAT_V);
-			device->sync_bits |= BYTEBEAT_SYNC_V;
+			voice->v = buxn_vm_dev_load2(vm, BYTEBEAT_V);
+			voice->sync_bits |= BYTEBEAT_SYNC_V;
+			break;
+		case BYTEBEAT_OPTIONS:
+			device->options = buxn_vm_dev_load(vm, BYTEBEAT_OPTIONS);
+			device->sync_bits |= BYTEBEAT_SYNC_OPTIONS;
+			break;
+		case BYTEBEAT_VOICE:
+			device->voice = buxn_vm_dev_load(vm, BYTEBEAT_VOICE) % BYTEBEAT_MAX_VOICES;
+			break;
+		case BYTEBEAT_GAIN:
+			voice->gain = buxn_vm_dev_load(vm, BYTEBEAT_GAIN);
+			voice->sync_bits |= BYTEBEAT_SYNC_GAIN;
 			break;
 	}
 }
@@ -2,6 +2,7 @@
 #define UBEAT_BYTEBEAT_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <buxn/vm/vm.h>
 #include <buxn/jit.h>
 
@@ -9,26 +10,49 @@
 #define BYTEBEAT_T 0xd2
 #define BYTEBEAT_V 0xd4
 #define BYTEBEAT_OPTIONS 0xd6
+#define BYTEBEAT_VOICE 0xd7
+#define BYTEBEAT_GAIN 0xd8
+
+#define BYTEBEAT_MAX_VOICES 4
 
 enum {
 	BYTEBEAT_SYNC_VECTOR = 1 << 0,
 	BYTEBEAT_SYNC_T      = 1 << 1,
 	BYTEBEAT_SYNC_V      = 1 << 2,
+	BYTEBEAT_SYNC_GAIN   = 1 << 3,
+	BYTEBEAT_SYNC_OPTIONS = 1 << 4,
 };
 
 enum {
 	BYTEBEAT_OPTS_SHOW_WAVEFORM  = 1 << 0,
 	BYTEBEAT_OPTS_SHOW_FFT       = 1 << 1,
+	BYTEBEAT_OPTS_16_BIT         = 1 << 2,
+	BYTEBEAT_OPTS_STEREO         = 1 << 3,
+	BYTEBEAT_OPTS_SPECIALIZE_ZP  = 1 << 4,
 };
 
 typedef struct {
 	uint16_t vector;
 	uint16_t t;
 	uint16_t v;
+	uint8_t gain;
 
 	uint8_t sync_bits;
+} bytebeat_voice_t;
+
+typedef struct {
+	bytebeat_voice_t voices[BYTEBEAT_MAX_VOICES];
+	uint8_t voice;
+	uint8_t options;
+
+	uint8_t sync_bits;  // For ports which are shared between voices
 } bytebeat_t;
 
+typedef struct {
+	int16_t left;
+	int16_t right;
+} bytebeat_frame_t;
+
 uint8_t
 bytebeat_dei(buxn_vm_t* vm, bytebeat_t* device, uint8_t address);
 
@@ -37,7 +61,31 @@ bytebeat_deo(buxn_vm_t* vm, bytebeat_t* device, uint8_t address);
 
 static inline void
 bytebeat_init(bytebeat_t* device) {
-	*device = (bytebeat_t){ .v = 1 };
+	*device = (bytebeat_t){ 0 };
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		device->voices[i] = (bytebeat_voice_t){ .v = 1, .gain = 0xff };
+	}
+}
+
+static inline bytebeat_voice_t*
+bytebeat_current_voice(bytebeat_t* device) {
+	return &device->voices[device->voice % BYTEBEAT_MAX_VOICES];
+}
+
+static inline uint8_t
+bytebeat_sync_bits(bytebeat_t* device) {
+	uint8_t sync_bits = device->sync_bits;
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		sync_bits |= device->voices[i].sync_bits;
+	}
+	return sync_bits;
+}
+
+static inline bool
+bytebeat_voice_is_active(const bytebeat_t* device, int index) {
+	const bytebeat_voice_t* voice = &device->voices[index];
+	// The first voice is always rendered, as it was before voices existed
+	return index == 0 || (voice->vector != 0 && voice->gain != 0);
 }
 
 static inline uint8_t
@@ -45,20 +93,47 @@ bytebeat_options(buxn_vm_t* vm) {
 	return buxn_vm_dev_load(vm, BYTEBEAT_OPTIONS);
 }
 
-static inline uint8_t
+// Convert the top of the stack after the vector into a frame.
+// Samples are always returned as signed 16-bit stereo.
+// 8-bit samples are unsigned and centered around 0x80.
+static inline bytebeat_frame_t
+bytebeat_make_frame(uint8_t options, uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3) {
+	bytebeat_frame_t frame;
+	if (options & BYTEBEAT_OPTS_16_BIT) {
+		frame.left = (int16_t)(b0 << 8 | b1);
+		frame.right = (options & BYTEBEAT_OPTS_STEREO)
+			? (int16_t)(b2 << 8 | b3)
+			: frame.left;
+	} else {
+		frame.left = (int16_t)((b0 - 0x80) * 256);
+		frame.right = (options & BYTEBEAT_OPTS_STEREO)
+			? (int16_t)((b1 - 0x80) * 256)
+			: frame.left;
+	}
+	return frame;
+}
+
+static inline bytebeat_frame_t
 bytebeat_render(
 	buxn_vm_t* vm,
 	buxn_jit_t* jit,
-	bytebeat_t* device,
+	bytebeat_voice_t* voice,
+	uint8_t options,
 	uint16_t t
 ) {
 	vm->wsp = 2;
 	vm->ws[0] = t >> 8;
 	vm->ws[1] = t & 0xff;
-	device->t = t;
-	buxn_jit_execute(jit, device->vector);
+	voice->t = t;
+	// Without compiled code, the vector is interpreted
+	if (jit != NULL) {
+		buxn_jit_execute(jit, voice->vector);
+	} else {
+		buxn_vm_execute(vm, voice->vector);
+	}
 	vm->wsp = 0;
-	return vm->ws[0];
+
+	return bytebeat_make_frame(options, vm->ws[0], vm->ws[1], vm->ws[2], vm->ws[3]);
 }
 
 #endif
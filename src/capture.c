@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include "capture.h"
+#include <blog.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// About 16 seconds of stereo audio at 8kHz
+#define CAPTURE_RING_SIZE (1 << 20)
+#define CAPTURE_CHUNK_FRAMES 8192
+#define CAPTURE_POLL_INTERVAL_NS (20 * 1000 * 1000)
+#define CAPTURE_WAV_HEADER_SIZE 44
+
+static void
+capture_put_u16(uint8_t* ptr, uint16_t value) {
+	ptr[0] = (uint8_t)(value & 0xff);
+	ptr[1] = (uint8_t)(value >> 8);
+}
+
+static void
+capture_put_u32(uint8_t* ptr, uint32_t value) {
+	capture_put_u16(ptr, (uint16_t)(value & 0xffff));
+	capture_put_u16(ptr + 2, (uint16_t)(value >> 16));
+}
+
+static void
+capture_write_header(capture_t* capture) {
+	uint32_t data_size = (uint32_t)(capture->num_frames_written * capture->num_channels * 2);
+	uint8_t header[CAPTURE_WAV_HEADER_SIZE];
+	memcpy(header + 0, "RIFF", 4);
+	capture_put_u32(header + 4, 36 + data_size);
+	memcpy(header + 8, "WAVE", 4);
+	memcpy(header + 12, "fmt ", 4);
+	capture_put_u32(header + 16, 16);
+	capture_put_u16(header + 20, 1);  // PCM
+	capture_put_u16(header + 22, (uint16_t)capture->num_channels);
+	capture_put_u32(header + 24, (uint32_t)capture->sample_rate);
+	capture_put_u32(header + 28, (uint32_t)(capture->sample_rate * capture->num_channels * 2));
+	capture_put_u16(header + 32, (uint16_t)(capture->num_channels * 2));
+	capture_put_u16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	capture_put_u32(header + 40, data_size);
+
+	fseek(capture->file, 0, SEEK_SET);
+	fwrite(header, sizeof(header), 1, capture->file);
+	fseek(capture->file, 0, SEEK_END);
+}
+
+static void*
+capture_entry(void* userdata) {
+	capture_t* capture = userdata;
+	size_t frame_size = sizeof(float) * capture->num_channels;
+	float* samples = malloc(frame_size * CAPTURE_CHUNK_FRAMES);
+	int16_t* pcm = malloc(sizeof(int16_t) * capture->num_channels * CAPTURE_CHUNK_FRAMES);
+
+	while (true) {
+		// Check before reading so that everything is drained when stopping
+		bool stopping = !atomic_load_explicit(&capture->running, memory_order_acquire);
+
+		// Blocks are always whole frames so this never splits one
+		size_t size = ring_read(&capture->ring, samples, frame_size * CAPTURE_CHUNK_FRAMES);
+		size_t num_samples = size / sizeof(float);
+		for (size_t i = 0; i < num_samples; ++i) {
+			float sample = samples[i];
+			sample = sample > 1.f ? 1.f : sample;
+			sample = sample < -1.f ? -1.f : sample;
+			pcm[i] = (int16_t)(sample * 32767.f);
+		}
+		if (num_samples > 0) {
+			fwrite(pcm, sizeof(int16_t), num_samples, capture->file);
+			capture->num_frames_written += num_samples / capture->num_channels;
+		}
+
+		if (size == 0) {
+			if (stopping) { break; }
+			nanosleep(&(struct timespec){ .tv_nsec = CAPTURE_POLL_INTERVAL_NS }, NULL);
+		}
+	}
+
+	free(pcm);
+	free(samples);
+	return NULL;
+}
+
+void
+capture_init(capture_t* capture, int sample_rate) {
+	*capture = (capture_t){ .sample_rate = sample_rate };
+	capture->storage = malloc(CAPTURE_RING_SIZE);
+}
+
+void
+capture_cleanup(capture_t* capture) {
+	capture_stop(capture);
+	free(capture->storage);
+}
+
+bool
+capture_start(capture_t* capture, const char* path, int num_channels) {
+	if (capture_is_recording(capture) || capture->storage == NULL) { return false; }
+
+	capture->file = fopen(path, "wb");
+	if (capture->file == NULL) {
+		BLOG_ERROR("Could not open %s", path);
+		return false;
+	}
+
+	capture->num_channels = num_channels;
+	capture->num_frames_written = 0;
+	capture_write_header(capture);
+
+	// Fault in the ring here instead of in the audio thread
+	memset(capture->storage, 0, CAPTURE_RING_SIZE);
+	ring_init(&capture->ring, capture->storage, CAPTURE_RING_SIZE);
+	atomic_store_explicit(&capture->num_dropped_blocks, 0, memory_order_relaxed);
+	atomic_store_explicit(&capture->running, true, memory_order_relaxed);
+
+	if (pthread_create(&capture->thread, NULL, capture_entry, capture) != 0) {
+		BLOG_ERROR("Could not start the capture thread");
+		fclose(capture->file);
+		capture->file = NULL;
+		return false;
+	}
+	pthread_setname_np(capture->thread, "ubeat.capture");
+
+	atomic_store_explicit(&capture->recording, true, memory_order_release);
+	BLOG_INFO("Recording to %s", path);
+	return true;
+}
+
+void
+capture_stop(capture_t* capture) {
+	if (!capture_is_recording(capture)) { return; }
+
+	atomic_store_explicit(&capture->recording, false, memory_order_relaxed);
+	atomic_store_explicit(&capture->running, false, memory_order_release);
+	pthread_join(capture->thread, NULL);
+
+	capture_write_header(capture);
+	fclose(capture->file);
+	capture->file = NULL;
+
+	unsigned num_dropped_blocks = capture_num_dropped_blocks(capture);
+	if (num_dropped_blocks > 0) {
+		BLOG_WARN(
+			"Recorded %.1f seconds, %u blocks were dropped",
+			(double)capture->num_frames_written / (double)capture->sample_rate,
+			num_dropped_blocks
+		);
+	} else {
+		BLOG_INFO(
+			"Recorded %.1f seconds",
+			(double)capture->num_frames_written / (double)capture->sample_rate
+		);
+	}
+}
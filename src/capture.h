@@ -0,0 +1,63 @@
+#ifndef UBEAT_CAPTURE_H
+#define UBEAT_CAPTURE_H
+
+// Record the audio output to a WAV file.
+// The audio thread only copies blocks into a ring.
+// A writer thread converts them to 16-bit PCM and writes them to disk.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "ring.h"
+
+typedef struct {
+	ring_t ring;
+	void* storage;
+	int sample_rate;
+	int num_channels;
+
+	atomic_bool recording;
+	atomic_bool running;
+	atomic_uint num_dropped_blocks;
+
+	pthread_t thread;
+	FILE* file;
+	uint64_t num_frames_written;
+} capture_t;
+
+void
+capture_init(capture_t* capture, int sample_rate);
+
+void
+capture_cleanup(capture_t* capture);
+
+bool
+capture_start(capture_t* capture, const char* path, int num_channels);
+
+void
+capture_stop(capture_t* capture);
+
+static inline bool
+capture_is_recording(capture_t* capture) {
+	return atomic_load_explicit(&capture->recording, memory_order_relaxed);
+}
+
+static inline unsigned
+capture_num_dropped_blocks(capture_t* capture) {
+	return atomic_load_explicit(&capture->num_dropped_blocks, memory_order_relaxed);
+}
+
+// Called from the audio thread with interleaved samples
+static inline void
+capture_write(capture_t* capture, const float* samples, int num_frames, int num_channels) {
+	if (!atomic_load_explicit(&capture->recording, memory_order_acquire)) { return; }
+	if (num_channels != capture->num_channels) { return; }
+
+	if (!ring_write(&capture->ring, samples, sizeof(float) * num_frames * num_channels)) {
+		atomic_fetch_add_explicit(&capture->num_dropped_blocks, 1, memory_order_relaxed);
+	}
+}
+
+#endif
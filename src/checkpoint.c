@@ -0,0 +1,135 @@
+#include "checkpoint.h"
+#include <string.h>
+
+static checkpoint_t*
+checkpoints_at(checkpoints_t* checkpoints, int index) {
+	return &checkpoints->checkpoints[(checkpoints->first + index) % CHECKPOINT_MAX];
+}
+
+static void
+checkpoints_release(checkpoints_t* checkpoints, const checkpoint_t* checkpoint) {
+	for (int i = 1; i < CHECKPOINT_NUM_PAGES; ++i) {
+		uint16_t page = checkpoint->pages[i];
+		if (--checkpoints->ref_counts[page] == 0) {
+			checkpoints->free_pages[checkpoints->num_free_pages++] = page;
+		}
+	}
+}
+
+static void
+checkpoints_evict_oldest(checkpoints_t* checkpoints) {
+	checkpoints_release(checkpoints, checkpoints_at(checkpoints, 0));
+	checkpoints->first = (checkpoints->first + 1) % CHECKPOINT_MAX;
+	checkpoints->count -= 1;
+}
+
+void
+checkpoints_init(checkpoints_t* checkpoints) {
+	checkpoints->first = 0;
+	checkpoints->count = 0;
+	checkpoints->is_stateful = false;
+	checkpoints->num_free_pages = CHECKPOINT_POOL_SIZE;
+	for (int i = 0; i < CHECKPOINT_POOL_SIZE; ++i) {
+		checkpoints->free_pages[i] = (uint16_t)(CHECKPOINT_POOL_SIZE - 1 - i);
+		checkpoints->ref_counts[i] = 0;
+	}
+}
+
+void
+checkpoints_clear(checkpoints_t* checkpoints) {
+	while (checkpoints->count > 0) {
+		checkpoints_evict_oldest(checkpoints);
+	}
+	checkpoints->first = 0;
+	checkpoints->is_stateful = false;
+}
+
+static void
+checkpoints_take(checkpoints_t* checkpoints, const buxn_vm_t* vm, const bytebeat_voice_t* voice) {
+	// Make room for a full copy so taking a checkpoint never fails
+	while (
+		checkpoints->count == CHECKPOINT_MAX
+		|| (checkpoints->count > 0 && checkpoints->num_free_pages < CHECKPOINT_NUM_PAGES - 1)
+	) {
+		checkpoints_evict_oldest(checkpoints);
+	}
+
+	const checkpoint_t* previous = checkpoints->count > 0
+		? checkpoints_at(checkpoints, checkpoints->count - 1)
+		: NULL;
+	checkpoint_t* checkpoint = checkpoints_at(checkpoints, checkpoints->count);
+	checkpoint->t = voice->t;
+	checkpoint->v = voice->v;
+	checkpoint->wsp = vm->wsp;
+	checkpoint->rsp = vm->rsp;
+	memcpy(checkpoint->ws, vm->ws, sizeof(checkpoint->ws));
+	memcpy(checkpoint->rs, vm->rs, sizeof(checkpoint->rs));
+
+	int num_changed_pages = 0;
+	for (int i = 1; i < CHECKPOINT_NUM_PAGES; ++i) {
+		const uint8_t* memory = vm->memory + i * CHECKPOINT_PAGE_SIZE;
+		if (
+			previous != NULL
+			&& memcmp(checkpoints->pool[previous->pages[i]], memory, CHECKPOINT_PAGE_SIZE) == 0
+		) {
+			checkpoint->pages[i] = previous->pages[i];
+			checkpoints->ref_counts[previous->pages[i]] += 1;
+		} else {
+			uint16_t page = checkpoints->free_pages[--checkpoints->num_free_pages];
+			memcpy(checkpoints->pool[page], memory, CHECKPOINT_PAGE_SIZE);
+			checkpoints->ref_counts[page] = 1;
+			checkpoint->pages[i] = page;
+			++num_changed_pages;
+		}
+	}
+
+	if (previous != NULL && num_changed_pages > 0) {
+		checkpoints->is_stateful = true;
+	}
+	checkpoints->count += 1;
+}
+
+void
+checkpoints_update(checkpoints_t* checkpoints, const buxn_vm_t* vm, const bytebeat_voice_t* voice) {
+	// History is only meaningful in the direction the vector was written for
+	if (voice->v == 0 || voice->v >= 0x8000) { return; }
+
+	// Not only the newest: after seeking back it lies ahead of t
+	if (checkpoints_find(checkpoints, voice->t, CHECKPOINT_INTERVAL - 1) != NULL) { return; }
+
+	checkpoints_take(checkpoints, vm, voice);
+}
+
+const checkpoint_t*
+checkpoints_find(const checkpoints_t* checkpoints, uint16_t t, uint16_t max_distance) {
+	const checkpoint_t* nearest = NULL;
+	uint16_t nearest_distance = 0;
+	// Newest first so it is preferred when several were taken at the same t
+	for (int i = checkpoints->count - 1; i >= 0; --i) {
+		const checkpoint_t* checkpoint = &checkpoints->checkpoints[
+			(checkpoints->first + i) % CHECKPOINT_MAX
+		];
+		uint16_t distance = (uint16_t)(t - checkpoint->t);
+		if (distance <= max_distance && (nearest == NULL || distance < nearest_distance)) {
+			nearest = checkpoint;
+			nearest_distance = distance;
+		}
+	}
+
+	return nearest;
+}
+
+void
+checkpoints_restore(const checkpoints_t* checkpoints, const checkpoint_t* checkpoint, buxn_vm_t* vm) {
+	vm->wsp = checkpoint->wsp;
+	vm->rsp = checkpoint->rsp;
+	memcpy(vm->ws, checkpoint->ws, sizeof(checkpoint->ws));
+	memcpy(vm->rs, checkpoint->rs, sizeof(checkpoint->rs));
+	for (int i = 1; i < CHECKPOINT_NUM_PAGES; ++i) {
+		memcpy(
+			vm->memory + i * CHECKPOINT_PAGE_SIZE,
+			checkpoints->pool[checkpoint->pages[i]],
+			CHECKPOINT_PAGE_SIZE
+		);
+	}
+}
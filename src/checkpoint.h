@@ -0,0 +1,73 @@
+#ifndef UBEAT_CHECKPOINT_H
+#define UBEAT_CHECKPOINT_H
+
+// Snapshots of a voice VM taken while it plays forward, keyed by t.
+// A vector which keeps state in memory only sounds right when it sees t in
+// order, so seeking and reverse playback restore the nearest earlier
+// snapshot and render forward from there.
+//
+// Memory is split into pages which are shared between consecutive snapshots
+// when they did not change.
+// All storage is allocated up front so snapshots can be taken on the audio
+// threads. When it runs out, the oldest snapshots are dropped.
+//
+// The zero page is not saved as it is owned by the main thread.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <buxn/vm/vm.h>
+#include "bytebeat.h"
+
+#define CHECKPOINT_PAGE_SIZE 256
+#define CHECKPOINT_NUM_PAGES (BUXN_MEMORY_BANK_SIZE / CHECKPOINT_PAGE_SIZE)
+// Enough to cover every value of t at the default interval
+#define CHECKPOINT_MAX 64
+#define CHECKPOINT_INTERVAL 1024
+#define CHECKPOINT_POOL_SIZE 2048
+
+typedef struct {
+	uint16_t t;
+	uint16_t v;
+	uint8_t wsp;
+	uint8_t rsp;
+	uint8_t ws[256];
+	uint8_t rs[256];
+	uint16_t pages[CHECKPOINT_NUM_PAGES];  // Indices into the pool
+} checkpoint_t;
+
+typedef struct {
+	int first;
+	int count;
+	// Set once memory was seen changing between two checkpoints
+	bool is_stateful;
+
+	checkpoint_t checkpoints[CHECKPOINT_MAX];
+
+	int num_free_pages;
+	uint16_t free_pages[CHECKPOINT_POOL_SIZE];
+	uint16_t ref_counts[CHECKPOINT_POOL_SIZE];
+	uint8_t pool[CHECKPOINT_POOL_SIZE][CHECKPOINT_PAGE_SIZE];
+} checkpoints_t;
+
+void
+checkpoints_init(checkpoints_t* checkpoints);
+
+// Drop all checkpoints.
+// Must be called whenever the memory of the VM is replaced or patched.
+void
+checkpoints_clear(checkpoints_t* checkpoints);
+
+// Take a checkpoint if the voice is playing forward and there is none in the
+// CHECKPOINT_INTERVAL values of t before it
+void
+checkpoints_update(checkpoints_t* checkpoints, const buxn_vm_t* vm, const bytebeat_voice_t* voice);
+
+// The checkpoint closest to t which is at most max_distance before it.
+// Returns NULL if there is none.
+const checkpoint_t*
+checkpoints_find(const checkpoints_t* checkpoints, uint16_t t, uint16_t max_distance);
+
+void
+checkpoints_restore(const checkpoints_t* checkpoints, const checkpoint_t* checkpoint, buxn_vm_t* vm);
+
+#endif
@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+#include "control.h"
+#include <blog.h>
+#include <sokol_time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bytebeat.h"
+#include "trace.h"
+
+#define CONTROL_MAX_PACKET_SIZE 8192
+#define CONTROL_MAX_BUNDLE_DEPTH 4
+#define CONTROL_POLL_TIMEOUT_MS 100
+
+static const struct {
+	const char* address;
+	control_target_t target;
+} control_addresses[] = {
+	{ "/zp", CONTROL_WRITE_ZERO_PAGE },
+	{ "/bytebeat/t", CONTROL_WRITE_T },
+	{ "/bytebeat/v", CONTROL_WRITE_V },
+	{ "/bytebeat/vector", CONTROL_WRITE_VECTOR },
+	{ "/bytebeat/gain", CONTROL_WRITE_GAIN },
+};
+
+// OSC strings are null terminated and padded to 4 bytes
+static bool
+control_read_string(const uint8_t** cursor, const uint8_t* end, const char** string) {
+	const uint8_t* start = *cursor;
+	const uint8_t* terminator = memchr(start, 0, end - start);
+	if (terminator == NULL) { return false; }
+
+	size_t padded_size = ((size_t)(terminator - start) + 4) & ~(size_t)3;
+	if (padded_size > (size_t)(end - start)) { return false; }
+
+	*string = (const char*)start;
+	*cursor = start + padded_size;
+	return true;
+}
+
+static bool
+control_read_i32(const uint8_t** cursor, const uint8_t* end, int32_t* value) {
+	if (end - *cursor < 4) { return false; }
+
+	const uint8_t* bytes = *cursor;
+	*value = (int32_t)((uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3]);
+	*cursor += 4;
+	return true;
+}
+
+static void
+control_push(control_t* control, const control_write_t* write) {
+	// Drops are counted by the rings
+	ring_write(&control->audio_ring, write, sizeof(*write));
+	ring_write(&control->main_ring, write, sizeof(*write));
+}
+
+static bool
+control_parse_message(control_t* control, const uint8_t* data, size_t size, uint64_t timestamp) {
+	const uint8_t* cursor = data;
+	const uint8_t* end = data + size;
+
+	const char* address;
+	const char* types;
+	if (!control_read_string(&cursor, end, &address)) { return false; }
+	if (!control_read_string(&cursor, end, &types) || types[0] != ',') { return false; }
+
+	int num_args = (int)strlen(types + 1);
+	if (num_args == 0 || num_args % 2 != 0) { return false; }
+	for (int i = 1; i <= num_args; ++i) {
+		if (types[i] != 'i') { return false; }
+	}
+
+	int num_addresses = sizeof(control_addresses) / sizeof(control_addresses[0]);
+	int index = 0;
+	while (index < num_addresses && strcmp(control_addresses[index].address, address) != 0) {
+		++index;
+	}
+	if (index == num_addresses) { return false; }
+	control_target_t target = control_addresses[index].target;
+
+	// Validate everything before queuing anything so a batch is applied
+	// entirely or not at all
+	const uint8_t* args = cursor;
+	for (int i = 0; i < num_args; i += 2) {
+		int32_t key, value;
+		control_read_i32(&cursor, end, &key);
+		if (!control_read_i32(&cursor, end, &value)) { return false; }
+
+		if (target == CONTROL_WRITE_ZERO_PAGE) {
+			if (key < 0 || key > 0xff || value < 0 || value > 0xff) { return false; }
+		} else {
+			if (key < 0 || key >= BYTEBEAT_MAX_VOICES || value < 0 || value > 0xffff) { return false; }
+			if (target == CONTROL_WRITE_GAIN && value > 0xff) { return false; }
+		}
+	}
+
+	cursor = args;
+	for (int i = 0; i < num_args; i += 2) {
+		int32_t key, value;
+		control_read_i32(&cursor, end, &key);
+		control_read_i32(&cursor, end, &value);
+
+		control_write_t write = {
+			.timestamp = timestamp,
+			.target = (uint8_t)target,
+			.value = (uint16_t)value,
+		};
+		if (target == CONTROL_WRITE_ZERO_PAGE) {
+			write.address = (uint8_t)key;
+		} else {
+			write.voice = (uint8_t)key;
+		}
+		control_push(control, &write);
+	}
+
+	return true;
+}
+
+static bool
+control_parse_packet(control_t* control, const uint8_t* data, size_t size, uint64_t timestamp, int depth) {
+	if (size < 8 || memcmp(data, "#bundle", 8) != 0) {
+		return control_parse_message(control, data, size, timestamp);
+	}
+
+	if (depth >= CONTROL_MAX_BUNDLE_DEPTH || size < 16) { return false; }
+
+	// Skip the header and the time tag
+	const uint8_t* cursor = data + 16;
+	const uint8_t* end = data + size;
+	while (cursor < end) {
+		int32_t element_size;
+		if (!control_read_i32(&cursor, end, &element_size)) { return false; }
+		if (element_size < 0 || element_size > end - cursor) { return false; }
+
+		if (!control_parse_packet(control, cursor, (size_t)element_size, timestamp, depth + 1)) {
+			return false;
+		}
+		cursor += element_size;
+	}
+
+	return true;
+}
+
+static void*
+control_entry(void* userdata) {
+	control_t* control = userdata;
+	trace_set_thread_name("control");
+
+	uint8_t packet[CONTROL_MAX_PACKET_SIZE];
+	while (atomic_load_explicit(&control->running, memory_order_relaxed)) {
+		struct pollfd poll_fd = { .fd = control->fd, .events = POLLIN };
+		if (poll(&poll_fd, 1, CONTROL_POLL_TIMEOUT_MS) <= 0) { continue; }
+
+		ssize_t size = recv(control->fd, packet, sizeof(packet), 0);
+		if (size <= 0) { continue; }
+
+		uint64_t timestamp = stm_now();
+		if (!control_parse_packet(control, packet, (size_t)size, timestamp, 0)) {
+			atomic_fetch_add_explicit(&control->num_invalid_packets, 1, memory_order_relaxed);
+		}
+	}
+
+	return NULL;
+}
+
+static bool
+control_is_port(const char* endpoint) {
+	if (*endpoint == '\0') { return false; }
+	for (const char* ch = endpoint; *ch != '\0'; ++ch) {
+		if (!isdigit((unsigned char)*ch)) { return false; }
+	}
+	return true;
+}
+
+static int
+control_open_udp(const char* endpoint) {
+	long port = strtol(endpoint, NULL, 10);
+	if (port <= 0 || port > 65535) {
+		BLOG_ERROR("Invalid control port: %s", endpoint);
+		return -1;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		BLOG_ERROR("Could not create a socket: %s", strerror(errno));
+		return -1;
+	}
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons((uint16_t)port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		BLOG_ERROR("Could not listen on port %ld: %s", port, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+control_open_unix(const char* path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		BLOG_ERROR("Control socket path is too long: %s", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		BLOG_ERROR("Could not create a socket: %s", strerror(errno));
+		return -1;
+	}
+
+	// Left over from a previous run
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		BLOG_ERROR("Could not listen on %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+bool
+control_start(control_t* control, const char* endpoint) {
+	ring_init(&control->audio_ring, control->audio_storage, CONTROL_RING_SIZE);
+	ring_init(&control->main_ring, control->main_storage, CONTROL_RING_SIZE);
+	atomic_store(&control->num_invalid_packets, 0);
+
+	bool is_port = control_is_port(endpoint);
+	control->path = is_port ? NULL : endpoint;
+	control->fd = is_port ? control_open_udp(endpoint) : control_open_unix(endpoint);
+	if (control->fd < 0) { return false; }
+
+	atomic_store(&control->running, true);
+	if (pthread_create(&control->thread, NULL, control_entry, control) != 0) {
+		BLOG_ERROR("Could not start the control thread");
+		atomic_store(&control->running, false);
+		close(control->fd);
+		return false;
+	}
+	pthread_setname_np(control->thread, "ubeat.control");
+
+	BLOG_INFO("Listening for control messages on %s", endpoint);
+	return true;
+}
+
+void
+control_stop(control_t* control) {
+	if (!control_is_running(control)) { return; }
+
+	atomic_store(&control->running, false);
+	pthread_join(control->thread, NULL);
+	close(control->fd);
+	if (control->path != NULL) {
+		unlink(control->path);
+	}
+}
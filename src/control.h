@@ -0,0 +1,81 @@
+#ifndef UBEAT_CONTROL_H
+#define UBEAT_CONTROL_H
+
+// A socket which accepts OSC messages writing to Bytebeat ports and the zero
+// page, so an external sequencer can drive a tune.
+//
+// Messages (all arguments are int32, several pairs can be sent at once):
+//
+// * `/zp address value ...`
+// * `/bytebeat/t voice value ...`
+// * `/bytebeat/v voice value ...`
+// * `/bytebeat/vector voice value ...`
+// * `/bytebeat/gain voice value ...`
+//
+// Bundles are accepted but their time tags are ignored.
+//
+// A listener thread timestamps each write and queues it for both the audio
+// thread, which applies it without waiting for the main thread, and the main
+// thread, which keeps its VM in agreement.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "ring.h"
+
+#define CONTROL_RING_SIZE 16384
+
+typedef enum {
+	CONTROL_WRITE_ZERO_PAGE,
+	CONTROL_WRITE_T,
+	CONTROL_WRITE_V,
+	CONTROL_WRITE_VECTOR,
+	CONTROL_WRITE_GAIN,
+} control_target_t;
+
+typedef struct {
+	uint64_t timestamp;  // stm ticks when the packet was received
+	uint16_t value;
+	uint8_t target;
+	uint8_t voice;
+	uint8_t address;  // In the zero page
+} control_write_t;
+
+typedef struct {
+	int fd;
+	const char* path;  // Of a Unix socket, removed on stop
+	pthread_t thread;
+	atomic_bool running;
+	atomic_uint num_invalid_packets;
+
+	ring_t audio_ring;
+	ring_t main_ring;
+	uint8_t audio_storage[CONTROL_RING_SIZE];
+	uint8_t main_storage[CONTROL_RING_SIZE];
+} control_t;
+
+// The endpoint is either a UDP port on the loopback interface or the path of
+// a Unix datagram socket
+bool
+control_start(control_t* control, const char* endpoint);
+
+void
+control_stop(control_t* control);
+
+static inline bool
+control_is_running(control_t* control) {
+	return atomic_load_explicit(&control->running, memory_order_relaxed);
+}
+
+static inline bool
+control_read(ring_t* ring, control_write_t* write) {
+	return ring_read(ring, write, sizeof(*write)) == sizeof(*write);
+}
+
+static inline unsigned
+control_num_invalid_packets(control_t* control) {
+	return atomic_load_explicit(&control->num_invalid_packets, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,272 @@
+#include "fx.h"
+#include <math.h>
+#include <string.h>
+
+#define FX_PI 3.14159265358979323846f
+
+static inline fx_params_t*
+fx_current_slot(fx_t* device) {
+	return &device->slots[device->slot % FX_MAX_SLOTS];
+}
+
+uint8_t
+fx_dei(buxn_vm_t* vm, fx_t* device, uint8_t address) {
+	fx_params_t* params = fx_current_slot(device);
+	switch (address) {
+		case FX_SLOT:
+			return device->slot;
+		case FX_TYPE:
+			return params->type;
+		case FX_A:
+			return (uint8_t)(params->a >> 8);
+		case FX_A + 1:
+			return (uint8_t)(params->a & 0xff);
+		case FX_B:
+			return (uint8_t)(params->b >> 8);
+		case FX_B + 1:
+			return (uint8_t)(params->b & 0xff);
+		case FX_DRY:
+			return params->dry;
+		default:
+			return vm->device[address];
+	}
+}
+
+void
+fx_deo(buxn_vm_t* vm, fx_t* device, uint8_t address) {
+	fx_params_t* params = fx_current_slot(device);
+	uint8_t slot_bit = 1 << (device->slot % FX_MAX_SLOTS);
+	switch (address) {
+		case FX_SLOT:
+			device->slot = buxn_vm_dev_load(vm, FX_SLOT) % FX_MAX_SLOTS;
+			break;
+		case FX_TYPE:
+			params->type = buxn_vm_dev_load(vm, FX_TYPE);
+			device->sync_bits |= slot_bit;
+			break;
+		case FX_A:
+			params->a = buxn_vm_dev_load2(vm, FX_A);
+			device->sync_bits |= slot_bit;
+			break;
+		case FX_B:
+			params->b = buxn_vm_dev_load2(vm, FX_B);
+			device->sync_bits |= slot_bit;
+			break;
+		case FX_DRY:
+			params->dry = buxn_vm_dev_load(vm, FX_DRY);
+			device->sync_bits |= slot_bit;
+			break;
+	}
+}
+
+void
+fx_chain_init(fx_chain_t* chain, int sample_rate) {
+	memset(chain, 0, sizeof(*chain));
+	chain->sample_rate = (float)sample_rate;
+}
+
+static float
+fx_cutoff(fx_chain_t* chain, uint16_t hz) {
+	float nyquist = chain->sample_rate * 0.5f;
+	float cutoff = (float)hz;
+	if (cutoff < 1.f) { cutoff = 1.f; }
+	if (cutoff > nyquist - 1.f) { cutoff = nyquist - 1.f; }
+	return cutoff;
+}
+
+static float
+fx_fixed_8_8(uint16_t value, float default_value) {
+	return value == 0 ? default_value : (float)value / 256.f;
+}
+
+void
+fx_chain_configure(fx_chain_t* chain, int slot, fx_params_t params) {
+	fx_stage_t* stage = &chain->stages[slot];
+
+	// Only clear the state when the type changes so that sweeping a
+	// parameter does not click
+	if (stage->params.type != params.type) {
+		memset(stage->channels, 0, sizeof(stage->channels));
+	}
+	stage->params = params;
+
+	switch (params.type) {
+		case FX_TYPE_LOWPASS:
+		case FX_TYPE_HIGHPASS: {
+			float cutoff = fx_cutoff(chain, params.a);
+			stage->b0 = 1.f - expf(-2.f * FX_PI * cutoff / chain->sample_rate);
+		} break;
+		case FX_TYPE_BIQUAD_LOWPASS:
+		case FX_TYPE_BIQUAD_HIGHPASS:
+		case FX_TYPE_BIQUAD_BANDPASS: {
+			// https://www.w3.org/TR/audio-eq-cookbook/
+			float w0 = 2.f * FX_PI * fx_cutoff(chain, params.a) / chain->sample_rate;
+			float q = fx_fixed_8_8(params.b, 0.7071f);
+			float cos_w0 = cosf(w0);
+			float alpha = sinf(w0) / (2.f * q);
+			float a0 = 1.f + alpha;
+			if (params.type == FX_TYPE_BIQUAD_LOWPASS) {
+				stage->b0 = (1.f - cos_w0) * 0.5f;
+				stage->b1 = 1.f - cos_w0;
+				stage->b2 = (1.f - cos_w0) * 0.5f;
+			} else if (params.type == FX_TYPE_BIQUAD_HIGHPASS) {
+				stage->b0 = (1.f + cos_w0) * 0.5f;
+				stage->b1 = -(1.f + cos_w0);
+				stage->b2 = (1.f + cos_w0) * 0.5f;
+			} else {
+				stage->b0 = alpha;
+				stage->b1 = 0.f;
+				stage->b2 = -alpha;
+			}
+			stage->a1 = -2.f * cos_w0;
+			stage->a2 = 1.f - alpha;
+			stage->b0 /= a0;
+			stage->b1 /= a0;
+			stage->b2 /= a0;
+			stage->a1 /= a0;
+			stage->a2 /= a0;
+		} break;
+		case FX_TYPE_DELAY:
+			stage->delay_length = params.a < 1 ? 1 : params.a;
+			if (stage->delay_length >= FX_MAX_DELAY) {
+				stage->delay_length = FX_MAX_DELAY - 1;
+			}
+			stage->feedback = (float)params.b / 65536.f;
+			break;
+		case FX_TYPE_BITCRUSH: {
+			int bits = params.a > 16 ? 16 : params.a;
+			stage->quantization = bits == 0 ? 0.f : (float)(1 << (bits - 1));
+			stage->hold_length = params.b < 1 ? 1 : params.b;
+		} break;
+		case FX_TYPE_SOFT_CLIP:
+		case FX_TYPE_GAIN:
+			stage->b0 = fx_fixed_8_8(params.a, 1.f);
+			break;
+	}
+}
+
+static void
+fx_stage_process(
+	fx_stage_t* stage,
+	fx_channel_state_t* state,
+	float* restrict buffer,
+	int num_frames
+) {
+	switch (stage->params.type) {
+		case FX_TYPE_LOWPASS: {
+			float k = stage->b0;
+			float y = state->z1;
+			for (int i = 0; i < num_frames; ++i) {
+				y += k * (buffer[i] - y);
+				buffer[i] = y;
+			}
+			state->z1 = y;
+		} break;
+		case FX_TYPE_HIGHPASS: {
+			float k = stage->b0;
+			float y = state->z1;
+			for (int i = 0; i < num_frames; ++i) {
+				y += k * (buffer[i] - y);
+				buffer[i] -= y;
+			}
+			state->z1 = y;
+		} break;
+		case FX_TYPE_BIQUAD_LOWPASS:
+		case FX_TYPE_BIQUAD_HIGHPASS:
+		case FX_TYPE_BIQUAD_BANDPASS: {
+			// Transposed direct form II
+			float b0 = stage->b0, b1 = stage->b1, b2 = stage->b2;
+			float a1 = stage->a1, a2 = stage->a2;
+			float z1 = state->z1, z2 = state->z2;
+			for (int i = 0; i < num_frames; ++i) {
+				float x = buffer[i];
+				float y = b0 * x + z1;
+				z1 = b1 * x - a1 * y + z2;
+				z2 = b2 * x - a2 * y;
+				buffer[i] = y;
+			}
+			state->z1 = z1;
+			state->z2 = z2;
+		} break;
+		case FX_TYPE_DELAY: {
+			int length = stage->delay_length;
+			int pos = state->delay_pos;
+			float feedback = stage->feedback;
+			for (int i = 0; i < num_frames; ++i) {
+				int read_pos = pos - length;
+				read_pos += read_pos < 0 ? FX_MAX_DELAY : 0;
+				float delayed = state->delay_line[read_pos];
+				state->delay_line[pos] = buffer[i] + delayed * feedback;
+				buffer[i] = delayed;
+				pos = pos + 1 == FX_MAX_DELAY ? 0 : pos + 1;
+			}
+			state->delay_pos = pos;
+		} break;
+		case FX_TYPE_BITCRUSH: {
+			float levels = stage->quantization;
+			if (levels > 0.f) {
+				float inv_levels = 1.f / levels;
+				for (int i = 0; i < num_frames; ++i) {
+					buffer[i] = floorf(buffer[i] * levels + 0.5f) * inv_levels;
+				}
+			}
+
+			if (stage->hold_length > 1) {
+				int count = state->hold_count;
+				float value = state->hold_value;
+				for (int i = 0; i < num_frames; ++i) {
+					if (count == 0) { value = buffer[i]; }
+					buffer[i] = value;
+					count = count + 1 == stage->hold_length ? 0 : count + 1;
+				}
+				state->hold_count = count;
+				state->hold_value = value;
+			}
+		} break;
+		case FX_TYPE_SOFT_CLIP: {
+			float drive = stage->b0;
+			for (int i = 0; i < num_frames; ++i) {
+				float x = buffer[i] * drive;
+				x = x > 1.f ? 1.f : x;
+				x = x < -1.f ? -1.f : x;
+				buffer[i] = 1.5f * x - 0.5f * x * x * x;
+			}
+		} break;
+		case FX_TYPE_GAIN: {
+			float gain = stage->b0;
+			for (int i = 0; i < num_frames; ++i) {
+				buffer[i] *= gain;
+			}
+		} break;
+	}
+}
+
+void
+fx_chain_process(fx_chain_t* chain, int channel, float* buffer, int num_frames) {
+	float dry_buffer[FX_BLOCK_SIZE];
+
+	for (int offset = 0; offset < num_frames; offset += FX_BLOCK_SIZE) {
+		float* block = buffer + offset;
+		int block_size = num_frames - offset;
+		block_size = block_size > FX_BLOCK_SIZE ? FX_BLOCK_SIZE : block_size;
+
+		for (int slot = 0; slot < FX_MAX_SLOTS; ++slot) {
+			fx_stage_t* stage = &chain->stages[slot];
+			if (stage->params.type == FX_TYPE_NONE) { continue; }
+
+			float dry = (float)stage->params.dry / 255.f;
+			if (dry > 0.f) {
+				memcpy(dry_buffer, block, sizeof(float) * block_size);
+			}
+
+			fx_stage_process(stage, &stage->channels[channel], block, block_size);
+
+			if (dry > 0.f) {
+				float wet = 1.f - dry;
+				for (int i = 0; i < block_size; ++i) {
+					block[i] = block[i] * wet + dry_buffer[i] * dry;
+				}
+			}
+		}
+	}
+}
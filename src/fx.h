@@ -0,0 +1,93 @@
+#ifndef UBEAT_FX_H
+#define UBEAT_FX_H
+
+#include <stdint.h>
+#include <buxn/vm/vm.h>
+
+#define FX_SLOT 0x70
+#define FX_TYPE 0x71
+#define FX_A 0x72
+#define FX_B 0x74
+#define FX_DRY 0x76
+
+#define FX_MAX_SLOTS 8
+#define FX_MAX_DELAY 16384
+#define FX_BLOCK_SIZE 256
+#define FX_MAX_CHANNELS 2
+
+enum {
+	FX_TYPE_NONE = 0,
+	FX_TYPE_LOWPASS,
+	FX_TYPE_HIGHPASS,
+	FX_TYPE_BIQUAD_LOWPASS,
+	FX_TYPE_BIQUAD_HIGHPASS,
+	FX_TYPE_BIQUAD_BANDPASS,
+	FX_TYPE_DELAY,
+	FX_TYPE_BITCRUSH,
+	FX_TYPE_SOFT_CLIP,
+	FX_TYPE_GAIN,
+};
+
+typedef struct {
+	uint8_t type;
+	uint8_t dry;
+	uint16_t a;
+	uint16_t b;
+} fx_params_t;
+
+// Device state, as seen by a VM
+typedef struct {
+	fx_params_t slots[FX_MAX_SLOTS];
+	uint8_t slot;
+
+	uint8_t sync_bits;  // One bit per slot
+} fx_t;
+
+typedef struct {
+	float z1, z2;
+	int delay_pos;
+	int hold_count;
+	float hold_value;
+
+	float delay_line[FX_MAX_DELAY];
+} fx_channel_state_t;
+
+typedef struct {
+	fx_params_t params;
+
+	float b0, b1, b2, a1, a2;
+	int delay_length;
+	float feedback;
+	float quantization;
+	int hold_length;
+
+	fx_channel_state_t channels[FX_MAX_CHANNELS];
+} fx_stage_t;
+
+// DSP state, owned by the audio thread
+typedef struct {
+	float sample_rate;
+	fx_stage_t stages[FX_MAX_SLOTS];
+} fx_chain_t;
+
+uint8_t
+fx_dei(buxn_vm_t* vm, fx_t* device, uint8_t address);
+
+void
+fx_deo(buxn_vm_t* vm, fx_t* device, uint8_t address);
+
+static inline void
+fx_init(fx_t* device) {
+	*device = (fx_t){ 0 };
+}
+
+void
+fx_chain_init(fx_chain_t* chain, int sample_rate);
+
+void
+fx_chain_configure(fx_chain_t* chain, int slot, fx_params_t params);
+
+void
+fx_chain_process(fx_chain_t* chain, int channel, float* buffer, int num_frames);
+
+#endif
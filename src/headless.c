@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include "headless.h"
+#include <blog.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define HEADLESS_NS_PER_S 1000000000ll
+
+static struct {
+	headless_audio_desc_t desc;
+	pthread_t thread;
+	atomic_bool running;
+
+	atomic_uint_fast64_t num_callbacks;
+	atomic_uint_fast64_t num_overruns;
+	atomic_bool sink_failed;
+} headless = { 0 };
+
+static void
+headless_advance(struct timespec* time, long long ns) {
+	ns += time->tv_nsec;
+	time->tv_sec += ns / HEADLESS_NS_PER_S;
+	time->tv_nsec = ns % HEADLESS_NS_PER_S;
+}
+
+static bool
+headless_is_before(const struct timespec* lhs, const struct timespec* rhs) {
+	return lhs->tv_sec < rhs->tv_sec
+		|| (lhs->tv_sec == rhs->tv_sec && lhs->tv_nsec < rhs->tv_nsec);
+}
+
+static bool
+headless_write_stdout(const float* buffer, int16_t* pcm, int num_samples) {
+	for (int i = 0; i < num_samples; ++i) {
+		float sample = buffer[i] * 32767.f;
+		sample = sample > 32767.f ? 32767.f : (sample < -32768.f ? -32768.f : sample);
+		int16_t value = (int16_t)sample;
+		// Little endian regardless of the host
+		uint8_t* bytes = (uint8_t*)&pcm[i];
+		bytes[0] = (uint8_t)((uint16_t)value & 0xff);
+		bytes[1] = (uint8_t)((uint16_t)value >> 8);
+	}
+
+	size_t num_written = fwrite(pcm, sizeof(int16_t), num_samples, stdout);
+	fflush(stdout);
+	return num_written == (size_t)num_samples;
+}
+
+static void*
+headless_audio_entry(void* userdata) {
+	(void)userdata;
+	const headless_audio_desc_t* desc = &headless.desc;
+	int num_samples = desc->buffer_frames * desc->num_channels;
+	float* buffer = malloc(sizeof(float) * num_samples);
+	int16_t* pcm = malloc(sizeof(int16_t) * num_samples);
+	long long period_ns = (long long)desc->buffer_frames * HEADLESS_NS_PER_S / desc->sample_rate;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	while (atomic_load_explicit(&headless.running, memory_order_relaxed)) {
+		desc->stream_cb(buffer, desc->buffer_frames, desc->num_channels);
+		atomic_fetch_add_explicit(&headless.num_callbacks, 1, memory_order_relaxed);
+
+		if (
+			desc->sink == HEADLESS_SINK_STDOUT
+			&& !atomic_load_explicit(&headless.sink_failed, memory_order_relaxed)
+			&& !headless_write_stdout(buffer, pcm, num_samples)
+		) {
+			atomic_store_explicit(&headless.sink_failed, true, memory_order_relaxed);
+		}
+
+		// A device would play the buffer while the next one is rendered.
+		// When rendering took too long, start over from now instead of
+		// rendering several buffers back to back.
+		headless_advance(&deadline, period_ns);
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (headless_is_before(&deadline, &now)) {
+			atomic_fetch_add_explicit(&headless.num_overruns, 1, memory_order_relaxed);
+			deadline = now;
+		} else {
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) != 0) { }
+		}
+	}
+
+	free(pcm);
+	free(buffer);
+	return NULL;
+}
+
+bool
+headless_audio_setup(const headless_audio_desc_t* desc) {
+	headless.desc = *desc;
+	atomic_store(&headless.num_callbacks, 0);
+	atomic_store(&headless.num_overruns, 0);
+	atomic_store(&headless.sink_failed, false);
+
+	if (desc->sink == HEADLESS_SINK_STDOUT) {
+		// A closed pipe is reported through the stats instead
+		signal(SIGPIPE, SIG_IGN);
+	}
+
+	atomic_store(&headless.running, true);
+	if (pthread_create(&headless.thread, NULL, headless_audio_entry, NULL) != 0) {
+		BLOG_ERROR("Could not start the audio thread");
+		atomic_store(&headless.running, false);
+		return false;
+	}
+	pthread_setname_np(headless.thread, "ubeat.audio");
+
+	return true;
+}
+
+void
+headless_audio_shutdown(void) {
+	if (!atomic_load(&headless.running)) { return; }
+
+	atomic_store(&headless.running, false);
+	pthread_join(headless.thread, NULL);
+}
+
+headless_audio_stats_t
+headless_audio_stats(void) {
+	return (headless_audio_stats_t){
+		.num_callbacks = atomic_load_explicit(&headless.num_callbacks, memory_order_relaxed),
+		.num_overruns = atomic_load_explicit(&headless.num_overruns, memory_order_relaxed),
+		.sink_failed = atomic_load_explicit(&headless.sink_failed, memory_order_relaxed),
+	};
+}
+
+void
+headless_sleep(double seconds) {
+	struct timespec duration = { 0 };
+	headless_advance(&duration, (long long)(seconds * HEADLESS_NS_PER_S));
+	while (nanosleep(&duration, &duration) != 0) { }
+}
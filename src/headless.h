@@ -0,0 +1,46 @@
+#ifndef UBEAT_HEADLESS_H
+#define UBEAT_HEADLESS_H
+
+// Drive an audio callback from a timer instead of an audio device, for
+// machines which have neither a sound card nor a display.
+// Like sokol_audio, there is a single global stream.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+	HEADLESS_SINK_NULL,
+	// Interleaved signed 16-bit little endian samples
+	HEADLESS_SINK_STDOUT,
+} headless_sink_t;
+
+typedef struct {
+	int sample_rate;
+	int num_channels;
+	int buffer_frames;
+	headless_sink_t sink;
+	void (*stream_cb)(float* buffer, int num_frames, int num_channels);
+} headless_audio_desc_t;
+
+typedef struct {
+	uint64_t num_callbacks;
+	// Callbacks which started after their deadline because the previous one
+	// took too long
+	uint64_t num_overruns;
+	// The sink could not be written to, e.g: the reader of stdout exited
+	bool sink_failed;
+} headless_audio_stats_t;
+
+bool
+headless_audio_setup(const headless_audio_desc_t* desc);
+
+void
+headless_audio_shutdown(void);
+
+headless_audio_stats_t
+headless_audio_stats(void);
+
+void
+headless_sleep(double seconds);
+
+#endif
@@ -0,0 +1,423 @@
+#include "lanes.h"
+
+#define LANES_MAX_STEPS (1 << 20)
+#define LANES_FOR(l) for (int l = 0; l < LANES_WIDTH; ++l)
+
+#define LANES_FLAG_SHORT 0x20
+#define LANES_FLAG_RETURN 0x40
+#define LANES_FLAG_KEEP 0x80
+
+typedef uint8_t lanes_stack_t[256][LANES_WIDTH];
+typedef uint16_t lanes_vec_t[LANES_WIDTH];
+
+static inline void
+lanes_pop(lanes_stack_t stack, uint8_t* sp, bool is_short, lanes_vec_t out) {
+	if (is_short) {
+		uint8_t hi = *sp - 2;
+		uint8_t lo = *sp - 1;
+		LANES_FOR(l) { out[l] = (uint16_t)(stack[hi][l] << 8 | stack[lo][l]); }
+		*sp -= 2;
+	} else {
+		uint8_t top = *sp - 1;
+		LANES_FOR(l) { out[l] = stack[top][l]; }
+		*sp -= 1;
+	}
+}
+
+static inline void
+lanes_push(lanes_stack_t stack, uint8_t* sp, bool is_short, const lanes_vec_t in) {
+	if (is_short) {
+		uint8_t hi = *sp;
+		uint8_t lo = *sp + 1;
+		LANES_FOR(l) {
+			stack[hi][l] = (uint8_t)(in[l] >> 8);
+			stack[lo][l] = (uint8_t)(in[l] & 0xff);
+		}
+		*sp += 2;
+	} else {
+		uint8_t top = *sp;
+		LANES_FOR(l) { stack[top][l] = (uint8_t)in[l]; }
+		*sp += 1;
+	}
+}
+
+static inline void
+lanes_push_uniform(lanes_stack_t stack, uint8_t* sp, bool is_short, uint16_t value) {
+	lanes_vec_t vec;
+	LANES_FOR(l) { vec[l] = value; }
+	lanes_push(stack, sp, is_short, vec);
+}
+
+static inline bool
+lanes_uniform(const lanes_vec_t vec, uint16_t* value) {
+	uint16_t first = vec[0];
+	bool uniform = true;
+	LANES_FOR(l) { uniform &= vec[l] == first; }
+	*value = first;
+	return uniform;
+}
+
+static inline uint8_t
+lanes_load(buxn_vm_t* vm, uint16_t addr) {
+	return vm->memory[addr];
+}
+
+static inline void
+lanes_load_vec(buxn_vm_t* vm, const lanes_vec_t addr, bool is_short, lanes_vec_t out) {
+	if (is_short) {
+		LANES_FOR(l) {
+			out[l] = (uint16_t)(
+				lanes_load(vm, addr[l]) << 8
+				|
+				lanes_load(vm, (uint16_t)(addr[l] + 1))
+			);
+		}
+	} else {
+		LANES_FOR(l) { out[l] = lanes_load(vm, addr[l]); }
+	}
+}
+
+static lanes_result_t
+lanes_execute(
+	lanes_t* lanes,
+	buxn_vm_t* vm,
+	bytebeat_t* device,
+	const bytebeat_voice_t* voice,
+	uint8_t options,
+	uint16_t t,
+	bytebeat_frame_t frames[LANES_WIDTH]
+) {
+	lanes_vec_t lane_t;
+	LANES_FOR(l) { lane_t[l] = (uint16_t)(t + voice->v * l); }
+
+	uint8_t wsp = 0;
+	uint8_t rsp = 0;
+	lanes_push(lanes->ws, &wsp, true, lane_t);
+
+	uint16_t pc = voice->vector;
+	for (int step = 0; step < LANES_MAX_STEPS; ++step) {
+		uint8_t opcode = lanes_load(vm, pc++);
+
+		// Immediate opcodes
+		switch (opcode) {
+			case 0x00: {  // BRK
+				LANES_FOR(l) {
+					frames[l] = bytebeat_make_frame(
+						options,
+						lanes->ws[0][l], lanes->ws[1][l],
+						lanes->ws[2][l], lanes->ws[3][l]
+					);
+				}
+				return LANES_OK;
+			}
+			case 0x20: {  // JCI
+				lanes_vec_t cond;
+				uint16_t uniform_cond;
+				lanes_pop(lanes->ws, &wsp, false, cond);
+				if (!lanes_uniform(cond, &uniform_cond)) { return LANES_DIVERGED; }
+				uint16_t offset = (uint16_t)(lanes_load(vm, pc) << 8 | lanes_load(vm, pc + 1));
+				pc += 2;
+				if (uniform_cond) { pc += offset; }
+			} continue;
+			case 0x40: {  // JMI
+				uint16_t offset = (uint16_t)(lanes_load(vm, pc) << 8 | lanes_load(vm, pc + 1));
+				pc += 2 + offset;
+			} continue;
+			case 0x60: {  // JSI
+				uint16_t offset = (uint16_t)(lanes_load(vm, pc) << 8 | lanes_load(vm, pc + 1));
+				pc += 2;
+				lanes_push_uniform(lanes->rs, &rsp, true, pc);
+				pc += offset;
+			} continue;
+			case 0x80:  // LIT
+			case 0xa0:  // LIT2
+			case 0xc0:  // LITr
+			case 0xe0: {  // LIT2r
+				bool is_short = (opcode & LANES_FLAG_SHORT) != 0;
+				uint16_t value = is_short
+					? (uint16_t)(lanes_load(vm, pc) << 8 | lanes_load(vm, pc + 1))
+					: lanes_load(vm, pc);
+				pc += is_short ? 2 : 1;
+				if (opcode & LANES_FLAG_RETURN) {
+					lanes_push_uniform(lanes->rs, &rsp, is_short, value);
+				} else {
+					lanes_push_uniform(lanes->ws, &wsp, is_short, value);
+				}
+			} continue;
+		}
+
+		bool is_short = (opcode & LANES_FLAG_SHORT) != 0;
+		bool keep = (opcode & LANES_FLAG_KEEP) != 0;
+		bool is_return = (opcode & LANES_FLAG_RETURN) != 0;
+		uint8_t (*src)[LANES_WIDTH] = is_return ? lanes->rs : lanes->ws;
+		uint8_t (*dst)[LANES_WIDTH] = is_return ? lanes->ws : lanes->rs;
+		uint8_t* src_sp = is_return ? &rsp : &wsp;
+		uint8_t* dst_sp = is_return ? &wsp : &rsp;
+
+		// In keep mode, operands are read but not removed
+		uint8_t sp = *src_sp;
+		#define LANES_POP(vec) lanes_pop(src, &sp, is_short, vec)
+		#define LANES_POP8(vec) lanes_pop(src, &sp, false, vec)
+		#define LANES_COMMIT() do { if (!keep) { *src_sp = sp; } } while (0)
+		#define LANES_PUSH(vec) lanes_push(src, src_sp, is_short, vec)
+		#define LANES_PUSH8(vec) lanes_push(src, src_sp, false, vec)
+
+		lanes_vec_t a, b, c;
+		switch (opcode & 0x1f) {
+			case 0x01:  // INC
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] += 1; }
+				LANES_PUSH(a);
+				break;
+			case 0x02:  // POP
+				LANES_POP(a);
+				LANES_COMMIT();
+				break;
+			case 0x03:  // NIP
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_PUSH(b);
+				break;
+			case 0x04:  // SWP
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_PUSH(b);
+				LANES_PUSH(a);
+				break;
+			case 0x05:  // ROT
+				LANES_POP(c);
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_PUSH(b);
+				LANES_PUSH(c);
+				LANES_PUSH(a);
+				break;
+			case 0x06:  // DUP
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_PUSH(a);
+				LANES_PUSH(a);
+				break;
+			case 0x07:  // OVR
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_PUSH(a);
+				LANES_PUSH(b);
+				LANES_PUSH(a);
+				break;
+			case 0x08:  // EQU
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = a[l] == b[l]; }
+				LANES_PUSH8(a);
+				break;
+			case 0x09:  // NEQ
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = a[l] != b[l]; }
+				LANES_PUSH8(a);
+				break;
+			case 0x0a:  // GTH
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = a[l] > b[l]; }
+				LANES_PUSH8(a);
+				break;
+			case 0x0b:  // LTH
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = a[l] < b[l]; }
+				LANES_PUSH8(a);
+				break;
+			case 0x0c:  // JMP
+			case 0x0e: {  // JSR
+				uint16_t addr;
+				LANES_POP(a);
+				LANES_COMMIT();
+				if (!lanes_uniform(a, &addr)) { return LANES_DIVERGED; }
+				if ((opcode & 0x1f) == 0x0e) {
+					lanes_push_uniform(dst, dst_sp, true, pc);
+				}
+				pc = is_short ? addr : (uint16_t)(pc + (int8_t)addr);
+			} break;
+			case 0x0d: {  // JCN
+				uint16_t addr, cond;
+				LANES_POP(a);
+				LANES_POP8(b);
+				LANES_COMMIT();
+				if (!lanes_uniform(b, &cond)) { return LANES_DIVERGED; }
+				if (cond) {
+					if (!lanes_uniform(a, &addr)) { return LANES_DIVERGED; }
+					pc = is_short ? addr : (uint16_t)(pc + (int8_t)addr);
+				}
+			} break;
+			case 0x0f:  // STH
+				LANES_POP(a);
+				LANES_COMMIT();
+				lanes_push(dst, dst_sp, is_short, a);
+				break;
+			case 0x10:  // LDZ
+				LANES_POP8(a);
+				LANES_COMMIT();
+				lanes_load_vec(vm, a, is_short, b);
+				LANES_PUSH(b);
+				break;
+			case 0x12:  // LDR
+				LANES_POP8(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = (uint16_t)(pc + (int8_t)a[l]); }
+				lanes_load_vec(vm, a, is_short, b);
+				LANES_PUSH(b);
+				break;
+			case 0x14:  // LDA
+				lanes_pop(src, &sp, true, a);
+				LANES_COMMIT();
+				lanes_load_vec(vm, a, is_short, b);
+				LANES_PUSH(b);
+				break;
+			case 0x16: {  // DEI
+				uint16_t port;
+				LANES_POP8(a);
+				LANES_COMMIT();
+				if (!lanes_uniform(a, &port)) { return LANES_DIVERGED; }
+				// Only the Bytebeat device can be read without side effects
+				if ((port & 0xf0) != BYTEBEAT_VECTOR) {
+					lanes->unsupported = true;
+					lanes->unsupported_vector = voice->vector;
+					return LANES_UNSUPPORTED;
+				}
+				int num_bytes = is_short ? 2 : 1;
+				for (int i = 0; i < num_bytes; ++i) {
+					uint8_t address = (uint8_t)(port + i);
+					if (address == BYTEBEAT_T) {
+						LANES_FOR(l) { c[l] = lane_t[l] >> 8; }
+					} else if (address == BYTEBEAT_T + 1) {
+						LANES_FOR(l) { c[l] = lane_t[l] & 0xff; }
+					} else {
+						uint8_t value = bytebeat_dei(vm, device, address);
+						LANES_FOR(l) { c[l] = value; }
+					}
+					LANES_PUSH8(c);
+				}
+			} break;
+			case 0x18:  // ADD
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = a[l] + b[l]; }
+				LANES_PUSH(a);
+				break;
+			case 0x19:  // SUB
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = a[l] - b[l]; }
+				LANES_PUSH(a);
+				break;
+			case 0x1a:  // MUL
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = (uint16_t)((uint32_t)a[l] * b[l]); }
+				LANES_PUSH(a);
+				break;
+			case 0x1b:  // DIV
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = b[l] == 0 ? 0 : a[l] / b[l]; }
+				LANES_PUSH(a);
+				break;
+			case 0x1c:  // AND
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = a[l] & b[l]; }
+				LANES_PUSH(a);
+				break;
+			case 0x1d:  // ORA
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = a[l] | b[l]; }
+				LANES_PUSH(a);
+				break;
+			case 0x1e:  // EOR
+				LANES_POP(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) { a[l] = a[l] ^ b[l]; }
+				LANES_PUSH(a);
+				break;
+			case 0x1f:  // SFT
+				LANES_POP8(b);
+				LANES_POP(a);
+				LANES_COMMIT();
+				LANES_FOR(l) {
+					a[l] = (uint16_t)((a[l] >> (b[l] & 0x0f)) << (b[l] >> 4));
+				}
+				LANES_PUSH(a);
+				break;
+			default:
+				// STZ, STR, STA and DEO have side effects
+				lanes->unsupported = true;
+				lanes->unsupported_vector = voice->vector;
+				return LANES_UNSUPPORTED;
+		}
+
+		#undef LANES_POP
+		#undef LANES_POP8
+		#undef LANES_COMMIT
+		#undef LANES_PUSH
+		#undef LANES_PUSH8
+	}
+
+	// Too many steps, the vector is probably stuck in a loop
+	lanes->unsupported = true;
+	lanes->unsupported_vector = voice->vector;
+	return LANES_UNSUPPORTED;
+}
+
+lanes_result_t
+lanes_render(
+	lanes_t* lanes,
+	buxn_vm_t* vm,
+	bytebeat_t* device,
+	const bytebeat_voice_t* voice,
+	uint8_t options,
+	uint16_t t,
+	bytebeat_frame_t frames[LANES_WIDTH]
+) {
+	lanes_result_t result = lanes_execute(lanes, vm, device, voice, options, t, frames);
+
+	if (lanes->probed_vector != voice->vector) {
+		lanes->probed_vector = voice->vector;
+		lanes->window_batches = 0;
+		lanes->window_diverged = 0;
+		lanes->skip_batches = 0;
+	}
+	++lanes->num_batches;
+	++lanes->window_batches;
+	if (result == LANES_DIVERGED) {
+		++lanes->num_diverged;
+		++lanes->window_diverged;
+	}
+	if (lanes->window_batches == LANES_PROBE_BATCHES) {
+		if (lanes->window_diverged * 2 > lanes->window_batches) {
+			lanes->skip_batches = LANES_SKIP_BATCHES;
+		}
+		lanes->window_batches = 0;
+		lanes->window_diverged = 0;
+	}
+
+	return result;
+}
@@ -0,0 +1,80 @@
+#ifndef UBEAT_LANES_H
+#define UBEAT_LANES_H
+
+// Execute a bytebeat vector for several consecutive values of t at once.
+// Each stack slot holds one byte per lane so every instruction is a loop over
+// lanes which the compiler can turn into SIMD code.
+// Only pure vectors are supported: anything which writes to memory or devices
+// is rejected and lanes which branch differently are reported as divergent.
+// The caller is expected to fall back to scalar execution in both cases.
+// A vector which diverges on most batches is not tried for a while so the
+// work done before the divergence is not wasted on every batch.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bytebeat.h"
+
+#define LANES_WIDTH 16
+// Divergence is measured over windows of this many batches
+#define LANES_PROBE_BATCHES 32
+// How long a vector which diverged on most of a window is not tried
+#define LANES_SKIP_BATCHES 1024
+
+typedef enum {
+	LANES_OK,
+	LANES_DIVERGED,
+	LANES_UNSUPPORTED,
+} lanes_result_t;
+
+typedef struct {
+	// The vector which was found to be unsupported
+	uint16_t unsupported_vector;
+	bool unsupported;
+
+	// Divergence of the last vector which was tried
+	uint16_t probed_vector;
+	int window_batches;
+	int window_diverged;
+	int skip_batches;
+
+	// Totals, for reports
+	uint64_t num_batches;
+	uint64_t num_diverged;
+	uint64_t num_skipped;
+
+	uint8_t ws[256][LANES_WIDTH];
+	uint8_t rs[256][LANES_WIDTH];
+} lanes_t;
+
+// Called whenever the code changes
+static inline void
+lanes_reset(lanes_t* lanes) {
+	lanes->unsupported = false;
+	lanes->window_batches = 0;
+	lanes->window_diverged = 0;
+	lanes->skip_batches = 0;
+}
+
+static inline bool
+lanes_should_try(lanes_t* lanes, uint16_t vector) {
+	if (lanes->unsupported && lanes->unsupported_vector == vector) { return false; }
+	if (lanes->skip_batches > 0 && lanes->probed_vector == vector) {
+		--lanes->skip_batches;
+		++lanes->num_skipped;
+		return false;
+	}
+	return true;
+}
+
+lanes_result_t
+lanes_render(
+	lanes_t* lanes,
+	buxn_vm_t* vm,
+	bytebeat_t* device,
+	const bytebeat_voice_t* voice,
+	uint8_t options,
+	uint16_t t,
+	bytebeat_frame_t frames[LANES_WIDTH]
+);
+
+#endif
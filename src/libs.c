@@ -12,6 +12,7 @@
 #include <sokol_gfx.h>
 #include <sokol_glue.h>
 #include <sokol_gl.h>
+#include <sokol_debugtext.h>
 #include <sokol_audio.h>
 #include <sokol_time.h>
 
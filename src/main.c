@@ -3,8 +3,10 @@
 #include <sokol_gfx.h>
 #include <sokol_glue.h>
 #include <sokol_gl.h>
+#include <sokol_debugtext.h>
 #include <sokol_audio.h>
 #include <sokol_time.h>
+#include <GLES3/gl3.h>
 #ifdef __clang__
 #	pragma clang diagnostic ignored "-Wnewline-eof"
 #endif
@@ -22,33 +24,162 @@
 #include <buxn/devices/screen.h>
 #include <buxn/metadata.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <signal.h>
 #include "tribuf.h"
+#include "ring.h"
 #include "bytebeat.h"
 #include "fpu.h"
+#include "fx.h"
 #include "asm.h"
+#include "worker.h"
+#include "analysis.h"
+#include "lanes.h"
+#include "profiler.h"
+#include "trace.h"
+#include "realtime.h"
+#include "capture.h"
+#include "session.h"
+#include "checkpoint.h"
+#include "headless.h"
+#include "control.h"
+#include "sampler.h"
+#include "ticker.h"
+#include "prerender.h"
 
 #define SAMPLING_RATE 8000
 #define FRAME_TIME_US (1000000.0 / 60.0)
+#define INPUT_RING_SIZE 65536
+#define PROFILER_OVERLAY_SIZE 2048
+#define WINDOW_TITLE_SIZE 256
+#define PLOT_HEIGHT 256
+#define SCREEN_REPORT_INTERVAL_S 5.0
+#define AUDIO_BLOCK_SIZE 512
+#define MAX_ROM_PATCHES (ANALYSIS_MAX_ZP_LOADS * BYTEBEAT_MAX_VOICES)
+#define CONSOLE_RING_SIZE 4096
+#define AUDIO_LOG_RING_SIZE 16384
+#define SESSION_EVENT_RING_SIZE 32768
+// How far back a seek may look for a checkpoint, in values of t
+#define CHECKPOINT_MAX_CATCH_UP 4096
+#define REVERSE_SPAN_FRAMES (CHECKPOINT_MAX_CATCH_UP + AUDIO_BLOCK_SIZE)
+#define AUDIO_LOG_MAX_MESSAGE 256
+#define ADAPTIVE_MIN_BUFFER_FRAMES 512
+#define ADAPTIVE_MAX_BUFFER_FRAMES 8192
+#define ADAPTIVE_WINDOW_S 1.0
+// Fraction of the callback deadline
+#define ADAPTIVE_GROW_LOAD 0.7
+#define ADAPTIVE_SHRINK_LOAD 0.25
+#define ADAPTIVE_SHRINK_WINDOWS 5
+// Time spent replaying each voice per frame while profiling
+#define PROFILER_BUDGET_S 0.0005
+#define PROFILER_TOP_ENTRIES 10
+#define HEADLESS_BUFFER_FRAMES 512
+#define HEADLESS_REPORT_INTERVAL_S 5.0
+// Vectors are run for this many values of t when warming up compiled code
+#define TIER_WARMUP_SAMPLES 1024
+#define TIER_MAX_VECTORS 8
+#define DEFAULT_CROSSFADE_MS 50
+// Above this load, in 1/1000 of a callback, the previous rom is rendered on
+// its own thread during a crossfade
+#define CROSSFADE_PARALLEL_LOAD 500
+// Mixed samples above this level are compressed so that voices summed at
+// full gain do not clip
+#define LIMITER_KNEE 0.75f
+#define DEFAULT_PROFILE_FILE "ubeat.folded"
+#define MAX_PLAYLIST_TUNES 64
+#define DEFAULT_STANDBY_TUNES 2
+#define DEFAULT_STANDBY_JIT_KB 16384
+#define STANDBY_RETURN_RING_SIZE 1024
 
 #ifndef FFT_SIZE
 #	define FFT_SIZE 1024
 #endif
 
 typedef struct {
-	uint64_t timestamp;
 	uint16_t t;
 	uint16_t v;
+	uint64_t render_ticks;  // Total time spent rendering this voice
+	bool interpreted;
+	uint32_t num_promotions;
+	uint64_t warmup_ticks;  // Of the last promotion
+} audio_voice_state_t;
+
+typedef struct {
+	uint64_t timestamp;
+	uint32_t cmd_sequence;  // Of the last applied command
+	bool crossfading;
+	audio_voice_state_t voices[BYTEBEAT_MAX_VOICES];
 } audio_state_t;
 
+// The GL texture is created here and injected into sokol so that a span of
+// rows can be uploaded on its own
 typedef struct {
+	GLuint gl_texture;
 	sg_image gpu;
 	sg_view view;
-	uint32_t* cpu;
-	size_t size;
+	int width;
+	int height;
 } layer_texture_t;
 
+// Input is handled on the screen thread
+typedef struct {
+	sapp_event event;
+	char* dropped_file;  // Owned by the receiver
+} input_event_t;
+
+enum {
+	SCREEN_LAYER_BACKGROUND_BIT = 1 << 0,
+	SCREEN_LAYER_FOREGROUND_BIT = 1 << 1,
+};
+
+// Everything the GL thread draws besides the screen layers
+typedef struct {
+	bool show_screen;
+	// Both layers are merged into the background texture
+	bool composited;
+	bool playing_forward;
+	uint8_t bytebeat_opts;
+
+	// Only set when the profiler is running
+	int overlay_length;
+	char overlay[PROFILER_OVERLAY_SIZE];
+
+	bool title_changed;
+	char title[WINDOW_TITLE_SIZE];
+
+	// Mix of all voices, only when a plot is shown
+	float samples[SAMPLING_RATE];
+} screen_view_t;
+
+// A frame sent from the screen thread to the GL thread.
+// Layers are only copied in when they are behind the ones rendered on the
+// screen thread, the GL thread clears the bits once they are uploaded.
+typedef struct {
+	screen_view_t view;
+
+	int width;
+	int height;
+	uint32_t* layers[2];
+	int changed_layers;
+	// Rows of each layer to upload, also cleared by the GL thread
+	int dirty_top[2];
+	int dirty_bottom[2];
+	// Screen thread only: of the layers this slot holds
+	uint32_t generations[2];
+} screen_frame_t;
+
+// Compiled code, which can only run on the VM it was compiled for
+typedef struct {
+	buxn_jit_t* jit;
+	barena_pool_t arena_pool;
+	barena_t arena;
+	size_t num_bytes;  // Allocated from the arena
+} jit_state_t;
+
 typedef struct {
 	buxn_console_t console;
 	buxn_mouse_t mouse;
@@ -56,30 +187,282 @@ typedef struct {
 	buxn_screen_t* screen;
 	bytebeat_t bytebeat;
 	buxn_fpu_t fpu;
+	fx_t fx;
+	sampler_t sampler;
 
-	buxn_jit_t* jit;
-	barena_pool_t arena_pool;
-	barena_t arena;
+	jit_state_t* jit_state;
+	// Vectors are interpreted while their code is compiled on a shadow VM
+	bool interpreted;
+	// Set for shadow VMs, which only run to warm up compiled code
+	bool is_shadow;
+
+	// When set, console output is queued instead of written immediately
+	ring_t* console_out;
+	ring_t* console_err;
 } devices_t;
 
+// After a reload, the voice is interpreted while a copy of its VM runs the
+// vectors on a worker so the JIT compiles them.
+// The two VMs are then swapped.
+typedef struct {
+	buxn_vm_t* vm;
+	devices_t devices;
+	worker_t worker;
+	bool running;  // A job was started and not waited for
+	bool pending;  // The voice changed since the last job started
+	uint32_t generation;  // Of the voice when the job started
+
+	int num_vectors;
+	uint16_t vectors[TIER_MAX_VECTORS];
+	// Owned by the job while it runs
+	int num_job_vectors;
+	uint16_t job_vectors[TIER_MAX_VECTORS];
+	uint64_t job_ticks;
+
+	uint32_t num_promotions;
+	uint64_t warmup_ticks;  // Of the last promotion
+	// Promotions happen on the voice workers but are logged by the audio
+	// thread, which is the only writer of the log ring
+	uint32_t num_logged_promotions;
+} voice_tier_t;
+
+// The VM of the previous rom keeps playing while it fades out after a
+// reload
+typedef struct {
+	buxn_vm_t* vm;
+	devices_t devices;
+	lanes_t lanes;
+	worker_t worker;
+	bool parallel;
+
+	int length;
+	int remaining;  // In frames
+
+	int16_t left[AUDIO_BLOCK_SIZE];
+	int16_t right[AUDIO_BLOCK_SIZE];
+} voice_fade_t;
+
+// Frames of a stateful vector rendered forward from a checkpoint for reverse
+// playback.
+// The following blocks walk back through them until they run out.
+typedef struct {
+	uint16_t first_t;
+	uint16_t step;
+	int num_frames;  // 0 when empty
+
+	int16_t left[REVERSE_SPAN_FRAMES];
+	int16_t right[REVERSE_SPAN_FRAMES];
+} voice_reverse_t;
+
+// A VM which already ran the vector of one voice of a tune from the playlist,
+// so its code is compiled
+typedef struct {
+	buxn_vm_t* vm;
+	devices_t devices;
+	int num_vectors;
+	uint16_t vectors[TIER_MAX_VECTORS];
+} standby_voice_t;
+
+typedef enum {
+	STANDBY_COLD,
+	STANDBY_WARMING,
+	STANDBY_WARM,
+	STANDBY_FAILED,
+} standby_status_t;
+
+// What the standby worker prepared for a tune
+typedef struct {
+	bool failed;
+	ubeat_prepared_rom_t* prepared;
+	// Zero-page patches which were applied before compiling, found the same
+	// way as on reload
+	int num_patches;
+	analysis_patch_t* patches;
+	// One per active voice
+	standby_voice_t* voices[BYTEBEAT_MAX_VOICES];
+	size_t jit_bytes;
+	uint64_t warmup_ticks;
+} standby_result_t;
+
+// The status is only changed by the main thread
+typedef struct {
+	const char* path;
+	standby_status_t status;
+	standby_result_t warm;  // When the status is STANDBY_WARM
+	// Of the main thread VM when the job started
+	uint8_t options;
+	// Written by the worker while the tune is warming, only read once the job
+	// was waited for
+	standby_result_t job;
+} standby_tune_t;
+
+typedef struct {
+	buxn_vm_t* vm;
+	devices_t devices;
+	worker_t worker;
+	voice_tier_t tier;
+	voice_fade_t fade;
+	bool has_rom;
+	// Changes whenever compiled code would be invalidated
+	uint32_t code_generation;
+	lanes_t lanes;
+	uint64_t render_ticks;
+	checkpoints_t* checkpoints;
+	voice_reverse_t reverse;
+	bool seek_pending;
+	analysis_purity_t purity;  // Of the current vector
+	// Of every vector analyzed since the rom was loaded, which covers all
+	// the code compiled for this voice
+	uint8_t read_zp[256 / 8];
+
+	ring_t console_out;
+	ring_t console_err;
+	size_t num_reported_drops;
+	uint8_t console_out_storage[CONSOLE_RING_SIZE];
+	uint8_t console_err_storage[CONSOLE_RING_SIZE];
+
+	int num_frames;
+	int16_t left[AUDIO_BLOCK_SIZE];
+	int16_t right[AUDIO_BLOCK_SIZE];
+} audio_voice_t;
+
+// Logs from the audio thread are formatted there but written by the main thread
+typedef struct {
+	blog_level_t level;
+	int line;
+	const char* file;
+	int length;
+	char message[AUDIO_LOG_MAX_MESSAGE];
+} audio_log_record_t;
+
 enum {
 	AUDIO_CMD_LOAD_ROM            = 1 << 0,
 	AUDIO_CMD_SYNC_ZERO_PAGE      = 1 << 1,
 	AUDIO_CMD_SYNC_BYTEBEAT       = 1 << 2,
+	AUDIO_CMD_SYNC_FX             = 1 << 3,
+	AUDIO_CMD_PATCH_ROM           = 1 << 4,
+	AUDIO_CMD_SYNC_SAMPLER        = 1 << 5,
+	AUDIO_CMD_SYNC_PURITY         = 1 << 6,
 };
 
 typedef struct {
 	int cmds;
+	uint32_t sequence;
 
 	rom_t rom;
 	uint8_t zero_page[256];
+	// One bit per byte of zero_page which was changed by the main thread.
+	// Other bytes may hold control writes the audio thread applied since.
+	uint32_t zero_page_mask[8];
 	bytebeat_t bytebeat;
+	fx_t fx;
+	sample_bank_t* sample_banks[SAMPLER_MAX_BANKS];
+	analysis_purity_t purity[BYTEBEAT_MAX_VOICES];
+	uint8_t read_zp[BYTEBEAT_MAX_VOICES][256 / 8];
+
+	uint32_t patch_generation;
+	// The first num_restores patches restore every site patched since the
+	// rom was loaded
+	int num_restores;
+	int num_patches;
+	analysis_patch_t patches[MAX_ROM_PATCHES * 2];
+	// One bit per zero-page byte whose folded value changed.
+	// Only voices which read one of them have stale compiled code.
+	uint8_t patched_zp[256 / 8];
+
+	int crossfade_frames;  // Sent with every rom
+	// Taken by the audio thread with the rom when the tune was prepared ahead.
+	// These are not recorded, a replay renders the same output without them.
+	standby_voice_t* standby_voices[BYTEBEAT_MAX_VOICES];
 } audio_cmd_t;
 
 static const char* input_file = NULL;
+static const char* profile_file = NULL;
+static const char* trace_file = NULL;
+static bool realtime = false;
+static bool audio_thread_promoted = false;
+static int buffer_frames = 0;
+static int num_packets = 0;
+static bool adaptive_buffer = false;
+static const char* record_file = NULL;
+static const char* session_file = NULL;
+static const char* replay_file = NULL;
+static bool headless = false;
+static headless_sink_t headless_sink = HEADLESS_SINK_NULL;
+static int duration = 0;
+static int bench_seconds = 0;
+static int crossfade_ms = DEFAULT_CROSSFADE_MS;
+static volatile sig_atomic_t stop_requested = 0;
+static const char* control_endpoint = NULL;
+static bool no_cache = false;
+static bool no_lanes = false;
+static bool composite_screen = false;
+static int standby_tunes = DEFAULT_STANDBY_TUNES;
+static int standby_jit_kb = DEFAULT_STANDBY_JIT_KB;
+
+static control_t control;
+static size_t control_reported_drops = 0;
+static unsigned control_reported_invalid_packets = 0;
+// Audio thread only
+static uint64_t last_callback_start = 0;
+// Of the previous callback, in 1/1000 of its duration.
+// Written by the audio thread before voice jobs are started.
+static unsigned last_callback_load = 0;
+
+static capture_t capture;
+static unsigned capture_reported_drops = 0;
+
+// Highest cost of a callback relative to its duration, in 1/1000
+static atomic_uint audio_peak_load = 0;
+// With --adaptive-buffer, the device buffer keeps its size and only how far
+// ahead audio is rendered changes
+static struct {
+	int min_buffer_frames;
+	uint64_t window_start;
+	unsigned peak_load;
+	int num_cheap_windows;
+	uint64_t reported_underruns;
+} adaptive = { 0 };
 
 static audio_cmd_t audio_cmds[3] = { 0 };
 static tribuf_t audio_cmd_buf;
+// The zero page as of the last command
+static uint8_t last_zero_page[256] = { 0 };
+static uint32_t audio_cmd_sequence = 0;
+// Audio thread only
+static uint32_t applied_cmd_sequence = 0;
+// The original content of every site patched since the rom was loaded, so
+// control writes can unpatch the loads they make stale.
+// Audio thread only.
+static struct {
+	int num_sites;
+	analysis_patch_t originals[MAX_ROM_PATCHES];
+} audio_zp_folds = { 0 };
+// Sample banks are unmapped once the audio thread has applied the command
+// which replaced them
+static sample_bank_t* retired_sample_banks = NULL;
+
+// Session recording.
+// The audio thread reports when it applied each command and each control
+// write through a ring, in order.
+// The position and hash are only read by the main thread after the audio
+// thread has stopped.
+typedef struct {
+	session_record_type_t type;  // Consumed command or control write
+	uint32_t sequence;
+	uint64_t position;
+	control_write_t write;
+} session_event_t;
+
+static session_t session = { 0 };
+// Set before the audio thread starts and cleared after it stops
+static atomic_bool recording_session = false;
+static ring_t session_event_ring;
+static uint8_t session_event_storage[SESSION_EVENT_RING_SIZE];
+static size_t session_event_reported_drops = 0;
+// Written by the audio thread
+static atomic_uint_fast64_t audio_position = 0;
+static atomic_uint_fast64_t audio_output_hash = SESSION_HASH_INIT;
 
 static audio_state_t last_audio_state = { 0 };
 static audio_state_t audio_states[3] = { 0 };
@@ -87,15 +470,110 @@ static tribuf_t audio_state_buf;
 
 static buxn_vm_t* main_thread_vm = NULL;
 static devices_t main_thread_devices = { 0 };
-static buxn_vm_t* audio_thread_vm = NULL;
-static devices_t audio_thread_devices = { 0 };
+static lanes_t main_thread_lanes = { 0 };
+static audio_voice_t audio_voices[BYTEBEAT_MAX_VOICES] = { 0 };
+
+static ring_t audio_log_ring;
+static uint8_t audio_log_storage[AUDIO_LOG_RING_SIZE];
+static size_t audio_log_reported_drops = 0;
+
+static rom_t current_rom = { 0 };
+// Owned by the thread which runs the main thread VM
+static struct {
+	int num_tunes;
+	int current;
+	standby_tune_t tunes[MAX_PLAYLIST_TUNES];
+	worker_t worker;
+	standby_tune_t* warming;
+} playlist = { 0 };
+// VMs replaced by standby ones are freed by the main thread
+static ring_t standby_return_ring;
+static uint8_t standby_return_storage[STANDBY_RETURN_RING_SIZE];
+static struct {
+	analysis_t analyses[BYTEBEAT_MAX_VOICES];
+	// The last classification sent to the audio thread
+	analysis_purity_t purity[BYTEBEAT_MAX_VOICES];
+	uint8_t read_zp[BYTEBEAT_MAX_VOICES][256 / 8];
+} vector_analysis = { 0 };
+static struct {
+	// The last set of patches sent to the audio thread
+	int num_patches;
+	analysis_patch_t patches[MAX_ROM_PATCHES];
+
+	// Every site which may have been patched since the rom was loaded
+	int num_touched;
+	analysis_patch_t touched[MAX_ROM_PATCHES];
+
+	uint32_t generation;
+} zp_specialization = { 0 };
+static fx_chain_t fx_chain;
+
+static profiler_t profiler;
+// Vectors are replayed on a copy of the main thread VM
+static buxn_vm_t* profiler_vm = NULL;
+static devices_t profiler_devices = { 0 };
+static bool profiling = false;
+static uint64_t profile_start = 0;
+static uint64_t profiled_ticks[BYTEBEAT_MAX_VOICES] = { 0 };
 
 static am_fft_plan_1d_t* fft = NULL;
 static am_fft_complex_t* fft_in = NULL;
 static am_fft_complex_t* fft_out = NULL;
 
-static uint64_t last_frame;
-static double frame_time_accumulator;
+// With a window, the main thread VM runs on the screen thread at a fixed
+// rate and the GL thread only draws what it sends
+static ticker_t screen_ticker;
+static bool screen_thread_running = false;
+static screen_frame_t screen_frames[3] = { 0 };
+static tribuf_t screen_frame_buf;
+static ring_t input_ring;
+static uint8_t input_storage[INPUT_RING_SIZE];
+static atomic_int window_width = 0;
+static atomic_int window_height = 0;
+// Screen thread only
+static char* dropped_file = NULL;
+static bool window_title_changed = false;
+static char window_title[WINDOW_TITLE_SIZE] = { 0 };
+// The last rendered layers.
+// A slot of the triple buffer may be several renders behind so frames are
+// brought up to date from here rather than rendered into.
+static struct {
+	int width;
+	int height;
+	size_t size;
+	uint32_t* layers[2];
+	// Bumped whenever a layer changes
+	uint32_t generations[2];
+
+	// With --composite-screen, the layers merged one row at a time as they
+	// change.
+	// Rows merged since each slot was last sent are tracked instead of
+	// generations so that only those are copied.
+	uint32_t* scratch;
+	uint32_t* pixels;
+	bool* dirty_rows;
+	int stale_top[3];
+	int stale_bottom[3];
+} screen_layers = { 0 };
+static size_t input_reported_drops = 0;
+static uint64_t last_screen_report = 0;
+static ticker_stats_t reported_screen_stats = { 0 };
+// GL thread only
+static screen_view_t screen_view = { 0 };
+static struct {
+	layer_texture_t texture;
+	uint32_t* pixels;
+	size_t size;
+	// Rows drawn in each column, which are cleared before the next plot
+	int* dirty_top;
+	int* dirty_bottom;
+	// Rows cleared or drawn since the last upload
+	int upload_top;
+	int upload_bottom;
+	// A new frame was received since the last plot
+	bool stale;
+} plot = { 0 };
+
 static layer_texture_t background_texture = { 0 };
 static layer_texture_t foreground_texture = { 0 };
 static sg_sampler screen_sampler;
@@ -104,9 +582,94 @@ static sgl_pipeline screen_pipeline;
 static void
 audio(float* buffer, int num_frames, int num_channels);
 
+static void
+audio_log(blog_level_t level, const char* file, int line, const char* fmt, ...);
+
+#define AUDIO_LOG_DEBUG(...) audio_log(BLOG_LEVEL_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
+#define AUDIO_LOG_INFO(...) audio_log(BLOG_LEVEL_INFO, __FILE__, __LINE__, __VA_ARGS__)
+#define AUDIO_LOG_WARN(...) audio_log(BLOG_LEVEL_WARN, __FILE__, __LINE__, __VA_ARGS__)
+
 static void
 try_reload_formula(void);
 
+static audio_cmd_t*
+analyze_vectors(audio_cmd_t* cmd, bool reanalyze);
+
+static audio_cmd_t*
+specialize_zero_page(audio_cmd_t* cmd, bool reanalyze);
+
+static void
+reset_profiler(void);
+
+static void
+write_profile(void);
+
+static void
+write_trace(void);
+
+static void
+drain_audio_output(void);
+
+static void
+prepare_realtime(void);
+
+static void
+start_audio(int num_buffer_frames, void (*stream_cb)(float* buffer, int num_frames, int num_channels));
+
+static void
+toggle_recording(void);
+
+static void
+send_audio_cmd(audio_cmd_t* cmd);
+
+static void
+init_audio_voices(void);
+
+static void
+cleanup_audio_voices(void);
+
+static void
+finish_session(void);
+
+static void
+close_sample_banks(void);
+
+static void
+process_audio_command(const audio_cmd_t* cmd);
+
+static void
+apply_control_write(const control_write_t* write);
+
+static bool
+sync_audio(void);
+
+static void
+follow_audio_state(void);
+
+static void
+render_audio(float* buffer, int num_frames, int num_channels, uint64_t* hash);
+
+static void
+screen_tick(void* userdata);
+
+static standby_tune_t*
+find_standby(void);
+
+static void
+release_standby(standby_tune_t* tune);
+
+static void
+drop_standby_voices(audio_cmd_t* cmd);
+
+static void
+attach_standby(audio_cmd_t* cmd, standby_tune_t* tune);
+
+static void
+free_standby_voice(standby_voice_t* standby);
+
+static void
+cleanup_standby(void);
+
 static void
 slog(
 	const char* tag,
@@ -125,12 +688,10 @@ init_layer_texture(
 	layer_texture_t* texture,
 	int width,
 	int height,
-	buxn_screen_info_t screen_info,
 	const char* label
 ) {
-	texture->cpu = realloc(texture->cpu, screen_info.target_mem_size);
-	texture->size = screen_info.target_mem_size;
-	memset(texture->cpu, 0, screen_info.target_mem_size);
+	texture->width = width;
+	texture->height = height;
 	if (texture->gpu.id != SG_INVALID_ID) {
 		sg_destroy_image(texture->gpu);
 	}
@@ -138,13 +699,26 @@ init_layer_texture(
 		sg_destroy_view(texture->view);
 	}
 
+	if (texture->gl_texture != 0) {
+		glDeleteTextures(1, &texture->gl_texture);
+	}
+
+	glGenTextures(1, &texture->gl_texture);
+	glBindTexture(GL_TEXTURE_2D, texture->gl_texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexImage2D(
+		GL_TEXTURE_2D, 0, GL_RGBA8,
+		width, height, 0,
+		GL_RGBA, GL_UNSIGNED_BYTE, NULL
+	);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	sg_reset_state_cache();
+
 	texture->gpu = sg_make_image(&(sg_image_desc){
 		.type = SG_IMAGETYPE_2D,
 		.width = width,
 		.height = height,
-		.usage = {
-			.stream_update = true,
-		},
+		.gl_textures[0] = texture->gl_texture,
 		.label = label,
 	});
 	texture->view = sg_make_view(&(sg_view_desc){
@@ -154,11 +728,40 @@ init_layer_texture(
 	});
 }
 
+// Upload the rows in [top, bottom) of an image the size of the texture
+static void
+upload_layer_texture(layer_texture_t* texture, const uint32_t* pixels, int top, int bottom) {
+	if (top >= bottom) { return; }
+
+	glBindTexture(GL_TEXTURE_2D, texture->gl_texture);
+	glTexSubImage2D(
+		GL_TEXTURE_2D, 0,
+		0, top, texture->width, bottom - top,
+		GL_RGBA, GL_UNSIGNED_BYTE,
+		pixels + (size_t)top * texture->width
+	);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	// sokol caches the bound texture
+	sg_reset_state_cache();
+}
+
 static void
 cleanup_layer_texture(layer_texture_t* texture) {
 	sg_destroy_view(texture->view);
 	sg_destroy_image(texture->gpu);
-	free(texture->cpu);
+	glDeleteTextures(1, &texture->gl_texture);
+}
+
+// Grow [top, bottom) to cover [span_top, span_bottom)
+static void
+add_row_span(int* top, int* bottom, int span_top, int span_bottom) {
+	if (*top >= *bottom) {
+		*top = span_top;
+		*bottom = span_bottom;
+	} else {
+		*top = span_top < *top ? span_top : *top;
+		*bottom = span_bottom > *bottom ? span_bottom : *bottom;
+	}
 }
 
 static void
@@ -171,39 +774,143 @@ init_vm(buxn_vm_t* vm, devices_t* devices) {
 
 	buxn_console_init(vm, &devices->console, 0, NULL);
 	bytebeat_init(&devices->bytebeat);
+	fx_init(&devices->fx);
+	sampler_init(&devices->sampler, SAMPLING_RATE, false);
 
-	barena_pool_init(&devices->arena_pool, 1);
-	barena_init(&devices->arena, &devices->arena_pool);
-	devices->jit = buxn_jit_init(vm, &(buxn_jit_config_t){
-		.mem_ctx = &devices->arena,
+	jit_state_t* jit_state = malloc(sizeof(jit_state_t));
+	barena_pool_init(&jit_state->arena_pool, 1);
+	barena_init(&jit_state->arena, &jit_state->arena_pool);
+	jit_state->num_bytes = 0;
+	jit_state->jit = buxn_jit_init(vm, &(buxn_jit_config_t){
+		.mem_ctx = jit_state,
 	});
+	devices->jit_state = jit_state;
 }
 
 static void
 cleanup_vm(buxn_vm_t* vm) {
 	devices_t* devices = vm->config.userdata;
 
-	buxn_jit_cleanup(devices->jit);
-	barena_reset(&devices->arena);
-	barena_pool_cleanup(&devices->arena_pool);
+	jit_state_t* jit_state = devices->jit_state;
+	buxn_jit_cleanup(jit_state->jit);
+	barena_reset(&jit_state->arena);
+	barena_pool_cleanup(&jit_state->arena_pool);
+	free(jit_state);
 
 	free(vm);
 }
 
 static void
 reset_jit(buxn_vm_t* vm) {
+	uint64_t trace_start = trace_begin();
 	devices_t* devices = vm->config.userdata;
+	jit_state_t* jit_state = devices->jit_state;
 
-	buxn_jit_cleanup(devices->jit);
-	barena_reset(&devices->arena);
-	devices->jit = buxn_jit_init(vm, &(buxn_jit_config_t){
-		.mem_ctx = &devices->arena,
+	buxn_jit_cleanup(jit_state->jit);
+	barena_reset(&jit_state->arena);
+	jit_state->num_bytes = 0;
+	jit_state->jit = buxn_jit_init(vm, &(buxn_jit_config_t){
+		.mem_ctx = jit_state,
 	});
+	trace_end("reset_jit", trace_start);
+}
+
+// The main thread VM and its screen, which is never drawn when headless
+static void
+init_main_vm(int width, int height) {
+	main_thread_vm = malloc(sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
+	init_vm(main_thread_vm, &main_thread_devices);
+	main_thread_devices.sampler.can_open = true;
+
+	buxn_screen_info_t screen_info = buxn_screen_info(width, height);
+	main_thread_devices.screen = malloc(screen_info.screen_mem_size);
+	memset(main_thread_devices.screen, 0, screen_info.screen_mem_size);
+	buxn_screen_resize(main_thread_devices.screen, width, height);
+}
+
+// Everything but graphics and the audio device
+static void
+init_engine(void) {
+	profiler_init(&profiler);
+	profiler_vm = malloc(sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
+	init_vm(profiler_vm, &profiler_devices);
+	profiler_devices.is_shadow = true;
+	profiling = profile_file != NULL;
+
+	tribuf_init(&audio_cmd_buf, &audio_cmds, sizeof(audio_cmds[0]));
+	tribuf_init(&audio_state_buf, &audio_states, sizeof(audio_states[0]));
+	last_audio_state.timestamp = stm_now();
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		last_audio_state.voices[i].v = 1;
+	}
+
+	init_audio_voices();
+	if (realtime) {
+		prepare_realtime();
+	}
+
+	// The first command is sent by the initial reload
+	if (session_file != NULL) {
+		if (session_open_write(&session, session_file, SAMPLING_RATE)) {
+			BLOG_INFO("Recording session to %s", session_file);
+			atomic_store(&recording_session, true);
+		} else {
+			BLOG_ERROR("Could not open %s for writing", session_file);
+		}
+	}
+
+	ubeat_asm_set_cache_enabled(!no_cache);
+	ubeat_asm_init();
+	ubeat_asm_set_entry_file(input_file);
+	try_reload_formula();
+	if (input_file == NULL) {
+		BLOG_WARN("No entry file set. Please drag and drop a .tal or .rom file into the window");
+	}
+
+	capture_init(&capture, SAMPLING_RATE);
+
+	if (control_endpoint != NULL && control_start(&control, control_endpoint) && realtime) {
+		int error = realtime_promote_thread(control.thread);
+		if (error != 0) {
+			BLOG_WARN("Could not raise the priority of the control thread: %s", realtime_describe_error(error));
+		}
+	}
+}
+
+// Must be called after the audio stream has stopped
+static void
+cleanup_engine(void) {
+	control_stop(&control);
+	capture_cleanup(&capture);
+	if (atomic_load(&recording_session)) {
+		finish_session();
+	}
+
+	if (profiling && profile_file != NULL) {
+		write_profile();
+	}
+	profiler_cleanup(&profiler);
+	cleanup_vm(profiler_vm);
+
+	cleanup_audio_voices();
+	close_sample_banks();
+	drain_audio_output();
+	free(main_thread_devices.screen);
+	cleanup_vm(main_thread_vm);
+	ubeat_asm_cleanup();
+
+	// All threads have stopped
+	if (trace_is_enabled()) {
+		write_trace();
+	}
+	trace_cleanup();
 }
 
 static void
 init(void) {
 	stm_setup();
+	trace_init(trace_file != NULL);
+	trace_set_thread_name("main");
 
 	sg_setup(&(sg_desc){
 		.environment = sglue_environment(),
@@ -214,19 +921,18 @@ init(void) {
 			.func = slog,
 		},
 	});
+	sdtx_setup(&(sdtx_desc_t){
+		.fonts[0] = sdtx_font_kc853(),
+		.logger = {
+			.func = slog,
+		},
+	});
 
-	main_thread_vm = malloc(sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
-	init_vm(main_thread_vm, &main_thread_devices);
-
-	// Screen device for main thread VM
 	int width = sapp_width();
 	int height = sapp_height();
-	buxn_screen_info_t screen_info = buxn_screen_info(width, height);
-	main_thread_devices.screen = malloc(screen_info.screen_mem_size);
-	memset(main_thread_devices.screen, 0, screen_info.screen_mem_size);
-	buxn_screen_resize(main_thread_devices.screen, width, height);
-	init_layer_texture(&background_texture, width, height, screen_info, "ubeat.screen.background");
-	init_layer_texture(&foreground_texture, width, height, screen_info, "ubeat.screen.foreground");
+	init_main_vm(width, height);
+	init_layer_texture(&background_texture, width, height, "ubeat.screen.background");
+	init_layer_texture(&foreground_texture, width, height, "ubeat.screen.foreground");
 	screen_sampler = sg_make_sampler(&(sg_sampler_desc){
 		.min_filter = SG_FILTER_NEAREST,
 		.mag_filter = SG_FILTER_NEAREST,
@@ -249,56 +955,100 @@ init(void) {
 		.label = "ubeat.screen",
 	});
 
-	last_frame = stm_now();
-	frame_time_accumulator = FRAME_TIME_US;  // Render once
-
-	tribuf_init(&audio_cmd_buf, &audio_cmds, sizeof(audio_cmds[0]));
-	tribuf_init(&audio_state_buf, &audio_states, sizeof(audio_states[0]));
-	last_audio_state.timestamp = stm_now();
-	last_audio_state.v = 1;
-
-	audio_thread_vm = malloc(sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
-	init_vm(audio_thread_vm, &audio_thread_devices);
-
-	ubeat_asm_init();
-	ubeat_asm_set_entry_file(input_file);
-	try_reload_formula();
-	if (input_file == NULL) {
-		BLOG_WARN("No entry file set. Please drag and drop a .tal file into the window");
+	init_engine();
+	if (adaptive_buffer) {
+		adaptive.min_buffer_frames = buffer_frames > 0 ? buffer_frames : ADAPTIVE_MIN_BUFFER_FRAMES;
+		adaptive.window_start = stm_now();
+		bool prerendering = prerender_setup(&(prerender_desc_t){
+			.num_channels = 2,
+			.block_frames = adaptive.min_buffer_frames,
+			.max_frames = ADAPTIVE_MAX_BUFFER_FRAMES,
+			.realtime = realtime,
+			.stream_cb = audio,
+		});
+		if (prerendering) {
+			start_audio(adaptive.min_buffer_frames, prerender_read);
+		} else {
+			BLOG_WARN("The audio buffer will not adapt");
+			adaptive_buffer = false;
+			start_audio(adaptive.min_buffer_frames, audio);
+		}
+	} else {
+		start_audio(buffer_frames, audio);
+	}
+	if (record_file != NULL) {
+		capture_start(&capture, record_file, saudio_channels());
 	}
-
-	saudio_setup(&(saudio_desc){
-		.sample_rate = SAMPLING_RATE,
-		.num_channels = 1,
-		.stream_cb = audio,
-		.logger = {
-			.func = slog,
-		},
-	});
 
 	fft = am_fft_plan_1d(AM_FFT_FORWARD, FFT_SIZE);
 	fft_in = malloc(sizeof(am_fft_complex_t) * FFT_SIZE);
 	fft_out = malloc(sizeof(am_fft_complex_t) * FFT_SIZE);
+
+	if (playlist.num_tunes > 1) {
+		worker_init(&playlist.worker, "ubeat.standby");
+	}
+
+	// The main thread VM belongs to the screen thread from now on
+	tribuf_init(&screen_frame_buf, &screen_frames, sizeof(screen_frames[0]));
+	ring_init(&input_ring, input_storage, sizeof(input_storage));
+	atomic_store(&window_width, width);
+	atomic_store(&window_height, height);
+	last_screen_report = stm_now();
+	screen_thread_running = ticker_start(
+		&screen_ticker, "ubeat.screen", FRAME_TIME_US / 1000000.0, screen_tick, NULL
+	);
+	if (!screen_thread_running) {
+		BLOG_WARN("Running the screen vector on the GL thread");
+	}
 }
 
 static void
 cleanup(void) {
+	ticker_stop(&screen_ticker);
+	cleanup_standby();
+	input_event_t input;
+	while (ring_read(&input_ring, &input, sizeof(input)) == sizeof(input)) {
+		free(input.dropped_file);
+	}
+	for (int i = 0; i < 3; ++i) {
+		free(screen_frames[i].layers[0]);
+		free(screen_frames[i].layers[1]);
+	}
+	free(screen_layers.layers[0]);
+	free(screen_layers.layers[1]);
+	free(screen_layers.scratch);
+	free(screen_layers.pixels);
+	free(screen_layers.dirty_rows);
+
 	sg_destroy_sampler(screen_sampler);
 	sgl_destroy_pipeline(screen_pipeline);
 	cleanup_layer_texture(&foreground_texture);
 	cleanup_layer_texture(&background_texture);
-	free(main_thread_devices.screen);
+	if (plot.texture.gpu.id != SG_INVALID_ID) {
+		cleanup_layer_texture(&plot.texture);
+	}
+	free(plot.pixels);
+	free(plot.dirty_top);
+	free(plot.dirty_bottom);
 
 	free(fft_in);
 	free(fft_out);
 	am_fft_plan_1d_free(fft);
 
 	saudio_shutdown();
+	prerender_shutdown();
+	// Commands which were never taken may still hold standby VMs
+	for (int i = 0; i < 3; ++i) {
+		for (int j = 0; j < BYTEBEAT_MAX_VOICES; ++j) {
+			if (audio_cmds[i].standby_voices[j] != NULL) {
+				free_standby_voice(audio_cmds[i].standby_voices[j]);
+			}
+		}
+	}
+	cleanup_engine();
+	free(dropped_file);
 
-	cleanup_vm(audio_thread_vm);
-	cleanup_vm(main_thread_vm);
-	ubeat_asm_cleanup();
-
+	sdtx_shutdown();
 	sgl_shutdown();
 	sg_shutdown();
 }
@@ -309,8 +1059,19 @@ try_reload_formula(void) {
 
 	BLOG_INFO("Compiling %s", input_file);
 
+	uint64_t trace_start = trace_begin();
 	rom_t tmp_rom = { 0 };
-	if (!ubeat_asm_reload(&tmp_rom)) { return; }
+	// A tune of the playlist may already be assembled
+	standby_tune_t* standby = find_standby();
+	if (standby != NULL && !ubeat_asm_reload_prepared(standby->warm.prepared, &tmp_rom)) {
+		BLOG_INFO("%s changed since it was prepared", standby->path);
+		release_standby(standby);
+		standby = NULL;
+	}
+	if (standby == NULL && !ubeat_asm_reload(&tmp_rom)) {
+		trace_end("try_reload_formula", trace_start);
+		return;
+	}
 
 	BLOG_INFO("Executing %s (%d bytes)", input_file, tmp_rom.size);
 	buxn_vm_reset(main_thread_vm, BUXN_VM_RESET_SOFT);
@@ -321,43 +1082,1714 @@ try_reload_formula(void) {
 	);
 	bytebeat_t* bytebeat = &main_thread_devices.bytebeat;
 	bytebeat->sync_bits = 0;
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		bytebeat->voices[i].sync_bits = 0;
+	}
+	// Effects and samples do not carry over from the previous rom
+	fx_init(&main_thread_devices.fx);
+	sampler_clear(&main_thread_devices.sampler);
 	buxn_vm_execute(main_thread_vm, BUXN_RESET_VECTOR);
 	reset_jit(main_thread_vm);
+	lanes_reset(&main_thread_lanes);
+	// Labels have moved so previous samples are meaningless
+	reset_profiler();
 
 	audio_cmd_t* cmd = tribuf_begin_send(&audio_cmd_buf);
 	memcpy(cmd->rom.content, tmp_rom.content, tmp_rom.size);
 	cmd->rom.size = tmp_rom.size;
+	cmd->crossfade_frames = crossfade_ms * SAMPLING_RATE / 1000;
 	cmd->cmds |= AUDIO_CMD_LOAD_ROM | AUDIO_CMD_SYNC_ZERO_PAGE;
 	memcpy(cmd->zero_page, main_thread_vm->memory, sizeof(cmd->zero_page));
-	if (bytebeat->sync_bits != 0) {
+	memset(cmd->zero_page_mask, 0xff, sizeof(cmd->zero_page_mask));
+	if (bytebeat_sync_bits(bytebeat) != 0) {
 		cmd->cmds |= AUDIO_CMD_SYNC_BYTEBEAT;
 		cmd->bytebeat = main_thread_devices.bytebeat;
 	}
-	tribuf_end_send(&audio_cmd_buf);
+	cmd->cmds |= AUDIO_CMD_SYNC_FX;
+	cmd->fx = main_thread_devices.fx;
+	cmd->fx.sync_bits = (1 << FX_MAX_SLOTS) - 1;
+	main_thread_devices.fx.sync_bits = 0;
+	cmd->cmds |= AUDIO_CMD_SYNC_SAMPLER;
+	memcpy(cmd->sample_banks, main_thread_devices.sampler.banks, sizeof(cmd->sample_banks));
+	main_thread_devices.sampler.sync_bits = 0;
 
-	if (main_thread_devices.bytebeat.vector == 0) {
+	memcpy(&current_rom, &tmp_rom, sizeof(tmp_rom));
+	zp_specialization.num_patches = 0;
+	zp_specialization.num_touched = 0;
+	analyze_vectors(cmd, true);
+	specialize_zero_page(cmd, true);
+	attach_standby(cmd, standby);
+
+	send_audio_cmd(cmd);
+	trace_end("try_reload_formula", trace_start);
+
+	if (main_thread_devices.bytebeat.voices[0].vector == 0) {
 		BLOG_WARN("Bytebeat vector is not set");
 	}
 }
 
-static float
-lerp(float x, float from, float to) {
-	return from * (1.f - x) + to * x;
+static bool
+patches_equal(const analysis_patch_t* lhs, const analysis_patch_t* rhs, int num_patches) {
+	for (int i = 0; i < num_patches; ++i) {
+		if (
+			lhs[i].addr != rhs[i].addr
+			|| lhs[i].size != rhs[i].size
+			|| memcmp(lhs[i].bytes, rhs[i].bytes, lhs[i].size) != 0
+		) {
+			return false;
+		}
+	}
+
+	return true;
 }
 
+// Mark the zero-page bytes of a patch unless it is also in others unchanged
 static void
-event(const sapp_event* event) {
-	bool update_mouse = false;
-	buxn_mouse_t* mouse = &main_thread_devices.mouse;
-	buxn_controller_t* controller = &main_thread_devices.controller;
+mark_patched_zp(uint8_t* patched_zp, const analysis_patch_t* patch, const analysis_patch_t* others, int num_others) {
+	for (int i = 0; i < num_others; ++i) {
+		if (others[i].addr == patch->addr) {
+			if (patches_equal(&others[i], patch, 1)) { return; }
+			break;
+		}
+	}
 
-	switch (event->type) {
-		case SAPP_EVENTTYPE_MOUSE_UP:
-		case SAPP_EVENTTYPE_MOUSE_DOWN: {
-			int button;
-			switch (event->mouse_button) {
-				case SAPP_MOUSEBUTTON_LEFT:
-					button = 0;
+	for (int i = 0; i < patch->zp_size; ++i) {
+		uint8_t addr = (uint8_t)(patch->zp_addr + i);
+		patched_zp[addr / 8] |= (uint8_t)(1 << (addr % 8));
+	}
+}
+
+static void
+log_vector_analysis(int voice, const analysis_t* analysis) {
+	BLOG_INFO(
+		"Voice %d: vector %04x is %s",
+		voice, analysis->vector, analysis_purity_name(analysis->purity)
+	);
+
+	char zp_reads[256 * 3 + 1] = { 0 };
+	int length = 0;
+	for (int i = 0; i < 256; ++i) {
+		if (analysis_zp_is_read(analysis, (uint8_t)i)) {
+			length += snprintf(zp_reads + length, sizeof(zp_reads) - length, " %02x", i);
+		}
+	}
+	BLOG_DEBUG(
+		"Voice %d reads%s%s from the zero page and %d other address(es)%s",
+		voice,
+		length > 0 ? zp_reads : " nothing",
+		analysis->reads_unknown ? " and computed addresses" : "",
+		analysis->num_reads,
+		analysis->reads_truncated ? " or more" : ""
+	);
+}
+
+// Classify the vector of every voice.
+// The audio thread is told whenever a classification or the zero-page bytes
+// read by a vector change.
+static audio_cmd_t*
+analyze_vectors(audio_cmd_t* cmd, bool reanalyze) {
+	bytebeat_t* bytebeat = &main_thread_devices.bytebeat;
+	bool changed = reanalyze;
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		analysis_t* analysis = &vector_analysis.analyses[i];
+		if (!bytebeat_voice_is_active(bytebeat, i)) {
+			// A vector which comes back after a reload must be analyzed again
+			analysis->vector = 0;
+			continue;
+		}
+
+		uint16_t vector = bytebeat->voices[i].vector;
+		if (!reanalyze && analysis->vector == vector) { continue; }
+
+		analysis_run(analysis, &current_rom, vector);
+		if (
+			reanalyze
+			|| analysis->purity != vector_analysis.purity[i]
+			|| memcmp(analysis->read_zp, vector_analysis.read_zp[i], sizeof(analysis->read_zp)) != 0
+		) {
+			changed = true;
+			log_vector_analysis(i, analysis);
+		}
+	}
+	if (!changed) { return cmd; }
+
+	cmd = cmd == NULL ? tribuf_begin_send(&audio_cmd_buf) : cmd;
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		// Voices without a vector are not rendered so their value does not
+		// matter
+		const analysis_t* analysis = &vector_analysis.analyses[i];
+		vector_analysis.purity[i] = analysis->purity;
+		memcpy(vector_analysis.read_zp[i], analysis->read_zp, sizeof(analysis->read_zp));
+		cmd->purity[i] = vector_analysis.purity[i];
+		memcpy(cmd->read_zp[i], analysis->read_zp, sizeof(analysis->read_zp));
+	}
+	cmd->cmds |= AUDIO_CMD_SYNC_PURITY;
+
+	return cmd;
+}
+
+// Fold zero-page loads in the vectors into constants when enabled.
+// The patches are recomputed whenever the vectors or the zero page change.
+static audio_cmd_t*
+specialize_zero_page(audio_cmd_t* cmd, bool reanalyze) {
+	bytebeat_t* bytebeat = &main_thread_devices.bytebeat;
+	static analysis_patch_t patches[MAX_ROM_PATCHES];
+	int num_patches = 0;
+
+	if (bytebeat->options & BYTEBEAT_OPTS_SPECIALIZE_ZP) {
+		analysis_zp_writes_t writes = { 0 };
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			if (!bytebeat_voice_is_active(bytebeat, i)) { continue; }
+
+			analysis_add_zp_writes(&writes, &vector_analysis.analyses[i]);
+		}
+
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			if (!bytebeat_voice_is_active(bytebeat, i)) { continue; }
+
+			num_patches += analysis_specialize_zp(
+				&vector_analysis.analyses[i],
+				&writes,
+				main_thread_vm->memory,
+				patches + num_patches,
+				MAX_ROM_PATCHES - num_patches
+			);
+		}
+	}
+
+	// Track every site which has to be restored later
+	for (int i = 0; i < num_patches; ++i) {
+		bool found = false;
+		for (int j = 0; j < zp_specialization.num_touched; ++j) {
+			found |= zp_specialization.touched[j].addr == patches[i].addr;
+		}
+		if (found) { continue; }
+
+		if (zp_specialization.num_touched < MAX_ROM_PATCHES) {
+			zp_specialization.touched[zp_specialization.num_touched++] = analysis_unpatch(
+				&current_rom, &patches[i]
+			);
+		} else {
+			BLOG_WARN("Too many zero-page loads to specialize");
+			num_patches = 0;
+			break;
+		}
+	}
+
+	if (
+		!reanalyze
+		&& num_patches == zp_specialization.num_patches
+		&& patches_equal(patches, zp_specialization.patches, num_patches)
+	) {
+		return cmd;
+	}
+
+	cmd = cmd == NULL ? tribuf_begin_send(&audio_cmd_buf) : cmd;
+	// Standby VMs of an unsent command were compiled with other patches
+	drop_standby_voices(cmd);
+	// Restore all sites, then apply the current patches.
+	// This stays correct when an unsent command is overwritten.
+	int num_cmd_patches = 0;
+	for (int i = 0; i < zp_specialization.num_touched; ++i) {
+		cmd->patches[num_cmd_patches++] = zp_specialization.touched[i];
+	}
+	for (int i = 0; i < num_patches; ++i) {
+		cmd->patches[num_cmd_patches++] = patches[i];
+	}
+	cmd->num_restores = zp_specialization.num_touched;
+	cmd->num_patches = num_cmd_patches;
+	cmd->patch_generation = ++zp_specialization.generation;
+	cmd->cmds |= AUDIO_CMD_PATCH_ROM;
+	// Bits from an unsent command are kept
+	for (int i = 0; i < zp_specialization.num_patches; ++i) {
+		mark_patched_zp(cmd->patched_zp, &zp_specialization.patches[i], patches, num_patches);
+	}
+	for (int i = 0; i < num_patches; ++i) {
+		mark_patched_zp(cmd->patched_zp, &patches[i], zp_specialization.patches, zp_specialization.num_patches);
+	}
+
+	zp_specialization.num_patches = num_patches;
+	memcpy(zp_specialization.patches, patches, sizeof(patches[0]) * num_patches);
+
+	return cmd;
+}
+
+static void
+reset_profiler(void) {
+	profiler_reset(&profiler, ubeat_asm_symbols());
+	profile_start = stm_now();
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		profiled_ticks[i] = last_audio_state.voices[i].render_ticks;
+	}
+}
+
+static void
+toggle_profiler(void) {
+	profiling = !profiling;
+	if (profiling) {
+		reset_profiler();
+		BLOG_INFO("Profiler started");
+	} else {
+		BLOG_INFO("Profiler stopped");
+	}
+}
+
+static void
+write_profile(void) {
+	const char* path = profile_file != NULL ? profile_file : DEFAULT_PROFILE_FILE;
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) {
+		BLOG_ERROR("Could not open %s", path);
+		return;
+	}
+
+	profiler_write_collapsed(&profiler, file);
+	fclose(file);
+	BLOG_INFO("Wrote profile to %s", path);
+}
+
+static void
+write_trace(void) {
+	if (!trace_is_enabled()) {
+		BLOG_WARN("Tracing is not enabled, run with --trace");
+		return;
+	}
+
+	if (trace_write(trace_file)) {
+		BLOG_INFO("Wrote trace to %s", trace_file);
+	} else {
+		BLOG_ERROR("Could not write trace to %s", trace_file);
+	}
+}
+
+static void
+start_audio(int num_buffer_frames, void (*stream_cb)(float* buffer, int num_frames, int num_channels)) {
+	saudio_setup(&(saudio_desc){
+		.sample_rate = SAMPLING_RATE,
+		.num_channels = 2,
+		.buffer_frames = num_buffer_frames,
+		.num_packets = num_packets,
+		.stream_cb = stream_cb,
+		.logger = {
+			.func = slog,
+		},
+	});
+	BLOG_INFO("Audio buffer: %d frames", saudio_buffer_frames());
+}
+
+static void
+toggle_recording(void) {
+	if (capture_is_recording(&capture)) {
+		capture_stop(&capture);
+		return;
+	}
+
+	char path[64];
+	time_t now = time(NULL);
+	strftime(path, sizeof(path), "ubeat-%Y%m%d-%H%M%S.wav", localtime(&now));
+	capture_reported_drops = 0;
+	capture_start(&capture, path, saudio_channels());
+}
+
+static void
+init_audio_voices(void) {
+	// Each voice has its own VM and JIT.
+	// The first voice is rendered on the audio thread itself.
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		audio_voice_t* voice = &audio_voices[i];
+		voice->vm = malloc(sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
+		init_vm(voice->vm, &voice->devices);
+		voice->devices.bytebeat.voice = i;
+		ring_init(&voice->console_out, voice->console_out_storage, CONSOLE_RING_SIZE);
+		ring_init(&voice->console_err, voice->console_err_storage, CONSOLE_RING_SIZE);
+		voice->devices.console_out = &voice->console_out;
+		voice->devices.console_err = &voice->console_err;
+		voice->checkpoints = malloc(sizeof(checkpoints_t));
+		checkpoints_init(voice->checkpoints);
+		voice->purity = ANALYSIS_STATEFUL;
+		if (i > 0) {
+			worker_init(&voice->worker, "ubeat.voice");
+		}
+
+		voice_tier_t* tier = &voice->tier;
+		tier->vm = malloc(sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
+		init_vm(tier->vm, &tier->devices);
+		tier->devices.bytebeat.voice = i;
+		tier->devices.is_shadow = true;
+		worker_init(&tier->worker, "ubeat.jit");
+
+		voice_fade_t* fade = &voice->fade;
+		fade->vm = malloc(sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
+		init_vm(fade->vm, &fade->devices);
+		fade->devices.bytebeat.voice = i;
+		// Output of the previous rom was already seen
+		fade->devices.is_shadow = true;
+		worker_init(&fade->worker, "ubeat.fade");
+	}
+	fx_chain_init(&fx_chain, SAMPLING_RATE);
+	ring_init(&audio_log_ring, audio_log_storage, AUDIO_LOG_RING_SIZE);
+	ring_init(&standby_return_ring, standby_return_storage, STANDBY_RETURN_RING_SIZE);
+	ring_init(&session_event_ring, session_event_storage, SESSION_EVENT_RING_SIZE);
+}
+
+static void
+cleanup_audio_voices(void) {
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		if (i > 0) {
+			worker_cleanup(&audio_voices[i].worker);
+		}
+		worker_cleanup(&audio_voices[i].tier.worker);
+		cleanup_vm(audio_voices[i].tier.vm);
+		worker_cleanup(&audio_voices[i].fade.worker);
+		cleanup_vm(audio_voices[i].fade.vm);
+		cleanup_vm(audio_voices[i].vm);
+		free(audio_voices[i].checkpoints);
+	}
+}
+
+static void
+free_standby_voice(standby_voice_t* standby) {
+	cleanup_vm(standby->vm);
+	free(standby);
+}
+
+static void
+free_standby_result(standby_result_t* result) {
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		if (result->voices[i] != NULL) {
+			free_standby_voice(result->voices[i]);
+		}
+	}
+	ubeat_asm_free_prepared(result->prepared);
+	free(result->patches);
+	*result = (standby_result_t){ 0 };
+}
+
+// Runs on the standby worker, which only writes to the job of the tune
+static void
+warm_up_standby(void* userdata) {
+	standby_tune_t* tune = userdata;
+	standby_result_t* job = &tune->job;
+	uint64_t start = stm_now();
+	job->prepared = ubeat_asm_prepare(tune->path);
+	if (job->prepared == NULL) {
+		job->failed = true;
+		trace_end("warm_up_standby", start);
+		return;
+	}
+	const rom_t* rom = ubeat_prepared_rom(job->prepared);
+
+	// Which voices play and what they play is only known after on-reset
+	devices_t devices = { 0 };
+	buxn_vm_t* vm = malloc(sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
+	init_vm(vm, &devices);
+	devices.is_shadow = true;
+	devices.bytebeat.options = tune->options;
+	memcpy(vm->memory + BUXN_RESET_VECTOR, rom->content, rom->size);
+	buxn_vm_execute(vm, BUXN_RESET_VECTOR);
+
+	// Compiled code would not match the rom once it is specialized so the
+	// patches are applied first
+	if (devices.bytebeat.options & BYTEBEAT_OPTS_SPECIALIZE_ZP) {
+		job->patches = malloc(sizeof(analysis_patch_t) * MAX_ROM_PATCHES);
+		analysis_t analyses[BYTEBEAT_MAX_VOICES];
+		analysis_zp_writes_t writes = { 0 };
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			if (!bytebeat_voice_is_active(&devices.bytebeat, i)) { continue; }
+
+			analysis_run(&analyses[i], rom, devices.bytebeat.voices[i].vector);
+			analysis_add_zp_writes(&writes, &analyses[i]);
+		}
+
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			if (!bytebeat_voice_is_active(&devices.bytebeat, i)) { continue; }
+
+			job->num_patches += analysis_specialize_zp(
+				&analyses[i],
+				&writes,
+				vm->memory,
+				job->patches + job->num_patches,
+				MAX_ROM_PATCHES - job->num_patches
+			);
+		}
+		for (int i = 0; i < job->num_patches; ++i) {
+			const analysis_patch_t* patch = &job->patches[i];
+			memcpy(vm->memory + patch->addr, patch->bytes, patch->size);
+		}
+	}
+
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		uint16_t vector = devices.bytebeat.voices[i].vector;
+		if (!bytebeat_voice_is_active(&devices.bytebeat, i) || vector == 0) { continue; }
+
+		standby_voice_t* standby = malloc(sizeof(standby_voice_t));
+		*standby = (standby_voice_t){
+			.vm = malloc(sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE),
+		};
+		init_vm(standby->vm, &standby->devices);
+		standby->devices.is_shadow = true;
+		memcpy(standby->vm->memory, vm->memory, BUXN_MEMORY_BANK_SIZE);
+		memcpy(standby->vm->device, vm->device, sizeof(vm->device));
+		standby->devices.bytebeat = devices.bytebeat;
+		standby->devices.bytebeat.voice = i;
+
+		// The same range of t as when a voice is promoted
+		bytebeat_voice_t* state = &standby->devices.bytebeat.voices[i];
+		for (int j = 0; j < TIER_WARMUP_SAMPLES; ++j) {
+			uint16_t t = (uint16_t)(j * (0x10000 / TIER_WARMUP_SAMPLES) + j);
+			bytebeat_render(standby->vm, standby->devices.jit_state->jit, state, devices.bytebeat.options, t);
+		}
+		// A stateful vector changed memory while warming up but the voice
+		// must start from where on-reset left it, like a cold load.
+		// Only the compiled code is kept.
+		memcpy(standby->vm->memory, vm->memory, BUXN_MEMORY_BANK_SIZE);
+		memcpy(standby->vm->device, vm->device, sizeof(vm->device));
+		standby->devices.bytebeat = devices.bytebeat;
+		standby->devices.bytebeat.voice = i;
+		standby->vectors[0] = vector;
+		standby->num_vectors = 1;
+
+		job->voices[i] = standby;
+		job->jit_bytes += standby->devices.jit_state->num_bytes;
+	}
+	cleanup_vm(vm);
+
+	job->warmup_ticks = stm_since(start);
+	trace_end("warm_up_standby", start);
+}
+
+static void
+release_standby(standby_tune_t* tune) {
+	free_standby_result(&tune->warm);
+	// Failed tunes are only tried again once they have been played
+	if (tune->status != STANDBY_FAILED) {
+		tune->status = STANDBY_COLD;
+	}
+}
+
+// The tunes right after the current one are kept warm
+static bool
+is_standby_wanted(int index) {
+	int distance = (index - playlist.current + playlist.num_tunes) % playlist.num_tunes;
+	return distance >= 1 && distance <= standby_tunes;
+}
+
+// Called once the worker was waited for
+static void
+finish_standby(standby_tune_t* tune) {
+	tune->warm = tune->job;
+	tune->job = (standby_result_t){ 0 };
+	if (tune->warm.failed) {
+		BLOG_WARN("Could not prepare %s", tune->path);
+		tune->status = STANDBY_FAILED;
+		release_standby(tune);
+		return;
+	}
+
+	size_t jit_bytes = tune->warm.jit_bytes;
+	for (int i = 0; i < playlist.num_tunes; ++i) {
+		const standby_tune_t* other = &playlist.tunes[i];
+		if (other != tune && other->status == STANDBY_WARM) {
+			jit_bytes += other->warm.jit_bytes;
+		}
+	}
+	if (jit_bytes > (size_t)standby_jit_kb * 1024) {
+		BLOG_WARN(
+			"Not keeping %s warm, standby tunes would need %zu KB of compiled code",
+			tune->path, jit_bytes / 1024
+		);
+		tune->status = STANDBY_FAILED;
+		release_standby(tune);
+		return;
+	}
+
+	tune->status = STANDBY_WARM;
+	BLOG_INFO(
+		"%s is ready to play (%.1f ms, %zu KB of compiled code)",
+		tune->path, stm_ms(tune->warm.warmup_ticks), tune->warm.jit_bytes / 1024
+	);
+}
+
+// Prepare the next tunes of the playlist one at a time and release those
+// which are no longer next
+static void
+update_standby(void) {
+	if (playlist.num_tunes < 2) { return; }
+
+	if (playlist.warming != NULL) {
+		if (!worker_try_wait(&playlist.worker)) { return; }
+
+		standby_tune_t* tune = playlist.warming;
+		playlist.warming = NULL;
+		finish_standby(tune);
+	}
+
+	for (int i = 0; i < playlist.num_tunes; ++i) {
+		standby_tune_t* tune = &playlist.tunes[i];
+		if (tune->status == STANDBY_WARM && !is_standby_wanted(i)) {
+			BLOG_DEBUG("Releasing %s", tune->path);
+			release_standby(tune);
+		}
+	}
+
+	for (int distance = 1; distance <= standby_tunes && distance < playlist.num_tunes; ++distance) {
+		standby_tune_t* tune = &playlist.tunes[(playlist.current + distance) % playlist.num_tunes];
+		if (tune->status != STANDBY_COLD) { continue; }
+
+		tune->status = STANDBY_WARMING;
+		tune->options = main_thread_devices.bytebeat.options;
+		playlist.warming = tune;
+		worker_start_job(&playlist.worker, warm_up_standby, tune);
+		break;
+	}
+}
+
+// The warm tune for the file about to be loaded, if any
+static standby_tune_t*
+find_standby(void) {
+	// The tune being warmed belongs to the worker
+	for (int i = 0; i < playlist.num_tunes; ++i) {
+		if (
+			&playlist.tunes[i] != playlist.warming
+			&& playlist.tunes[i].status == STANDBY_WARM
+			&& strcmp(playlist.tunes[i].path, input_file) == 0
+		) {
+			return &playlist.tunes[i];
+		}
+	}
+
+	return NULL;
+}
+
+// VMs from a command which was never sent are freed here
+static void
+drop_standby_voices(audio_cmd_t* cmd) {
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		if (cmd->standby_voices[i] != NULL) {
+			free_standby_voice(cmd->standby_voices[i]);
+			cmd->standby_voices[i] = NULL;
+		}
+	}
+}
+
+// Hand the VMs of the tune whose prepared rom was loaded over with the
+// command.
+// They are only used if the rom was specialized the same way as when they
+// were compiled.
+static void
+attach_standby(audio_cmd_t* cmd, standby_tune_t* tune) {
+	drop_standby_voices(cmd);
+	if (tune == NULL) { return; }
+
+	if (
+		tune->warm.num_patches == zp_specialization.num_patches
+		&& patches_equal(tune->warm.patches, zp_specialization.patches, tune->warm.num_patches)
+	) {
+		memcpy(cmd->standby_voices, tune->warm.voices, sizeof(cmd->standby_voices));
+		memset(tune->warm.voices, 0, sizeof(tune->warm.voices));
+		BLOG_INFO("Switching to %s, which was prepared ahead", tune->path);
+	} else {
+		BLOG_INFO("The zero page of %s changed since it was prepared", tune->path);
+	}
+	release_standby(tune);
+}
+
+// Play another tune of the playlist
+static void
+switch_tune(int offset) {
+	if (playlist.num_tunes < 2) { return; }
+
+	playlist.current = (playlist.current + offset + playlist.num_tunes) % playlist.num_tunes;
+	standby_tune_t* tune = &playlist.tunes[playlist.current];
+	if (tune != playlist.warming && tune->status == STANDBY_FAILED) {
+		tune->status = STANDBY_COLD;
+	}
+
+	input_file = tune->path;
+	ubeat_asm_set_entry_file(input_file);
+	try_reload_formula();
+}
+
+static void
+cleanup_standby(void) {
+	if (playlist.num_tunes < 2) { return; }
+
+	if (playlist.warming != NULL) {
+		worker_wait(&playlist.worker);
+		free_standby_result(&playlist.warming->job);
+		playlist.warming = NULL;
+	}
+	for (int i = 0; i < playlist.num_tunes; ++i) {
+		release_standby(&playlist.tunes[i]);
+	}
+	worker_cleanup(&playlist.worker);
+}
+
+static void
+append_bytes(uint8_t* payload, uint32_t* size, const void* data, size_t length) {
+	memcpy(payload + *size, data, length);
+	*size += (uint32_t)length;
+}
+
+static void
+append_u8(uint8_t* payload, uint32_t* size, uint8_t value) {
+	payload[(*size)++] = value;
+}
+
+static void
+append_u16(uint8_t* payload, uint32_t* size, uint16_t value) {
+	uint8_t* out = payload + *size;
+	session_put_u16(&out, value);
+	*size += 2;
+}
+
+static void
+append_u32(uint8_t* payload, uint32_t* size, uint32_t value) {
+	uint8_t* out = payload + *size;
+	session_put_u32(&out, value);
+	*size += 4;
+}
+
+static bool
+read_bytes(const uint8_t* payload, uint32_t size, uint32_t* offset, void* data, size_t length) {
+	if (length > size - *offset) { return false; }
+	memcpy(data, payload + *offset, length);
+	*offset += (uint32_t)length;
+	return true;
+}
+
+static bool
+read_u8(const uint8_t* payload, uint32_t size, uint32_t* offset, uint8_t* value) {
+	return read_bytes(payload, size, offset, value, 1);
+}
+
+static bool
+read_u16(const uint8_t* payload, uint32_t size, uint32_t* offset, uint16_t* value) {
+	uint8_t bytes[2];
+	if (!read_bytes(payload, size, offset, bytes, sizeof(bytes))) { return false; }
+	const uint8_t* in = bytes;
+	*value = session_get_u16(&in);
+	return true;
+}
+
+static bool
+read_u32(const uint8_t* payload, uint32_t size, uint32_t* offset, uint32_t* value) {
+	uint8_t bytes[4];
+	if (!read_bytes(payload, size, offset, bytes, sizeof(bytes))) { return false; }
+	const uint8_t* in = bytes;
+	*value = session_get_u32(&in);
+	return true;
+}
+
+// Commands are written field by field in little endian so that the file has
+// no padding and does not depend on the host.
+// Only the sections marked in cmds are written.
+static void
+record_audio_cmd(const audio_cmd_t* cmd) {
+	static uint8_t payload[sizeof(audio_cmd_t) + SAMPLER_MAX_BANKS * SAMPLER_MAX_PATH];
+	uint32_t size = 0;
+	append_u32(payload, &size, (uint32_t)cmd->cmds);
+
+	if (cmd->cmds & AUDIO_CMD_LOAD_ROM) {
+		append_u16(payload, &size, cmd->rom.size);
+		append_bytes(payload, &size, cmd->rom.content, cmd->rom.size);
+		append_u32(payload, &size, (uint32_t)cmd->crossfade_frames);
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_ZERO_PAGE) {
+		append_bytes(payload, &size, cmd->zero_page, sizeof(cmd->zero_page));
+		for (int i = 0; i < 8; ++i) {
+			append_u32(payload, &size, cmd->zero_page_mask[i]);
+		}
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_BYTEBEAT) {
+		const bytebeat_t* bytebeat = &cmd->bytebeat;
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			const bytebeat_voice_t* voice = &bytebeat->voices[i];
+			append_u16(payload, &size, voice->vector);
+			append_u16(payload, &size, voice->t);
+			append_u16(payload, &size, voice->v);
+			append_u8(payload, &size, voice->gain);
+			append_u8(payload, &size, voice->sync_bits);
+		}
+		append_u8(payload, &size, bytebeat->voice);
+		append_u8(payload, &size, bytebeat->options);
+		append_u8(payload, &size, bytebeat->sync_bits);
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_FX) {
+		for (int i = 0; i < FX_MAX_SLOTS; ++i) {
+			const fx_params_t* params = &cmd->fx.slots[i];
+			append_u8(payload, &size, params->type);
+			append_u8(payload, &size, params->dry);
+			append_u16(payload, &size, params->a);
+			append_u16(payload, &size, params->b);
+		}
+		append_u8(payload, &size, cmd->fx.slot);
+		append_u8(payload, &size, cmd->fx.sync_bits);
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_SAMPLER) {
+		// Mappings are recorded by path and opened again on replay
+		for (int i = 0; i < SAMPLER_MAX_BANKS; ++i) {
+			const sample_bank_t* bank = cmd->sample_banks[i];
+			uint16_t length = bank != NULL ? (uint16_t)strlen(bank->path) : 0;
+			append_u16(payload, &size, length);
+			append_bytes(payload, &size, bank != NULL ? bank->path : "", length);
+		}
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_PURITY) {
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			append_u8(payload, &size, (uint8_t)cmd->purity[i]);
+			append_bytes(payload, &size, cmd->read_zp[i], sizeof(cmd->read_zp[i]));
+		}
+	}
+
+	if (cmd->cmds & AUDIO_CMD_PATCH_ROM) {
+		append_u32(payload, &size, cmd->patch_generation);
+		append_u32(payload, &size, (uint32_t)cmd->num_restores);
+		append_u32(payload, &size, (uint32_t)cmd->num_patches);
+		// Bytes past the size of a patch are not set
+		for (int i = 0; i < cmd->num_patches; ++i) {
+			const analysis_patch_t* patch = &cmd->patches[i];
+			append_u16(payload, &size, patch->addr);
+			append_u8(payload, &size, patch->size);
+			append_bytes(payload, &size, patch->bytes, patch->size);
+			append_u8(payload, &size, patch->zp_addr);
+			append_u8(payload, &size, patch->zp_size);
+		}
+		append_bytes(payload, &size, cmd->patched_zp, sizeof(cmd->patched_zp));
+	}
+
+	session_write(
+		&session,
+		&(session_record_t){
+			.type = SESSION_RECORD_COMMAND,
+			.sequence = cmd->sequence,
+			.payload_size = size,
+		},
+		payload
+	);
+}
+
+static bool
+decode_audio_cmd(const uint8_t* payload, uint32_t size, audio_cmd_t* cmd) {
+	uint32_t offset = 0;
+	uint32_t cmds;
+	if (!read_u32(payload, size, &offset, &cmds)) { return false; }
+	cmd->cmds = (int)cmds;
+
+	if (cmd->cmds & AUDIO_CMD_LOAD_ROM) {
+		uint32_t crossfade_frames;
+		if (!read_u16(payload, size, &offset, &cmd->rom.size)) { return false; }
+		if (cmd->rom.size > sizeof(cmd->rom.content)) { return false; }
+		if (!read_bytes(payload, size, &offset, cmd->rom.content, cmd->rom.size)) { return false; }
+		if (!read_u32(payload, size, &offset, &crossfade_frames)) { return false; }
+		cmd->crossfade_frames = (int)crossfade_frames;
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_ZERO_PAGE) {
+		if (!read_bytes(payload, size, &offset, cmd->zero_page, sizeof(cmd->zero_page))) { return false; }
+		for (int i = 0; i < 8; ++i) {
+			if (!read_u32(payload, size, &offset, &cmd->zero_page_mask[i])) { return false; }
+		}
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_BYTEBEAT) {
+		bytebeat_t* bytebeat = &cmd->bytebeat;
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			bytebeat_voice_t* voice = &bytebeat->voices[i];
+			if (!read_u16(payload, size, &offset, &voice->vector)) { return false; }
+			if (!read_u16(payload, size, &offset, &voice->t)) { return false; }
+			if (!read_u16(payload, size, &offset, &voice->v)) { return false; }
+			if (!read_u8(payload, size, &offset, &voice->gain)) { return false; }
+			if (!read_u8(payload, size, &offset, &voice->sync_bits)) { return false; }
+		}
+		if (!read_u8(payload, size, &offset, &bytebeat->voice)) { return false; }
+		if (!read_u8(payload, size, &offset, &bytebeat->options)) { return false; }
+		if (!read_u8(payload, size, &offset, &bytebeat->sync_bits)) { return false; }
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_FX) {
+		for (int i = 0; i < FX_MAX_SLOTS; ++i) {
+			fx_params_t* params = &cmd->fx.slots[i];
+			if (!read_u8(payload, size, &offset, &params->type)) { return false; }
+			if (!read_u8(payload, size, &offset, &params->dry)) { return false; }
+			if (!read_u16(payload, size, &offset, &params->a)) { return false; }
+			if (!read_u16(payload, size, &offset, &params->b)) { return false; }
+		}
+		if (!read_u8(payload, size, &offset, &cmd->fx.slot)) { return false; }
+		if (!read_u8(payload, size, &offset, &cmd->fx.sync_bits)) { return false; }
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_SAMPLER) {
+		for (int i = 0; i < SAMPLER_MAX_BANKS; ++i) {
+			uint16_t length;
+			char path[SAMPLER_MAX_PATH];
+			if (!read_u16(payload, size, &offset, &length)) { return false; }
+			if (length >= sizeof(path)) { return false; }
+			if (!read_bytes(payload, size, &offset, path, length)) { return false; }
+			path[length] = '\0';
+			cmd->sample_banks[i] = length > 0 ? sample_bank_open(path, SAMPLING_RATE) : NULL;
+		}
+	}
+
+	if (cmd->cmds & AUDIO_CMD_SYNC_PURITY) {
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			uint8_t purity;
+			if (!read_u8(payload, size, &offset, &purity)) { return false; }
+			cmd->purity[i] = (analysis_purity_t)purity;
+			if (!read_bytes(payload, size, &offset, cmd->read_zp[i], sizeof(cmd->read_zp[i]))) { return false; }
+		}
+	}
+
+	if (cmd->cmds & AUDIO_CMD_PATCH_ROM) {
+		uint32_t num_restores;
+		uint32_t num_patches;
+		if (!read_u32(payload, size, &offset, &cmd->patch_generation)) { return false; }
+		if (!read_u32(payload, size, &offset, &num_restores)) { return false; }
+		if (!read_u32(payload, size, &offset, &num_patches)) { return false; }
+		uint32_t max_patches = sizeof(cmd->patches) / sizeof(cmd->patches[0]);
+		if (num_patches > max_patches || num_restores > num_patches || num_restores > MAX_ROM_PATCHES) {
+			return false;
+		}
+		cmd->num_restores = (int)num_restores;
+		cmd->num_patches = (int)num_patches;
+		for (int i = 0; i < cmd->num_patches; ++i) {
+			analysis_patch_t* patch = &cmd->patches[i];
+			*patch = (analysis_patch_t){ 0 };
+			if (!read_u16(payload, size, &offset, &patch->addr)) { return false; }
+			if (!read_u8(payload, size, &offset, &patch->size)) { return false; }
+			if (patch->size > sizeof(patch->bytes)) { return false; }
+			if (!read_bytes(payload, size, &offset, patch->bytes, patch->size)) { return false; }
+			if (!read_u8(payload, size, &offset, &patch->zp_addr)) { return false; }
+			if (!read_u8(payload, size, &offset, &patch->zp_size)) { return false; }
+		}
+		if (!read_bytes(payload, size, &offset, cmd->patched_zp, sizeof(cmd->patched_zp))) { return false; }
+	}
+
+	return offset == size;
+}
+
+// Banks replaced before this command was sent can be unmapped once it has
+// been applied
+static void
+retire_sample_banks(uint32_t sequence) {
+	sample_bank_t* bank = sampler_take_retired(&main_thread_devices.sampler);
+	while (bank != NULL) {
+		sample_bank_t* next = bank->next_retired;
+		bank->retire_sequence = sequence;
+		bank->next_retired = retired_sample_banks;
+		retired_sample_banks = bank;
+		bank = next;
+	}
+}
+
+static void
+free_retired_sample_banks(uint32_t applied_sequence) {
+	sample_bank_t** link = &retired_sample_banks;
+	while (*link != NULL) {
+		sample_bank_t* bank = *link;
+		if (bank->retire_sequence <= applied_sequence) {
+			*link = bank->next_retired;
+			sample_bank_close(bank);
+		} else {
+			link = &bank->next_retired;
+		}
+	}
+}
+
+static void
+prefetch_samples(void) {
+	for (int i = 0; i < SAMPLER_MAX_BANKS; ++i) {
+		sample_bank_t* bank = main_thread_devices.sampler.banks[i];
+		if (bank != NULL) {
+			sample_bank_prefetch(bank);
+		}
+	}
+}
+
+// Must be called after the audio stream has stopped
+static void
+close_sample_banks(void) {
+	retire_sample_banks(0);
+	free_retired_sample_banks(0);
+	sampler_t* sampler = &main_thread_devices.sampler;
+	for (int i = 0; i < SAMPLER_MAX_BANKS; ++i) {
+		if (sampler->banks[i] != NULL) {
+			sample_bank_close(sampler->banks[i]);
+			sampler->banks[i] = NULL;
+		}
+	}
+}
+
+static void
+send_audio_cmd(audio_cmd_t* cmd) {
+	cmd->sequence = ++audio_cmd_sequence;
+	if (cmd->cmds & AUDIO_CMD_SYNC_SAMPLER) {
+		retire_sample_banks(cmd->sequence);
+	}
+	if (atomic_load_explicit(&recording_session, memory_order_relaxed)) {
+		record_audio_cmd(cmd);
+	}
+	tribuf_end_send(&audio_cmd_buf);
+}
+
+// Log the position at which the audio thread applied each command and each
+// control write
+static void
+drain_session_events(void) {
+	session_event_t event;
+	while (ring_read(&session_event_ring, &event, sizeof(event)) == sizeof(event)) {
+		uint8_t payload[5];
+		uint32_t size = 0;
+		if (event.type == SESSION_RECORD_CONTROL) {
+			append_u8(payload, &size, event.write.target);
+			append_u8(payload, &size, event.write.voice);
+			append_u8(payload, &size, event.write.address);
+			append_u16(payload, &size, event.write.value);
+		}
+		session_write(
+			&session,
+			&(session_record_t){
+				.type = event.type,
+				.sequence = event.sequence,
+				.position = event.position,
+				.payload_size = size,
+			},
+			size > 0 ? payload : NULL
+		);
+	}
+
+	size_t num_dropped = ring_num_dropped(&session_event_ring);
+	if (num_dropped != session_event_reported_drops) {
+		BLOG_WARN("Dropped %zu bytes of session records, replay will diverge", num_dropped - session_event_reported_drops);
+		session_event_reported_drops = num_dropped;
+	}
+}
+
+static bool
+decode_control_write(const uint8_t* payload, uint32_t size, control_write_t* write) {
+	uint32_t offset = 0;
+	*write = (control_write_t){ 0 };
+	if (!read_u8(payload, size, &offset, &write->target)) { return false; }
+	if (!read_u8(payload, size, &offset, &write->voice)) { return false; }
+	if (!read_u8(payload, size, &offset, &write->address)) { return false; }
+	if (!read_u16(payload, size, &offset, &write->value)) { return false; }
+	return offset == size
+		&& write->target <= CONTROL_WRITE_GAIN
+		&& write->voice < BYTEBEAT_MAX_VOICES;
+}
+
+// Must only be called once the audio thread has stopped
+static void
+finish_session(void) {
+	drain_session_events();
+	uint64_t position = atomic_load_explicit(&audio_position, memory_order_acquire);
+	session_write(
+		&session,
+		&(session_record_t){
+			.type = SESSION_RECORD_END,
+			.position = position,
+			.hash = atomic_load_explicit(&audio_output_hash, memory_order_acquire),
+		},
+		NULL
+	);
+	session_close(&session);
+	atomic_store(&recording_session, false);
+	BLOG_INFO(
+		"Recorded %.2f seconds of session to %s",
+		(double)position / (double)SAMPLING_RATE, session_file
+	);
+}
+
+static void
+replay_until(uint64_t* position, uint64_t end, uint64_t* hash, uint64_t* worst_block_ticks) {
+	float buffer[AUDIO_BLOCK_SIZE * 2];
+	while (*position < end) {
+		uint64_t remaining = end - *position;
+		int num_frames = remaining > AUDIO_BLOCK_SIZE ? AUDIO_BLOCK_SIZE : (int)remaining;
+
+		uint64_t block_start = stm_now();
+		render_audio(buffer, num_frames, 2, hash);
+		uint64_t block_ticks = stm_since(block_start);
+		// Normalize partial blocks so they compare to full ones
+		block_ticks = block_ticks * AUDIO_BLOCK_SIZE / num_frames;
+		*worst_block_ticks = block_ticks > *worst_block_ticks ? block_ticks : *worst_block_ticks;
+
+		*position += num_frames;
+	}
+}
+
+// Once rendering has stopped or when it happens on the calling thread
+static void
+log_voice_stats(void) {
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		const audio_voice_t* voice = &audio_voices[i];
+		if (voice->render_ticks == 0) { continue; }
+		BLOG_INFO(
+			"Voice %d: %.3f s, %s, %u tier-up(s), last warm-up took %.3f ms",
+			i, stm_sec(voice->render_ticks),
+			voice->devices.interpreted ? "interpreted" : "compiled",
+			voice->tier.num_promotions, stm_ms(voice->tier.warmup_ticks)
+		);
+		const lanes_t* lanes = &voice->lanes;
+		BLOG_INFO(
+			"Voice %d: %llu batch(es) tried in lanes, %llu diverged, %llu skipped",
+			i,
+			(unsigned long long)lanes->num_batches,
+			(unsigned long long)lanes->num_diverged,
+			(unsigned long long)lanes->num_skipped
+		);
+	}
+}
+
+// All voices share the same banks
+static void
+close_replayed_sample_banks(void) {
+	sample_bank_t** banks = audio_voices[0].devices.sampler.banks;
+	for (int i = 0; i < SAMPLER_MAX_BANKS; ++i) {
+		if (banks[i] != NULL) {
+			sample_bank_close(banks[i]);
+			banks[i] = NULL;
+		}
+	}
+}
+
+// Render a recorded session as fast as possible, without a window or an
+// audio device
+static int
+replay_session(const char* path) {
+	stm_setup();
+	trace_init(trace_file != NULL);
+	trace_set_thread_name("main");
+
+	session_t replay = { 0 };
+	if (!session_open_read(&replay, path)) {
+		BLOG_ERROR("Could not read session from %s", path);
+		return 1;
+	}
+	if (replay.sample_rate != SAMPLING_RATE) {
+		BLOG_ERROR("Session was recorded at %d Hz, expected %d Hz", replay.sample_rate, SAMPLING_RATE);
+		session_close(&replay);
+		return 1;
+	}
+
+	init_audio_voices();
+
+	// Commands are applied in the order they were consumed, which is not
+	// the order they were sent when some are superseded
+	long* cmd_offsets = NULL;
+	uint32_t num_cmd_offsets = 0;
+	static audio_cmd_t cmd;
+
+	int status = 0;
+	bool ended = false;
+	uint64_t position = 0;
+	uint64_t hash = SESSION_HASH_INIT;
+	uint64_t worst_block_ticks = 0;
+	int num_commands = 0;
+	int num_control_writes = 0;
+	uint64_t replay_start = stm_now();
+	while (!ended) {
+		long offset = session_tell(&replay);
+		session_record_t record;
+		const void* payload;
+		if (!session_read(&replay, &record, &payload)) {
+			BLOG_WARN("Session ends without an end record, it may be truncated");
+			break;
+		}
+
+		switch ((session_record_type_t)record.type) {
+			case SESSION_RECORD_COMMAND:
+				if (record.sequence >= num_cmd_offsets) {
+					uint32_t new_size = num_cmd_offsets > 0 ? num_cmd_offsets : 64;
+					while (new_size <= record.sequence) { new_size *= 2; }
+					cmd_offsets = realloc(cmd_offsets, sizeof(long) * new_size);
+					memset(cmd_offsets + num_cmd_offsets, 0, sizeof(long) * (new_size - num_cmd_offsets));
+					num_cmd_offsets = new_size;
+				}
+				cmd_offsets[record.sequence] = offset;
+				break;
+			case SESSION_RECORD_CONSUMED:
+				replay_until(&position, record.position, &hash, &worst_block_ticks);
+				session_record_t cmd_record;
+				if (
+					record.sequence >= num_cmd_offsets
+					|| cmd_offsets[record.sequence] == 0
+					|| !session_read_at(&replay, cmd_offsets[record.sequence], &cmd_record, &payload)
+					|| !decode_audio_cmd(payload, cmd_record.payload_size, &cmd)
+				) {
+					BLOG_ERROR("Command %u is missing or corrupted", record.sequence);
+					status = 1;
+					ended = true;
+					break;
+				}
+				// Every bank is opened again when decoding so the
+				// previous ones are no longer used after this
+				if (cmd.cmds & AUDIO_CMD_SYNC_SAMPLER) {
+					close_replayed_sample_banks();
+				}
+				process_audio_command(&cmd);
+				++num_commands;
+				break;
+			case SESSION_RECORD_CONTROL:
+				replay_until(&position, record.position, &hash, &worst_block_ticks);
+				control_write_t write;
+				if (!decode_control_write(payload, record.payload_size, &write)) {
+					BLOG_ERROR("Control write at %llu is corrupted", (unsigned long long)record.position);
+					status = 1;
+					ended = true;
+					break;
+				}
+				apply_control_write(&write);
+				++num_control_writes;
+				break;
+			case SESSION_RECORD_END:
+				replay_until(&position, record.position, &hash, &worst_block_ticks);
+				if (hash == record.hash) {
+					BLOG_INFO("Output is identical to the live session");
+				} else {
+					BLOG_ERROR("Output differs from the live session");
+					status = 1;
+				}
+				ended = true;
+				break;
+			default:
+				BLOG_WARN("Skipping unknown record type %u", record.type);
+				break;
+		}
+
+		drain_audio_output();
+	}
+	double replay_seconds = stm_sec(stm_since(replay_start));
+	double audio_seconds = (double)position / (double)SAMPLING_RATE;
+
+	BLOG_INFO(
+		"Replayed %.2f s of audio, %d commands and %d control writes in %.3f s (%.1fx real time)",
+		audio_seconds, num_commands, num_control_writes, replay_seconds,
+		replay_seconds > 0.0 ? audio_seconds / replay_seconds : 0.0
+	);
+	BLOG_INFO(
+		"Slowest block took %.3f ms, the deadline is %.3f ms",
+		stm_ms(worst_block_ticks),
+		(double)AUDIO_BLOCK_SIZE / (double)SAMPLING_RATE * 1000.0
+	);
+	log_voice_stats();
+
+	free(cmd_offsets);
+	session_close(&replay);
+	close_replayed_sample_banks();
+	cleanup_audio_voices();
+	drain_audio_output();
+
+	if (trace_is_enabled()) {
+		write_trace();
+	}
+	trace_cleanup();
+
+	return status;
+}
+
+static void
+request_stop(int signal) {
+	(void)signal;
+	stop_requested = 1;
+}
+
+// The same figures as the profiler overlay, logged instead of drawn
+static void
+report_headless_stats(void) {
+	unsigned peak_load = atomic_exchange_explicit(&audio_peak_load, 0, memory_order_relaxed);
+	headless_audio_stats_t stats = headless_audio_stats();
+	BLOG_INFO(
+		"Callbacks: %llu, overruns: %llu, peak load: %.1f%%",
+		(unsigned long long)stats.num_callbacks,
+		(unsigned long long)stats.num_overruns,
+		(double)peak_load / 10.0
+	);
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		const audio_voice_state_t* voice_state = &last_audio_state.voices[i];
+		if (voice_state->render_ticks == 0) { continue; }
+		BLOG_INFO(
+			"Voice %d: %s, %s, %u tier-up(s), last warm-up took %.3f ms",
+			i, analysis_purity_name(vector_analysis.analyses[i].purity),
+			voice_state->interpreted ? "interpreted" : "compiled",
+			voice_state->num_promotions, stm_ms(voice_state->warmup_ticks)
+		);
+	}
+
+	if (!profiling) { return; }
+
+	double elapsed = stm_sec(stm_since(profile_start));
+	double load = elapsed > 0.0 ? profiler.total_seconds / elapsed : 0.0;
+	BLOG_INFO("Load: %5.1f%%", load * 100.0);
+	profiler_entry_t entries[PROFILER_TOP_ENTRIES];
+	int num_entries = profiler_top(&profiler, entries, PROFILER_TOP_ENTRIES);
+	for (int i = 0; i < num_entries; ++i) {
+		double share = profiler.total_seconds > 0.0
+			? entries[i].seconds / profiler.total_seconds
+			: 0.0;
+		BLOG_INFO("%5.1f%% %s", share * 100.0, profiler_symbol_name(&profiler, entries[i].symbol));
+	}
+}
+
+// Run without a window or an audio device.
+// A timer thread stands in for the audio backend and the main thread VM is
+// updated at the same rate as the GUI would.
+static int
+run_headless(int width, int height) {
+	stm_setup();
+	trace_init(trace_file != NULL);
+	trace_set_thread_name("main");
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+
+	init_main_vm(width, height);
+	init_engine();
+
+	int num_buffer_frames = buffer_frames > 0 ? buffer_frames : HEADLESS_BUFFER_FRAMES;
+	bool started = headless_audio_setup(&(headless_audio_desc_t){
+		.sample_rate = SAMPLING_RATE,
+		.num_channels = 2,
+		.buffer_frames = num_buffer_frames,
+		.sink = headless_sink,
+		.stream_cb = audio,
+	});
+	if (!started) {
+		cleanup_engine();
+		return 1;
+	}
+	BLOG_INFO("Audio buffer: %d frames", num_buffer_frames);
+	if (record_file != NULL) {
+		capture_start(&capture, record_file, 2);
+	}
+
+	int status = 0;
+	uint64_t start = stm_now();
+	uint64_t last_report = start;
+	while (!stop_requested) {
+		uint64_t frame_trace_start = trace_begin();
+		if (sync_audio()) {
+			follow_audio_state();
+		}
+		// Nothing is drawn but the screen vector may still drive the tune
+		buxn_screen_update(main_thread_vm);
+		trace_end("frame", frame_trace_start);
+
+		if (headless_audio_stats().sink_failed) {
+			BLOG_ERROR("Could not write to stdout");
+			status = 1;
+			break;
+		}
+
+		uint64_t now = stm_now();
+		if (stm_sec(stm_diff(now, last_report)) >= HEADLESS_REPORT_INTERVAL_S) {
+			report_headless_stats();
+			last_report = now;
+		}
+		if (duration > 0 && stm_sec(stm_diff(now, start)) >= duration) { break; }
+
+		headless_sleep(FRAME_TIME_US / 1000000.0);
+	}
+
+	headless_audio_shutdown();
+	report_headless_stats();
+	cleanup_engine();
+
+	return status;
+}
+
+// Render audio as fast as possible on the main thread, with one main thread
+// frame per callback.
+// This is the workload used to compare builds and to train PGO builds.
+static int
+run_bench(int width, int height) {
+	stm_setup();
+	trace_init(trace_file != NULL);
+	trace_set_thread_name("main");
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+
+	init_main_vm(width, height);
+	init_engine();
+
+	int num_buffer_frames = buffer_frames > 0 ? buffer_frames : HEADLESS_BUFFER_FRAMES;
+	float* buffer = malloc(sizeof(float) * num_buffer_frames * 2);
+	if (record_file != NULL) {
+		capture_start(&capture, record_file, 2);
+	}
+
+	uint64_t total_frames = (uint64_t)bench_seconds * SAMPLING_RATE;
+	uint64_t num_frames = 0;
+	uint64_t audio_ticks = 0;
+	uint64_t worst_callback_ticks = 0;
+	uint64_t start = stm_now();
+	while (num_frames < total_frames && !stop_requested) {
+		if (sync_audio()) {
+			follow_audio_state();
+		}
+		buxn_screen_update(main_thread_vm);
+
+		int callback_frames = (int)(total_frames - num_frames < (uint64_t)num_buffer_frames
+			? total_frames - num_frames
+			: (uint64_t)num_buffer_frames);
+		uint64_t callback_start = stm_now();
+		audio(buffer, callback_frames, 2);
+		uint64_t callback_ticks = stm_since(callback_start);
+		audio_ticks += callback_ticks;
+		worst_callback_ticks = callback_ticks > worst_callback_ticks ? callback_ticks : worst_callback_ticks;
+		num_frames += (uint64_t)callback_frames;
+	}
+	double elapsed_seconds = stm_sec(stm_since(start));
+	double audio_seconds = (double)num_frames / (double)SAMPLING_RATE;
+
+	BLOG_INFO(
+		"Rendered %.2f s of audio in %.3f s (%.1fx real time), %.3f s in the audio callback",
+		audio_seconds, elapsed_seconds,
+		elapsed_seconds > 0.0 ? audio_seconds / elapsed_seconds : 0.0,
+		stm_sec(audio_ticks)
+	);
+	BLOG_INFO(
+		"Slowest callback took %.3f ms, the deadline is %.3f ms",
+		stm_ms(worst_callback_ticks),
+		(double)num_buffer_frames / (double)SAMPLING_RATE * 1000.0
+	);
+	log_voice_stats();
+
+	free(buffer);
+	cleanup_engine();
+	return stop_requested ? 1 : 0;
+}
+
+// Render further ahead when blocks come close to their deadline and come
+// back once the tune has been cheap for a while.
+// The device keeps running: the FIFO fills up or drains on its own.
+static void
+update_adaptive_buffer(void) {
+	unsigned load = atomic_exchange_explicit(&audio_peak_load, 0, memory_order_relaxed);
+	adaptive.peak_load = load > adaptive.peak_load ? load : adaptive.peak_load;
+
+	uint64_t now = stm_now();
+	if (stm_sec(stm_diff(now, adaptive.window_start)) < ADAPTIVE_WINDOW_S) { return; }
+	adaptive.window_start = now;
+	double peak_load = (double)adaptive.peak_load / 1000.0;
+	adaptive.peak_load = 0;
+
+	uint64_t num_underruns = prerender_num_underruns();
+	if (num_underruns != adaptive.reported_underruns) {
+		BLOG_WARN(
+			"Audio ran dry %llu times",
+			(unsigned long long)(num_underruns - adaptive.reported_underruns)
+		);
+		adaptive.reported_underruns = num_underruns;
+	}
+
+	int current_frames = prerender_target();
+	int new_frames = current_frames;
+	if (peak_load > ADAPTIVE_GROW_LOAD) {
+		adaptive.num_cheap_windows = 0;
+		if (current_frames < ADAPTIVE_MAX_BUFFER_FRAMES) {
+			new_frames = current_frames * 2;
+		}
+	} else if (peak_load < ADAPTIVE_SHRINK_LOAD && current_frames > adaptive.min_buffer_frames) {
+		if (++adaptive.num_cheap_windows >= ADAPTIVE_SHRINK_WINDOWS) {
+			adaptive.num_cheap_windows = 0;
+			new_frames = current_frames / 2;
+		}
+	} else {
+		adaptive.num_cheap_windows = 0;
+	}
+
+	if (new_frames != current_frames) {
+		BLOG_INFO(
+			"Audio peaked at %.0f%% of its deadline, rendering %d frames ahead",
+			peak_load * 100.0, new_frames
+		);
+		prerender_set_target(new_frames);
+	}
+}
+
+// Fault in everything the audio threads touch then lock it in memory
+static void
+prepare_realtime(void) {
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		audio_voice_t* voice = &audio_voices[i];
+		realtime_prefault(voice->vm, sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
+		realtime_prefault(voice->tier.vm, sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
+		realtime_prefault(voice->fade.vm, sizeof(buxn_vm_t) + BUXN_MEMORY_BANK_SIZE);
+		realtime_prefault(voice, sizeof(*voice));
+		realtime_prefault(voice->checkpoints, sizeof(checkpoints_t));
+	}
+	realtime_prefault(audio_cmds, sizeof(audio_cmds));
+	realtime_prefault(audio_states, sizeof(audio_states));
+	realtime_prefault(&fx_chain, sizeof(fx_chain));
+	realtime_prefault(audio_log_storage, sizeof(audio_log_storage));
+
+	// JIT arenas grow while running so they rely on future allocations being
+	// locked as well
+	realtime_lock_memory();
+
+	for (int i = 1; i < BYTEBEAT_MAX_VOICES; ++i) {
+		worker_t* worker = &audio_voices[i].worker;
+		if (!worker->running) { continue; }
+
+		int error = realtime_promote_thread(worker->thread);
+		if (error != 0) {
+			BLOG_WARN("Could not raise the priority of voice %d: %s", i, realtime_describe_error(error));
+		}
+	}
+
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		worker_t* worker = &audio_voices[i].fade.worker;
+		if (!worker->running) { continue; }
+
+		int error = realtime_promote_thread(worker->thread);
+		if (error != 0) {
+			BLOG_WARN("Could not raise the priority of the crossfade of voice %d: %s", i, realtime_describe_error(error));
+		}
+	}
+}
+
+// Output of the tune must not end up in the audio stream
+static FILE*
+console_out_file(void) {
+	return headless && headless_sink == HEADLESS_SINK_STDOUT ? stderr : stdout;
+}
+
+static void
+drain_console(ring_t* ring, FILE* file) {
+	char buffer[CONSOLE_RING_SIZE];
+	size_t size = ring_read(ring, buffer, sizeof(buffer));
+	if (size > 0) {
+		fwrite(buffer, 1, size, file);
+		fflush(file);
+	}
+}
+
+// Write out console output and logs which were queued by the audio threads
+static void
+drain_audio_output(void) {
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		audio_voice_t* voice = &audio_voices[i];
+		drain_console(&voice->console_out, console_out_file());
+		drain_console(&voice->console_err, stderr);
+
+		size_t num_dropped = ring_num_dropped(&voice->console_out)
+			+ ring_num_dropped(&voice->console_err);
+		if (num_dropped != voice->num_reported_drops) {
+			BLOG_WARN(
+				"Dropped %zu bytes of console output from voice %d",
+				num_dropped - voice->num_reported_drops, i
+			);
+			voice->num_reported_drops = num_dropped;
+		}
+	}
+
+	audio_log_record_t record;
+	size_t header_size = offsetof(audio_log_record_t, message);
+	while (ring_read(&audio_log_ring, &record, header_size) == header_size) {
+		ring_read(&audio_log_ring, record.message, record.length);
+		blog_write(record.level, record.file, record.line, "%.*s", record.length, record.message);
+	}
+
+	unsigned num_dropped_blocks = capture_num_dropped_blocks(&capture);
+	if (capture_is_recording(&capture) && num_dropped_blocks != capture_reported_drops) {
+		BLOG_WARN(
+			"Recording dropped %u blocks, the disk is too slow",
+			num_dropped_blocks - capture_reported_drops
+		);
+		capture_reported_drops = num_dropped_blocks;
+	}
+
+	size_t num_dropped = ring_num_dropped(&audio_log_ring);
+	if (num_dropped != audio_log_reported_drops) {
+		BLOG_WARN(
+			"Dropped %zu bytes of logs from the audio thread",
+			num_dropped - audio_log_reported_drops
+		);
+		audio_log_reported_drops = num_dropped;
+	}
+
+	standby_voice_t* standby;
+	while (ring_read(&standby_return_ring, &standby, sizeof(standby)) == sizeof(standby)) {
+		free_standby_voice(standby);
+	}
+
+	if (atomic_load_explicit(&recording_session, memory_order_relaxed)) {
+		drain_session_events();
+	}
+}
+
+// Attribute the render time of each voice since the last update
+static void
+update_profiler(void) {
+	bytebeat_t* bytebeat = &main_thread_devices.bytebeat;
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		audio_voice_state_t* voice_state = &last_audio_state.voices[i];
+		uint64_t ticks = stm_diff(voice_state->render_ticks, profiled_ticks[i]);
+		profiled_ticks[i] = voice_state->render_ticks;
+		if (!bytebeat_voice_is_active(bytebeat, i)) { continue; }
+
+		memcpy(profiler_vm->memory, main_thread_vm->memory, BUXN_MEMORY_BANK_SIZE);
+		memcpy(profiler_vm->device, main_thread_vm->device, sizeof(main_thread_vm->device));
+		profiler_devices.bytebeat = *bytebeat;
+		profiler_devices.bytebeat.voice = i;
+		profiler_devices.fpu = main_thread_devices.fpu;
+		memcpy(
+			profiler_devices.sampler.banks,
+			main_thread_devices.sampler.banks,
+			sizeof(profiler_devices.sampler.banks)
+		);
+
+		bytebeat_voice_t* voice = &profiler_devices.bytebeat.voices[i];
+		voice->t = voice_state->t;
+		voice->v = voice_state->v;
+		profiler_sample(
+			&profiler,
+			profiler_vm,
+			voice,
+			bytebeat->options,
+			PROFILER_BUDGET_S,
+			stm_sec(ticks)
+		);
+	}
+}
+
+static int
+append_text(char* text, size_t size, int length, const char* fmt, ...) {
+	if ((size_t)length >= size) { return length; }
+
+	va_list args;
+	va_start(args, fmt);
+	int num_chars = vsnprintf(text + length, size - length, fmt, args);
+	va_end(args);
+
+	length += num_chars > 0 ? num_chars : 0;
+	return (size_t)length < size ? length : (int)size - 1;
+}
+
+// The overlay is formatted on the screen thread, which owns the profiler
+static int
+format_profiler_overlay(char* text, size_t size) {
+	int length = 0;
+	double elapsed = stm_sec(stm_since(profile_start));
+	double load = elapsed > 0.0 ? profiler.total_seconds / elapsed : 0.0;
+	length = append_text(text, size, length, "Load: %5.1f%%\n", load * 100.0);
+	ticker_stats_t screen_stats = ticker_stats(&screen_ticker);
+	if (screen_stats.num_overruns > 0) {
+		length = append_text(
+			text, size, length,
+			"Screen: %llu overruns, %llu skipped frames\n",
+			(unsigned long long)screen_stats.num_overruns,
+			(unsigned long long)screen_stats.num_skipped
+		);
+	}
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		const audio_voice_state_t* voice_state = &last_audio_state.voices[i];
+		if (voice_state->render_ticks == 0) { continue; }
+		length = append_text(
+			text, size, length,
+			"Voice %d: %s, %s (%u tier-ups, %.1f ms)\n",
+			i, analysis_purity_name(vector_analysis.analyses[i].purity),
+			voice_state->interpreted ? "interpreted" : "compiled",
+			voice_state->num_promotions, stm_ms(voice_state->warmup_ticks)
+		);
+	}
+	length = append_text(text, size, length, "\n");
+
+	profiler_entry_t entries[PROFILER_TOP_ENTRIES];
+	int num_entries = profiler_top(&profiler, entries, PROFILER_TOP_ENTRIES);
+	for (int i = 0; i < num_entries; ++i) {
+		double share = profiler.total_seconds > 0.0
+			? entries[i].seconds / profiler.total_seconds
+			: 0.0;
+		length = append_text(
+			text, size, length,
+			"%5.1f%% %s\n",
+			share * 100.0,
+			profiler_symbol_name(&profiler, entries[i].symbol)
+		);
+	}
+
+	return length;
+}
+
+static void
+draw_profiler_overlay(float width, float height) {
+	sdtx_canvas(width * 0.5f, height * 0.5f);
+	sdtx_origin(1.f, 1.f);
+	sdtx_color3b(255, 255, 255);
+	sdtx_puts(screen_view.overlay);
+}
+
+// Render consecutive frames starting from voice->t and advance it by voice->v.
+// Batches of frames are rendered in lanes when the vector allows it.
+static void
+render_frames(
+	buxn_vm_t* vm,
+	lanes_t* lanes,
+	bytebeat_voice_t* voice,
+	int16_t* left,
+	int16_t* right,
+	int num_frames
+) {
+	devices_t* devices = vm->config.userdata;
+	bytebeat_t* device = &devices->bytebeat;
+	uint8_t options = device->options;
+	buxn_jit_t* jit = devices->interpreted ? NULL : devices->jit_state->jit;
+
+	int i = 0;
+	while (i < num_frames) {
+		int batch_size = num_frames - i < LANES_WIDTH ? num_frames - i : LANES_WIDTH;
+
+		if (batch_size == LANES_WIDTH && !no_lanes && lanes_should_try(lanes, voice->vector)) {
+			bytebeat_frame_t frames[LANES_WIDTH];
+			lanes_result_t result = lanes_render(
+				lanes, vm, device, voice, options, voice->t, frames
+			);
+			if (result == LANES_OK) {
+				for (int j = 0; j < LANES_WIDTH; ++j) {
+					left[i + j] = frames[j].left;
+					right[i + j] = frames[j].right;
+				}
+				voice->t += voice->v * LANES_WIDTH;
+				i += LANES_WIDTH;
+				continue;
+			}
+		}
+
+		// Diverged or unsupported, render the batch one frame at a time
+		for (int j = 0; j < batch_size; ++j, voice->t += voice->v) {
+			bytebeat_frame_t frame = bytebeat_render(vm, jit, voice, options, voice->t);
+			left[i + j] = frame.left;
+			right[i + j] = frame.right;
+		}
+		i += batch_size;
+	}
+}
+
+static float
+lerp(float x, float from, float to) {
+	return from * (1.f - x) + to * x;
+}
+
+static void
+handle_input(const input_event_t* input) {
+	const sapp_event* event = &input->event;
+	bool update_mouse = false;
+	buxn_mouse_t* mouse = &main_thread_devices.mouse;
+	buxn_controller_t* controller = &main_thread_devices.controller;
+
+	switch (event->type) {
+		case SAPP_EVENTTYPE_MOUSE_UP:
+		case SAPP_EVENTTYPE_MOUSE_DOWN: {
+			int button;
+			switch (event->mouse_button) {
+				case SAPP_MOUSEBUTTON_LEFT:
+					button = 0;
 					break;
 				case SAPP_MOUSEBUTTON_RIGHT:
 					button = 2;
@@ -369,409 +2801,1663 @@ event(const sapp_event* event) {
 					button = -1;
 					break;
 			}
-			if (button >= 0) {
-				buxn_mouse_set_button(
-					mouse,
-					button,
-					event->type == SAPP_EVENTTYPE_MOUSE_DOWN
+			if (button >= 0) {
+				buxn_mouse_set_button(
+					mouse,
+					button,
+					event->type == SAPP_EVENTTYPE_MOUSE_DOWN
+				);
+				update_mouse = true;
+			}
+		} break;
+		case SAPP_EVENTTYPE_MOUSE_SCROLL:
+			mouse->scroll_x = (int16_t)event->scroll_x;
+			mouse->scroll_y = -(int16_t)event->scroll_y;
+			update_mouse = true;
+			break;
+		case SAPP_EVENTTYPE_MOUSE_MOVE: {
+			mouse->x = event->mouse_x;
+			mouse->y = event->mouse_y;
+			update_mouse = true;
+		} break;
+		case SAPP_EVENTTYPE_KEY_DOWN:
+		case SAPP_EVENTTYPE_KEY_UP: {
+			bool down = event->type == SAPP_EVENTTYPE_KEY_DOWN;
+			int button = -1;
+			char ch = 0;
+			switch (event->key_code) {
+				case SAPP_KEYCODE_LEFT_CONTROL:
+				case SAPP_KEYCODE_RIGHT_CONTROL:
+					button = BUXN_CONTROLLER_BTN_A;
+					break;
+				case SAPP_KEYCODE_LEFT_ALT:
+				case SAPP_KEYCODE_RIGHT_ALT:
+					button = BUXN_CONTROLLER_BTN_B;
+					break;
+				case SAPP_KEYCODE_LEFT_SHIFT:
+				case SAPP_KEYCODE_RIGHT_SHIFT:
+					button = BUXN_CONTROLLER_BTN_SELECT;
+					break;
+				case SAPP_KEYCODE_HOME:
+					button = BUXN_CONTROLLER_BTN_START;
+					break;
+				case SAPP_KEYCODE_UP:
+					button = BUXN_CONTROLLER_BTN_UP;
+					break;
+				case SAPP_KEYCODE_DOWN:
+					button = BUXN_CONTROLLER_BTN_DOWN;
+					break;
+				case SAPP_KEYCODE_LEFT:
+					button = BUXN_CONTROLLER_BTN_LEFT;
+					break;
+				case SAPP_KEYCODE_RIGHT:
+					button = BUXN_CONTROLLER_BTN_RIGHT;
+					break;
+				case SAPP_KEYCODE_ENTER:
+					ch = '\r';
+					break;
+				case SAPP_KEYCODE_ESCAPE:
+					ch = 27;
+					break;
+				case SAPP_KEYCODE_BACKSPACE:
+					ch = 8;
+					break;
+				case SAPP_KEYCODE_TAB:
+					ch = '\t';
+					break;
+				case SAPP_KEYCODE_DELETE:
+					ch = 127;
+					break;
+				case SAPP_KEYCODE_F2:
+					if (down && !event->key_repeat) { toggle_profiler(); }
+					break;
+				case SAPP_KEYCODE_F3:
+					if (down && !event->key_repeat) { write_profile(); }
+					break;
+				case SAPP_KEYCODE_F4:
+					if (down && !event->key_repeat) { write_trace(); }
+					break;
+				case SAPP_KEYCODE_F5:
+					if (down && !event->key_repeat) { toggle_recording(); }
+					break;
+				case SAPP_KEYCODE_PAGE_UP:
+					if (down && !event->key_repeat) { switch_tune(-1); }
+					break;
+				case SAPP_KEYCODE_PAGE_DOWN:
+					if (down && !event->key_repeat) { switch_tune(1); }
+					break;
+				default:
+					break;
+			}
+			if (button >= 0) {
+				buxn_controller_send_button(main_thread_vm, controller, 0, button, down);
+			}
+			if (ch > 0 && down) {
+				buxn_controller_send_char(main_thread_vm, controller, ch);
+			}
+		} break;
+		case SAPP_EVENTTYPE_CHAR: {
+			uint32_t ch = event->char_code;
+			if (ch <= 127) {
+				// Sync the modifiers in case we missed their release due to
+				// focus change
+				buxn_controller_set_button(
+					controller,
+					0,
+					BUXN_CONTROLLER_BTN_A,
+					(event->modifiers & SAPP_MODIFIER_CTRL) != 0
+				);
+				buxn_controller_set_button(
+					controller,
+					0,
+					BUXN_CONTROLLER_BTN_B,
+					(event->modifiers & SAPP_MODIFIER_ALT) != 0
+				);
+				buxn_controller_set_button(
+					controller,
+					0,
+					BUXN_CONTROLLER_BTN_SELECT,
+					(event->modifiers & SAPP_MODIFIER_SHIFT) != 0
+				);
+				// Send the actual character
+				buxn_controller_send_char(main_thread_vm, controller, ch);
+			}
+		} break;
+		case SAPP_EVENTTYPE_FILES_DROPPED:
+			if (input->dropped_file != NULL) {
+				free(dropped_file);
+				dropped_file = input->dropped_file;
+				input_file = dropped_file;
+				for (int i = 0; i < playlist.num_tunes; ++i) {
+					if (strcmp(playlist.tunes[i].path, input_file) == 0) {
+						playlist.current = i;
+					}
+				}
+				ubeat_asm_set_entry_file(input_file);
+				try_reload_formula();
+			}
+			break;
+		default: break;
+	}
+
+	if (update_mouse) {
+		buxn_mouse_update(main_thread_vm);
+		mouse->scroll_x = mouse->scroll_y = 0;
+	}
+}
+
+// Run the mouse and controller vectors for the events since the last tick
+static void
+process_input(void) {
+	input_event_t input;
+	while (ring_read(&input_ring, &input, sizeof(input)) == sizeof(input)) {
+		handle_input(&input);
+	}
+
+	size_t num_dropped = ring_num_dropped(&input_ring);
+	if (num_dropped != input_reported_drops) {
+		BLOG_WARN(
+			"Dropped %zu input events, the screen thread is not keeping up",
+			(num_dropped - input_reported_drops) / sizeof(input_event_t)
+		);
+		input_reported_drops = num_dropped;
+	}
+}
+
+// Forward input to the screen thread
+static void
+event(const sapp_event* event) {
+	switch (event->type) {
+		case SAPP_EVENTTYPE_MOUSE_UP:
+		case SAPP_EVENTTYPE_MOUSE_DOWN:
+		case SAPP_EVENTTYPE_MOUSE_SCROLL:
+		case SAPP_EVENTTYPE_MOUSE_MOVE:
+		case SAPP_EVENTTYPE_KEY_DOWN:
+		case SAPP_EVENTTYPE_KEY_UP:
+		case SAPP_EVENTTYPE_CHAR:
+		case SAPP_EVENTTYPE_FILES_DROPPED:
+			break;
+		default:
+			return;
+	}
+
+	input_event_t input = { .event = *event };
+	if (event->type == SAPP_EVENTTYPE_FILES_DROPPED) {
+		// The path is only valid during the callback
+		if (sapp_get_num_dropped_files() == 0) { return; }
+		const char* path = sapp_get_dropped_file_path(0);
+		size_t length = strlen(path);
+		input.dropped_file = malloc(length + 1);
+		memcpy(input.dropped_file, path, length + 1);
+	}
+
+	if (!ring_write(&input_ring, &input, sizeof(input))) {
+		free(input.dropped_file);
+	}
+	if (!screen_thread_running) {
+		process_input();
+	}
+}
+
+static void
+blit_layer_texture(layer_texture_t* texture, float width, float height) {
+	sgl_texture(texture->view, screen_sampler);
+	sgl_c1i(0xffffffff);
+	sgl_begin_quads();
+	{
+		sgl_v2f_t2f(0.f, 0.f, 0.f, 0.f);
+		sgl_v2f_t2f(width, 0.f, 1.f, 0.f);
+		sgl_v2f_t2f(width, height, 1.f, 1.f);
+		sgl_v2f_t2f(0.f, height, 0.f, 1.f);
+	}
+	sgl_end();
+}
+
+// The audio thread has already applied these.
+// Applying them to the main thread VM without sync bits keeps the next
+// zero page sync from undoing them.
+static void
+follow_control_writes(void) {
+	control_write_t write;
+	while (control_read(&control.main_ring, &write)) {
+		if (write.target == CONTROL_WRITE_ZERO_PAGE) {
+			main_thread_vm->memory[write.address] = (uint8_t)write.value;
+			last_zero_page[write.address] = (uint8_t)write.value;
+			continue;
+		}
+
+		bytebeat_voice_t* voice = &main_thread_devices.bytebeat.voices[write.voice];
+		switch ((control_target_t)write.target) {
+			case CONTROL_WRITE_T:
+				voice->t = write.value;
+				break;
+			case CONTROL_WRITE_V:
+				voice->v = write.value;
+				break;
+			case CONTROL_WRITE_VECTOR:
+				voice->vector = write.value;
+				break;
+			case CONTROL_WRITE_GAIN:
+				voice->gain = (uint8_t)write.value;
+				break;
+			case CONTROL_WRITE_ZERO_PAGE:
+				break;
+		}
+	}
+
+	size_t num_dropped = ring_num_dropped(&control.audio_ring);
+	if (num_dropped != control_reported_drops) {
+		BLOG_WARN(
+			"Dropped %zu control writes, the audio thread is not keeping up",
+			(num_dropped - control_reported_drops) / sizeof(control_write_t)
+		);
+		control_reported_drops = num_dropped;
+	}
+
+	unsigned num_invalid_packets = control_num_invalid_packets(&control);
+	if (num_invalid_packets != control_reported_invalid_packets) {
+		BLOG_WARN("Ignored %u invalid control packets", num_invalid_packets - control_reported_invalid_packets);
+		control_reported_invalid_packets = num_invalid_packets;
+	}
+}
+
+// Send changes made by the main thread VM and receive the state of the audio
+// thread.
+// Returns whether a new state was received.
+static bool
+sync_audio(void) {
+	bytebeat_t* bytebeat = &main_thread_devices.bytebeat;
+	fx_t* fx = &main_thread_devices.fx;
+	sampler_t* sampler = &main_thread_devices.sampler;
+	audio_cmd_t* cmd = NULL;
+
+	if (control_is_running(&control)) {
+		follow_control_writes();
+	}
+
+	if (bytebeat_sync_bits(bytebeat) != 0) {
+		cmd = cmd == NULL ? tribuf_begin_send(&audio_cmd_buf) : cmd;
+		// Changes from an unsent command must still be synced
+		if (cmd->cmds & AUDIO_CMD_SYNC_BYTEBEAT) {
+			bytebeat->sync_bits |= cmd->bytebeat.sync_bits;
+			for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+				bytebeat->voices[i].sync_bits |= cmd->bytebeat.voices[i].sync_bits;
+			}
+		}
+		cmd->bytebeat = *bytebeat;
+		cmd->cmds |= AUDIO_CMD_SYNC_BYTEBEAT;
+
+		bytebeat->sync_bits = 0;
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			bytebeat->voices[i].sync_bits = 0;
+		}
+	}
+
+	if (fx->sync_bits != 0) {
+		cmd = cmd == NULL ? tribuf_begin_send(&audio_cmd_buf) : cmd;
+		// Slots from an unsent command must still be synced
+		uint8_t pending_bits = (cmd->cmds & AUDIO_CMD_SYNC_FX) ? cmd->fx.sync_bits : 0;
+		cmd->fx = *fx;
+		cmd->fx.sync_bits |= pending_bits;
+		cmd->cmds |= AUDIO_CMD_SYNC_FX;
+		fx->sync_bits = 0;
+	}
+
+	if (sampler->sync_bits != 0) {
+		cmd = cmd == NULL ? tribuf_begin_send(&audio_cmd_buf) : cmd;
+		// All banks are sent so nothing from an unsent command is lost
+		memcpy(cmd->sample_banks, sampler->banks, sizeof(cmd->sample_banks));
+		cmd->cmds |= AUDIO_CMD_SYNC_SAMPLER;
+		sampler->sync_bits = 0;
+	}
+
+	if (memcmp(last_zero_page, main_thread_vm->memory, sizeof(last_zero_page))) {
+		cmd = cmd == NULL ? tribuf_begin_send(&audio_cmd_buf) : cmd;
+		// Only the bytes changed here are sent so control writes which reach
+		// the audio thread before this command are not undone
+		for (int i = 0; i < 256; ++i) {
+			if (main_thread_vm->memory[i] != last_zero_page[i]) {
+				cmd->zero_page[i] = main_thread_vm->memory[i];
+				cmd->zero_page_mask[i / 32] |= 1u << (i % 32);
+			}
+		}
+		cmd->cmds |= AUDIO_CMD_SYNC_ZERO_PAGE;
+		memcpy(last_zero_page, main_thread_vm->memory, sizeof(cmd->zero_page));
+	}
+
+	cmd = analyze_vectors(cmd, false);
+	cmd = specialize_zero_page(cmd, false);
+
+	if (cmd != NULL) {
+		send_audio_cmd(cmd);
+	}
+
+	prefetch_samples();
+
+	try_reload_formula();
+	drain_audio_output();
+	if (adaptive_buffer && !headless) {
+		update_adaptive_buffer();
+	}
+	uint64_t trace_start = trace_begin();
+	tribuf_try_swap(&audio_cmd_buf);
+	trace_end("tribuf_try_swap", trace_start);
+
+	trace_start = trace_begin();
+	audio_state_t* audio_state_ptr = tribuf_begin_recv(&audio_state_buf);
+	if (audio_state_ptr != NULL) {
+		last_audio_state = *audio_state_ptr;
+		tribuf_end_recv(&audio_state_buf);
+		trace_end("tribuf_recv", trace_start);
+
+		// A fading rom may still read the banks it had
+		if (!last_audio_state.crossfading) {
+			free_retired_sample_banks(last_audio_state.cmd_sequence);
+		}
+
+		if (profiling) {
+			update_profiler();
+		}
+	}
+
+	return audio_state_ptr != NULL;
+}
+
+// Let the main thread VM see where the audio thread is
+static void
+follow_audio_state(void) {
+	bytebeat_t* bytebeat = &main_thread_devices.bytebeat;
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		bytebeat->voices[i].t = last_audio_state.voices[i].t;
+		bytebeat->voices[i].v = last_audio_state.voices[i].v;
+	}
+}
+
+// Every layer is rendered again after a resize so all slots fall behind
+static void
+resize_screen_layers(void) {
+	buxn_screen_t* screen = main_thread_devices.screen;
+	int width = screen->width;
+	int height = screen->height;
+	if (screen_layers.width == width && screen_layers.height == height) { return; }
+
+	buxn_screen_info_t screen_info = buxn_screen_info(width, height);
+	screen_layers.width = width;
+	screen_layers.height = height;
+	screen_layers.size = screen_info.target_mem_size;
+	screen_layers.layers[0] = realloc(screen_layers.layers[0], screen_layers.size);
+	screen_layers.layers[1] = realloc(screen_layers.layers[1], screen_layers.size);
+	memset(screen_layers.layers[0], 0, screen_layers.size);
+	memset(screen_layers.layers[1], 0, screen_layers.size);
+	++screen_layers.generations[0];
+	++screen_layers.generations[1];
+
+	if (composite_screen) {
+		screen_layers.scratch = realloc(screen_layers.scratch, screen_layers.size);
+		screen_layers.pixels = realloc(screen_layers.pixels, screen_layers.size);
+		screen_layers.dirty_rows = realloc(screen_layers.dirty_rows, sizeof(bool) * height);
+		memset(screen_layers.pixels, 0, screen_layers.size);
+		memset(screen_layers.dirty_rows, 0, sizeof(bool) * height);
+		for (int i = 0; i < 3; ++i) {
+			screen_layers.stale_top[i] = 0;
+			screen_layers.stale_bottom[i] = height;
+		}
+	}
+}
+
+// Layers in a frame are reallocated when the size changed since it was last
+// sent.
+// The layers on the screen thread were resized too so they are copied in.
+static void
+resize_screen_frame(screen_frame_t* frame, int num_layers) {
+	if (frame->width == screen_layers.width && frame->height == screen_layers.height) { return; }
+
+	for (int i = 0; i < num_layers; ++i) {
+		frame->layers[i] = realloc(frame->layers[i], screen_layers.size);
+	}
+	frame->width = screen_layers.width;
+	frame->height = screen_layers.height;
+	// Spans of the old size may not fit
+	for (int i = 0; i < 2; ++i) {
+		frame->dirty_top[i] = frame->dirty_bottom[i] = 0;
+	}
+}
+
+// Bring the layers of a slot up to the latest render
+static void
+send_screen_layers(screen_frame_t* frame, int num_layers) {
+	resize_screen_frame(frame, num_layers);
+	for (int i = 0; i < num_layers; ++i) {
+		if (frame->generations[i] == screen_layers.generations[i]) { continue; }
+
+		memcpy(frame->layers[i], screen_layers.layers[i], screen_layers.size);
+		add_row_span(&frame->dirty_top[i], &frame->dirty_bottom[i], 0, frame->height);
+		frame->generations[i] = screen_layers.generations[i];
+		frame->changed_layers |= 1 << i;
+	}
+}
+
+// Only copy the rows merged since the slot was last sent
+static void
+send_composited_screen(screen_frame_t* frame) {
+	resize_screen_frame(frame, 1);
+	int slot = (int)(frame - screen_frames);
+	int top = screen_layers.stale_top[slot];
+	int bottom = screen_layers.stale_bottom[slot];
+	if (top >= bottom) { return; }
+
+	size_t offset = (size_t)top * frame->width;
+	memcpy(
+		frame->layers[0] + offset,
+		screen_layers.pixels + offset,
+		sizeof(uint32_t) * frame->width * (bottom - top)
+	);
+	add_row_span(&frame->dirty_top[0], &frame->dirty_bottom[0], top, bottom);
+	frame->changed_layers |= SCREEN_LAYER_BACKGROUND_BIT;
+	screen_layers.stale_top[slot] = screen_layers.stale_bottom[slot] = 0;
+}
+
+static void
+render_screen_layers(uint32_t palette[4]) {
+	buxn_screen_t* screen = main_thread_devices.screen;
+	if (buxn_screen_render(screen, BUXN_SCREEN_LAYER_BACKGROUND, palette, screen_layers.layers[0])) {
+		++screen_layers.generations[0];
+	}
+
+	palette[0] = 0; // Foreground treats color0 as transparent
+	if (buxn_screen_render(screen, BUXN_SCREEN_LAYER_FOREGROUND, palette, screen_layers.layers[1])) {
+		++screen_layers.generations[1];
+	}
+}
+
+// Opaque foreground pixels replace the background.
+// Written without branches so it can be vectorized.
+static void
+merge_row(uint32_t* out, const uint32_t* background, const uint32_t* foreground, int width) {
+	for (int x = 0; x < width; ++x) {
+		uint32_t mask = (uint32_t)0 - (foreground[x] >> 31);
+		out[x] = (foreground[x] & mask) | (background[x] & ~mask);
+	}
+}
+
+// Merge the layers on the CPU so that a single texture is uploaded and drawn.
+// Only rows which differ from the last render are merged again.
+static void
+composite_screen_layers(uint32_t palette[4]) {
+	buxn_screen_t* screen = main_thread_devices.screen;
+	int width = screen_layers.width;
+	int height = screen_layers.height;
+	bool changed = false;
+	size_t row_size = sizeof(uint32_t) * width;
+	for (int i = 0; i < 2; ++i) {
+		buxn_screen_layer_type_t layer = i == 0 ? BUXN_SCREEN_LAYER_BACKGROUND : BUXN_SCREEN_LAYER_FOREGROUND;
+		if (i == 1) {
+			palette[0] = 0; // Foreground treats color0 as transparent
+		}
+		if (!buxn_screen_render(screen, layer, palette, screen_layers.scratch)) { continue; }
+
+		for (int y = 0; y < height; ++y) {
+			uint32_t* row = screen_layers.layers[i] + (size_t)y * width;
+			const uint32_t* new_row = screen_layers.scratch + (size_t)y * width;
+			if (memcmp(row, new_row, row_size) != 0) {
+				memcpy(row, new_row, row_size);
+				screen_layers.dirty_rows[y] = true;
+				changed = true;
+			}
+		}
+	}
+	if (!changed) { return; }
+
+	uint64_t trace_start = trace_begin();
+	int top = height;
+	int bottom = 0;
+	for (int y = 0; y < height; ++y) {
+		if (!screen_layers.dirty_rows[y]) { continue; }
+
+		top = y < top ? y : top;
+		bottom = y + 1;
+
+		size_t offset = (size_t)y * width;
+		merge_row(
+			screen_layers.pixels + offset,
+			screen_layers.layers[0] + offset,
+			screen_layers.layers[1] + offset,
+			width
+		);
+		screen_layers.dirty_rows[y] = false;
+	}
+	for (int i = 0; i < 3; ++i) {
+		add_row_span(&screen_layers.stale_top[i], &screen_layers.stale_bottom[i], top, bottom);
+	}
+	trace_end("composite_screen_layers", trace_start);
+}
+
+// Render a second of every voice from where the audio thread is now
+static void
+mix_visual_samples(float* samples) {
+	bytebeat_t* bytebeat = &main_thread_devices.bytebeat;
+	double time_diff_s = stm_sec(stm_now()) - stm_sec(last_audio_state.timestamp);
+	static int16_t left[SAMPLING_RATE];
+	static int16_t right[SAMPLING_RATE];
+	memset(samples, 0, sizeof(float) * SAMPLING_RATE);
+
+	uint8_t old_voice = bytebeat->voice;
+	for (int j = 0; j < BYTEBEAT_MAX_VOICES; ++j) {
+		if (!bytebeat_voice_is_active(bytebeat, j)) { continue; }
+
+		bytebeat_voice_t* voice = &bytebeat->voices[j];
+		audio_voice_state_t* voice_state = &last_audio_state.voices[j];
+		uint16_t old_t = voice->t;
+		uint16_t old_v = voice->v;
+		voice->t = voice_state->t + (uint16_t)(time_diff_s * (double)SAMPLING_RATE) * (double)voice_state->v;
+		voice->v = 1;
+		// Select the voice so that the vector reads its own t
+		bytebeat->voice = j;
+		render_frames(main_thread_vm, &main_thread_lanes, voice, left, right, SAMPLING_RATE);
+		voice->t = old_t;
+		voice->v = old_v;
+
+		float scale = (float)voice->gain / (255.f * 32768.f) * 0.5f;
+		for (int i = 0; i < SAMPLING_RATE; ++i) {
+			samples[i] += ((float)left[i] + (float)right[i]) * scale;
+		}
+	}
+	bytebeat->voice = old_voice;
+}
+
+static void
+report_screen_stats(void) {
+	uint64_t now = stm_now();
+	if (stm_sec(stm_diff(now, last_screen_report)) < SCREEN_REPORT_INTERVAL_S) { return; }
+	last_screen_report = now;
+
+	ticker_stats_t stats = ticker_stats(&screen_ticker);
+	if (stats.num_overruns != reported_screen_stats.num_overruns) {
+		BLOG_WARN(
+			"Screen thread overran %llu ticks and skipped %llu frames",
+			(unsigned long long)(stats.num_overruns - reported_screen_stats.num_overruns),
+			(unsigned long long)(stats.num_skipped - reported_screen_stats.num_skipped)
+		);
+	}
+	reported_screen_stats = stats;
+}
+
+// One tick of the main thread VM: sync with the audio thread, run the input
+// and screen vectors, then send the result to the GL thread
+static void
+screen_tick(void* userdata) {
+	(void)userdata;
+	uint64_t tick_trace_start = trace_begin();
+	bytebeat_t* bytebeat = &main_thread_devices.bytebeat;
+	bool received_audio_state = sync_audio();
+	process_input();
+	update_standby();
+
+	screen_frame_t* frame = tribuf_begin_send(&screen_frame_buf);
+	screen_view_t* view = &frame->view;
+
+	uint32_t palette[4];
+	buxn_system_palette(main_thread_vm, palette);
+	view->show_screen = palette[0] != 0xff000000
+		|| palette[1] != 0xff000000
+		|| palette[2] != 0xff000000
+		|| palette[3] != 0xff000000;
+	if (view->show_screen) {
+		int width = atomic_load_explicit(&window_width, memory_order_relaxed);
+		int height = atomic_load_explicit(&window_height, memory_order_relaxed);
+		buxn_screen_t* screen = main_thread_devices.screen;
+		if (width != screen->width || height != screen->height) {
+			buxn_screen_info_t screen_info = buxn_screen_info(width, height);
+			main_thread_devices.screen = realloc(screen, screen_info.screen_mem_size);
+			buxn_screen_resize(main_thread_devices.screen, width, height);
+		}
+
+		buxn_screen_update(main_thread_vm);
+		resize_screen_layers();
+		if (composite_screen) {
+			composite_screen_layers(palette);
+			send_composited_screen(frame);
+		} else {
+			render_screen_layers(palette);
+			send_screen_layers(frame, 2);
+		}
+	}
+	view->composited = composite_screen;
+
+	view->playing_forward = bytebeat->voices[0].v < UINT16_MAX / 2;
+	view->bytebeat_opts = bytebeat_options(main_thread_vm);
+	if (view->bytebeat_opts & (BYTEBEAT_OPTS_SHOW_WAVEFORM | BYTEBEAT_OPTS_SHOW_FFT)) {
+		mix_visual_samples(view->samples);
+	}
+
+	view->overlay_length = profiling
+		? format_profiler_overlay(view->overlay, sizeof(view->overlay))
+		: 0;
+
+	// Only cleared by the GL thread, a title from an unreceived frame is
+	// replaced by the latest one
+	if (window_title_changed) {
+		memcpy(view->title, window_title, sizeof(view->title));
+		view->title_changed = true;
+		window_title_changed = false;
+	}
+
+	tribuf_end_send(&screen_frame_buf);
+	report_screen_stats();
+	trace_end("screen_tick", tick_trace_start);
+
+	if (received_audio_state) {
+		follow_audio_state();
+	}
+}
+
+// Upload the layers which changed and keep the rest of the frame to draw
+// until the next one arrives
+static void
+receive_screen_frame(void) {
+	screen_frame_t* frame = tribuf_begin_recv(&screen_frame_buf);
+	if (frame == NULL) { return; }
+
+	if (frame->changed_layers != 0) {
+		if (frame->width != background_texture.width || frame->height != background_texture.height) {
+			init_layer_texture(&background_texture, frame->width, frame->height, "ubeat.screen.background");
+			init_layer_texture(&foreground_texture, frame->width, frame->height, "ubeat.screen.foreground");
+		}
+
+		layer_texture_t* textures[2] = { &background_texture, &foreground_texture };
+		for (int i = 0; i < 2; ++i) {
+			if ((frame->changed_layers & (1 << i)) == 0) { continue; }
+
+			upload_layer_texture(textures[i], frame->layers[i], frame->dirty_top[i], frame->dirty_bottom[i]);
+			frame->dirty_top[i] = frame->dirty_bottom[i] = 0;
+		}
+		frame->changed_layers = 0;
+	}
+
+	if (frame->view.title_changed) {
+		sapp_set_window_title(frame->view.title);
+		frame->view.title_changed = false;
+	}
+
+	screen_view = frame->view;
+	plot.stale = true;
+	tribuf_end_recv(&screen_frame_buf);
+}
+
+// Pixels are RGBA8 in memory
+static inline uint32_t
+pack_color(float r, float g, float b) {
+	return 0xff000000u
+		| ((uint32_t)(b * 255.f) << 16)
+		| ((uint32_t)(g * 255.f) << 8)
+		| (uint32_t)(r * 255.f);
+}
+
+// The plot is only as wide as the window and is stretched vertically when it
+// is drawn
+static void
+resize_plot(int width) {
+	int height = PLOT_HEIGHT;
+	init_layer_texture(&plot.texture, width, height, "ubeat.plot");
+	plot.size = sizeof(uint32_t) * (size_t)width * (size_t)height;
+	plot.pixels = realloc(plot.pixels, plot.size);
+	memset(plot.pixels, 0, plot.size);
+	plot.dirty_top = realloc(plot.dirty_top, sizeof(int) * width);
+	plot.dirty_bottom = realloc(plot.dirty_bottom, sizeof(int) * width);
+	for (int x = 0; x < width; ++x) {
+		plot.dirty_top[x] = height;
+		plot.dirty_bottom[x] = -1;
+	}
+	plot.upload_top = 0;
+	plot.upload_bottom = height;
+}
+
+// Fill rows top to bottom, inclusive, of a column
+static void
+plot_span(int x, int top, int bottom, uint32_t color) {
+	int width = plot.texture.width;
+	int height = plot.texture.height;
+	top = top < 0 ? 0 : top;
+	bottom = bottom >= height ? height - 1 : bottom;
+	if (top > bottom) { return; }
+
+	uint32_t* pixel = plot.pixels + (size_t)top * width + x;
+	for (int y = top; y <= bottom; ++y, pixel += width) {
+		*pixel = color;
+	}
+	plot.dirty_top[x] = top < plot.dirty_top[x] ? top : plot.dirty_top[x];
+	plot.dirty_bottom[x] = bottom > plot.dirty_bottom[x] ? bottom : plot.dirty_bottom[x];
+	add_row_span(&plot.upload_top, &plot.upload_bottom, top, bottom + 1);
+}
+
+static inline int
+plot_row(float value, int height) {
+	return (int)((float)height - (float)height * value);
+}
+
+// Draw the waveform and the spectrum one span per column so the cost depends
+// on the width of the window rather than on the number of samples.
+// Only the pixels drawn by the previous plot are cleared.
+static void
+rasterize_plot(void) {
+	uint64_t trace_start = trace_begin();
+	int width = plot.texture.width;
+	int height = plot.texture.height;
+	uint8_t bytebeat_opts = screen_view.bytebeat_opts;
+	bool playing_forward = screen_view.playing_forward;
+
+	for (int x = 0; x < width; ++x) {
+		int top = plot.dirty_top[x];
+		int bottom = plot.dirty_bottom[x];
+		if (top > bottom) { continue; }
+
+		uint32_t* pixel = plot.pixels + (size_t)top * width + x;
+		for (int y = top; y <= bottom; ++y, pixel += width) {
+			*pixel = 0;
+		}
+		add_row_span(&plot.upload_top, &plot.upload_bottom, top, bottom + 1);
+		plot.dirty_top[x] = height;
+		plot.dirty_bottom[x] = -1;
+	}
+
+	const float* samples = screen_view.samples;
+	if (bytebeat_opts & BYTEBEAT_OPTS_SHOW_WAVEFORM) {
+		uint32_t color = playing_forward ? pack_color(0.f, 0.f, 1.f) : pack_color(0.f, 1.f, 1.f);
+		for (int x = 0; x < width; ++x) {
+			int start = (int)((int64_t)x * SAMPLING_RATE / width);
+			int end = (int)((int64_t)(x + 1) * SAMPLING_RATE / width);
+			end = end > start ? end : start + 1;
+
+			// Branchless so it can be vectorized
+			float min = samples[start];
+			float max = samples[start];
+			for (int i = start + 1; i < end; ++i) {
+				min = samples[i] < min ? samples[i] : min;
+				max = samples[i] > max ? samples[i] : max;
+			}
+
+			// Points used to be 2 pixels wide
+			int top = plot_row((max + 1.f) * 0.5f, height) - 1;
+			int bottom = plot_row((min + 1.f) * 0.5f, height);
+			plot_span(x, top, bottom, color);
+		}
+	}
+
+	if (bytebeat_opts & BYTEBEAT_OPTS_SHOW_FFT) {
+		for (int i = 0; i < FFT_SIZE; ++i) {
+			fft_in[i][0] = samples[i];
+			fft_in[i][1] = 0.f;
+		}
+		am_fft_1d(fft, fft_in, fft_out);
+
+		static float amplitudes[FFT_SIZE / 2];
+		for (int i = 0; i < FFT_SIZE / 2; ++i) {
+			amplitudes[i] = sqrtf(fft_out[i][0] * fft_out[i][0] + fft_out[i][1] * fft_out[i][1]) / (float)FFT_SIZE;
+		}
+
+		// Consecutive columns are joined like a line strip
+		int previous_row = -1;
+		for (int x = 0; x < width; ++x) {
+			int start = (int)((int64_t)x * (FFT_SIZE / 2) / width);
+			int end = (int)((int64_t)(x + 1) * (FFT_SIZE / 2) / width);
+			end = end > start ? end : start + 1;
+
+			float amplitude = amplitudes[start];
+			for (int i = start + 1; i < end; ++i) {
+				amplitude = amplitudes[i] > amplitude ? amplitudes[i] : amplitude;
+			}
+
+			float lerp_factor = sqrtf(amplitude);
+			lerp_factor = lerp_factor > 1.f ? 1.f : lerp_factor;
+			uint32_t color = playing_forward
+				? pack_color(
+					lerp(lerp_factor, 0.f, 1.f),
+					lerp(lerp_factor, 1.f, 0.f),
+					lerp(lerp_factor, 1.f, 0.f)
+				)
+				: pack_color(
+					lerp(lerp_factor, 1.f, 1.f),
+					0.f,
+					lerp(lerp_factor, 1.f, 0.f)
 				);
-				update_mouse = true;
+
+			int row = plot_row(amplitude, height);
+			row = row >= height ? height - 1 : row;
+			int from = previous_row >= 0 ? previous_row : row;
+			plot_span(x, from < row ? from : row, from > row ? from : row, color);
+			previous_row = row;
+		}
+	}
+
+	upload_layer_texture(&plot.texture, plot.pixels, plot.upload_top, plot.upload_bottom);
+	plot.upload_top = plot.upload_bottom = 0;
+	trace_end("rasterize_plot", trace_start);
+}
+
+static void
+frame(void) {
+	uint64_t frame_trace_start = trace_begin();
+	atomic_store_explicit(&window_width, sapp_width(), memory_order_relaxed);
+	atomic_store_explicit(&window_height, sapp_height(), memory_order_relaxed);
+	if (!screen_thread_running) {
+		screen_tick(NULL);
+	}
+	receive_screen_frame();
+
+	float width = sapp_widthf();
+	float height = sapp_heightf();
+	uint8_t bytebeat_opts = screen_view.bytebeat_opts;
+
+	sgl_defaults();
+	sgl_viewport(0, 0, sapp_width(), sapp_height(), true);
+	sgl_ortho(0.f, sapp_widthf(), sapp_heightf(), 0.f, -1.f, 1.f);
+
+	// Screen
+	if (screen_view.show_screen) {
+		sgl_enable_texture();
+		sgl_push_pipeline();
+		sgl_load_pipeline(screen_pipeline);
+		blit_layer_texture(&background_texture, width, height);
+		if (!screen_view.composited) {
+			blit_layer_texture(&foreground_texture, width, height);
+		}
+		sgl_pop_pipeline();
+		sgl_disable_texture();
+	}
+
+	// Bytebeat visual
+	if (bytebeat_opts & (BYTEBEAT_OPTS_SHOW_WAVEFORM | BYTEBEAT_OPTS_SHOW_FFT)) {
+		if (plot.texture.width != sapp_width()) {
+			resize_plot(sapp_width());
+			plot.stale = true;
+		}
+		if (plot.stale) {
+			rasterize_plot();
+			plot.stale = false;
+		}
+
+		sgl_enable_texture();
+		sgl_push_pipeline();
+		sgl_load_pipeline(screen_pipeline);
+		blit_layer_texture(&plot.texture, width, height);
+		sgl_pop_pipeline();
+		sgl_disable_texture();
+	}
+
+	if (screen_view.overlay_length > 0) {
+		draw_profiler_overlay(width, height);
+	}
+
+	// Actual rendering
+	sg_begin_pass(&(sg_pass){
+		.swapchain = sglue_swapchain(),
+		.action.colors[0] = {
+			.load_action = SG_LOADACTION_CLEAR,
+		},
+	});
+	sgl_draw();
+	sdtx_draw();
+	sg_end_pass();
+	sg_commit();
+	trace_end("frame", frame_trace_start);
+}
+
+// Only called from the audio thread
+static void
+audio_log(blog_level_t level, const char* file, int line, const char* fmt, ...) {
+	audio_log_record_t record = {
+		.level = level,
+		.line = line,
+		.file = file,
+	};
+
+	va_list args;
+	va_start(args, fmt);
+	int length = vsnprintf(record.message, sizeof(record.message), fmt, args);
+	va_end(args);
+	if (length < 0) { return; }
+	record.length = length < AUDIO_LOG_MAX_MESSAGE ? length : AUDIO_LOG_MAX_MESSAGE - 1;
+
+	ring_write(&audio_log_ring, &record, offsetof(audio_log_record_t, message) + record.length);
+}
+
+// Restore the nearest checkpoint before t and render up to t so a stateful
+// vector sees the same history as when it was played forward
+static bool
+rewind_voice(audio_voice_t* voice, bytebeat_voice_t* state, uint16_t t) {
+	const checkpoint_t* checkpoint = checkpoints_find(voice->checkpoints, t, CHECKPOINT_MAX_CATCH_UP);
+	if (checkpoint == NULL) { return false; }
+
+	checkpoints_restore(voice->checkpoints, checkpoint, voice->vm);
+	uint16_t v = state->v;
+	state->t = checkpoint->t;
+	state->v = checkpoint->v;
+	int num_frames = (uint16_t)(t - checkpoint->t) / checkpoint->v;
+	int16_t left[AUDIO_BLOCK_SIZE];
+	int16_t right[AUDIO_BLOCK_SIZE];
+	while (num_frames > 0) {
+		int batch_size = num_frames < AUDIO_BLOCK_SIZE ? num_frames : AUDIO_BLOCK_SIZE;
+		render_frames(voice->vm, &voice->lanes, state, left, right, batch_size);
+		num_frames -= batch_size;
+	}
+	state->t = t;
+	state->v = v;
+
+	return true;
+}
+
+// Render forward from the nearest checkpoint up to the end of a block,
+// starting as far back as the checkpoint allows so the next blocks are
+// already rendered
+static bool
+render_reverse_span(
+	audio_voice_t* voice,
+	bytebeat_voice_t* state,
+	uint16_t start_t,
+	uint16_t step
+) {
+	const checkpoint_t* checkpoint = checkpoints_find(voice->checkpoints, start_t, CHECKPOINT_MAX_CATCH_UP);
+	if (checkpoint == NULL) { return false; }
+
+	int num_before = (uint16_t)(start_t - checkpoint->t) / step;
+	uint16_t first_t = (uint16_t)(start_t - num_before * step);
+	if (!rewind_voice(voice, state, first_t)) { return false; }
+
+	voice_reverse_t* span = &voice->reverse;
+	span->first_t = first_t;
+	span->step = step;
+	span->num_frames = num_before + voice->num_frames;
+	state->v = step;
+	for (int i = 0; i < span->num_frames; i += AUDIO_BLOCK_SIZE) {
+		int remaining = span->num_frames - i;
+		int batch_size = remaining < AUDIO_BLOCK_SIZE ? remaining : AUDIO_BLOCK_SIZE;
+		render_frames(voice->vm, &voice->lanes, state, span->left + i, span->right + i, batch_size);
+	}
+
+	return true;
+}
+
+// A stateful vector cannot run backwards so blocks are rendered forward from
+// a checkpoint then read back to front.
+// The VM is left at the end of the span, not at t.
+static bool
+render_reversed(audio_voice_t* voice, bytebeat_voice_t* state) {
+	voice_reverse_t* span = &voice->reverse;
+	uint16_t step = (uint16_t)-state->v;
+	int num_frames = voice->num_frames;
+	uint16_t end_t = state->t;
+	uint16_t start_t = (uint16_t)(end_t - (num_frames - 1) * step);
+
+	uint16_t offset = (uint16_t)(start_t - span->first_t);
+	bool is_cached = span->num_frames > 0
+		&& span->step == step
+		&& offset % step == 0
+		&& offset / step + num_frames <= span->num_frames;
+	if (!is_cached && !render_reverse_span(voice, state, start_t, step)) {
+		span->num_frames = 0;
+		return false;
+	}
+
+	int last = (uint16_t)(start_t - span->first_t) / step + num_frames - 1;
+	for (int i = 0; i < num_frames; ++i) {
+		voice->left[i] = span->left[last - i];
+		voice->right[i] = span->right[last - i];
+	}
+	state->v = (uint16_t)-step;
+	state->t = (uint16_t)(end_t - num_frames * step);
+
+	return true;
+}
+
+// Run on the interpreter until new code has been compiled in the background.
+// The stale code of the voice VM is not freed here, which would stall the
+// audio thread: it is only reset by warm_up_voice once this VM has been
+// swapped into the tier.
+static void
+demote_voice(audio_voice_t* voice) {
+	voice->devices.interpreted = true;
+	++voice->code_generation;
+	voice->tier.num_vectors = 0;
+	voice->tier.pending = true;
+}
+
+// Runs on the tier worker
+static void
+warm_up_voice(void* userdata) {
+	voice_tier_t* tier = userdata;
+	uint64_t start = stm_now();
+	buxn_vm_t* vm = tier->vm;
+	devices_t* devices = vm->config.userdata;
+	reset_jit(vm);
+
+	bytebeat_voice_t* state = bytebeat_current_voice(&devices->bytebeat);
+	for (int i = 0; i < tier->num_job_vectors; ++i) {
+		state->vector = tier->job_vectors[i];
+		// Spread t over its whole range so branches on high bits are compiled
+		for (int j = 0; j < TIER_WARMUP_SAMPLES; ++j) {
+			uint16_t t = (uint16_t)(j * (0x10000 / TIER_WARMUP_SAMPLES) + j);
+			bytebeat_render(vm, devices->jit_state->jit, state, devices->bytebeat.options, t);
+		}
+	}
+	tier->job_ticks = stm_since(start);
+	trace_end("warm_up_voice", start);
+}
+
+// Swap the voice VM with the warmed up shadow VM.
+// Each VM keeps its compiled code, only their devices are exchanged.
+static void
+promote_voice(audio_voice_t* voice) {
+	voice_tier_t* tier = &voice->tier;
+	buxn_vm_t* cold = voice->vm;
+	buxn_vm_t* warm = tier->vm;
+	memcpy(warm->memory, cold->memory, BUXN_MEMORY_BANK_SIZE);
+	memcpy(warm->device, cold->device, sizeof(cold->device));
+
+	jit_state_t* warm_jit = tier->devices.jit_state;
+	tier->devices.jit_state = voice->devices.jit_state;
+	voice->devices.jit_state = warm_jit;
+	warm->config.userdata = &voice->devices;
+	cold->config.userdata = &tier->devices;
+	voice->vm = warm;
+	tier->vm = cold;
+
+	voice->devices.interpreted = false;
+	++tier->num_promotions;
+	tier->warmup_ticks = tier->job_ticks;
+}
+
+// Swap the voice VM with one which already ran the new rom.
+// The replaced VM goes back to the main thread in its place.
+static void
+adopt_standby_voice(audio_voice_t* voice, standby_voice_t* standby) {
+	buxn_vm_t* cold = voice->vm;
+	buxn_vm_t* warm = standby->vm;
+	jit_state_t* warm_jit = standby->devices.jit_state;
+	standby->devices.jit_state = voice->devices.jit_state;
+	voice->devices.jit_state = warm_jit;
+	warm->config.userdata = &voice->devices;
+	cold->config.userdata = &standby->devices;
+	voice->vm = warm;
+	standby->vm = cold;
+
+	voice_tier_t* tier = &voice->tier;
+	memcpy(tier->vectors, standby->vectors, sizeof(tier->vectors));
+	tier->num_vectors = standby->num_vectors;
+	tier->pending = false;
+	voice->devices.interpreted = false;
+	++voice->code_generation;
+
+	if (!ring_write(&standby_return_ring, &standby, sizeof(standby))) {
+		AUDIO_LOG_WARN("Could not return a standby VM, it is leaked");
+	}
+}
+
+// Called before rendering a voice, on its own thread
+static void
+update_tier(audio_voice_t* voice, uint16_t vector) {
+	voice_tier_t* tier = &voice->tier;
+	if (tier->running) {
+		if (!worker_try_wait(&tier->worker)) { return; }
+		tier->running = false;
+		// The result is discarded when the rom changed in the meantime
+		if (tier->generation == voice->code_generation) {
+			promote_voice(voice);
+		}
+	}
+
+	bool is_known = false;
+	for (int i = 0; i < tier->num_vectors; ++i) {
+		is_known |= tier->vectors[i] == vector;
+	}
+	if (!is_known && vector != 0 && tier->num_vectors < TIER_MAX_VECTORS) {
+		// A new vector is warmed up along with the previous ones
+		tier->vectors[tier->num_vectors++] = vector;
+		voice->devices.interpreted = true;
+		++voice->code_generation;
+		tier->pending = true;
+	}
+
+	if (tier->pending && !tier->running && tier->num_vectors > 0) {
+		memcpy(tier->vm->memory, voice->vm->memory, BUXN_MEMORY_BANK_SIZE);
+		memcpy(tier->vm->device, voice->vm->device, sizeof(voice->vm->device));
+		uint8_t index = tier->devices.bytebeat.voice;
+		tier->devices.bytebeat = voice->devices.bytebeat;
+		tier->devices.bytebeat.voice = index;
+		memcpy(tier->job_vectors, tier->vectors, sizeof(tier->vectors));
+		tier->num_job_vectors = tier->num_vectors;
+		tier->generation = voice->code_generation;
+		tier->pending = false;
+		tier->running = true;
+		worker_start_job(&tier->worker, warm_up_voice, tier);
+	}
+}
+
+// Keep the VM of the previous rom playing and give the voice a copy of it to
+// load the new rom into.
+// Only the most recent rom fades out when reloads come faster than the fade.
+static void
+start_crossfade(audio_voice_t* voice, int length) {
+	voice_fade_t* fade = &voice->fade;
+	buxn_vm_t* old = voice->vm;
+	buxn_vm_t* spare = fade->vm;
+	memcpy(spare->memory, old->memory, BUXN_MEMORY_BANK_SIZE);
+	memcpy(spare->device, old->device, sizeof(old->device));
+
+	// Each VM keeps its compiled code
+	jit_state_t* spare_jit = fade->devices.jit_state;
+	fade->devices.jit_state = voice->devices.jit_state;
+	voice->devices.jit_state = spare_jit;
+	fade->devices.interpreted = voice->devices.interpreted;
+	fade->devices.bytebeat = voice->devices.bytebeat;
+	fade->devices.fpu = voice->devices.fpu;
+	fade->devices.fx = voice->devices.fx;
+	fade->devices.sampler = voice->devices.sampler;
+	fade->devices.sampler.can_open = false;
+	old->config.userdata = &fade->devices;
+	spare->config.userdata = &voice->devices;
+	voice->vm = spare;
+	fade->vm = old;
+
+	fade->lanes.unsupported = voice->lanes.unsupported;
+	fade->lanes.unsupported_vector = voice->lanes.unsupported_vector;
+	fade->lanes.probed_vector = voice->lanes.probed_vector;
+	fade->lanes.skip_batches = voice->lanes.skip_batches;
+	fade->length = length;
+	fade->remaining = length;
+}
+
+static void
+render_fade(void* userdata) {
+	audio_voice_t* voice = userdata;
+	voice_fade_t* fade = &voice->fade;
+	uint64_t start = stm_now();
+	bytebeat_voice_t* state = bytebeat_current_voice(&fade->devices.bytebeat);
+	render_frames(fade->vm, &fade->lanes, state, fade->left, fade->right, voice->num_frames);
+	trace_end("render_fade", start);
+}
+
+// Linear crossfade from the previous rom to the current one
+static void
+mix_fade(audio_voice_t* voice) {
+	voice_fade_t* fade = &voice->fade;
+	for (int i = 0; i < voice->num_frames && i < fade->remaining; ++i) {
+		float old_gain = (float)(fade->remaining - i) / (float)fade->length;
+		float new_gain = 1.f - old_gain;
+		voice->left[i] = (int16_t)((float)voice->left[i] * new_gain + (float)fade->left[i] * old_gain);
+		voice->right[i] = (int16_t)((float)voice->right[i] * new_gain + (float)fade->right[i] * old_gain);
+	}
+	fade->remaining = fade->remaining > voice->num_frames ? fade->remaining - voice->num_frames : 0;
+}
+
+static void
+render_voice(void* userdata) {
+	audio_voice_t* voice = userdata;
+	bytebeat_voice_t* state = bytebeat_current_voice(&voice->devices.bytebeat);
+	update_tier(voice, state->vector);
+	uint64_t start = stm_now();
+
+	// The previous rom is rendered alongside when the block budget is tight
+	voice_fade_t* fade = &voice->fade;
+	bool fading = fade->remaining > 0;
+	bool parallel = fading && last_callback_load > CROSSFADE_PARALLEL_LOAD;
+	if (parallel) {
+		worker_start_job(&fade->worker, render_fade, voice);
+	}
+
+	// Pure vectors can be rendered at any t directly.
+	// The analysis is conservative so checkpoints still tell whether a
+	// vector classified as stateful actually changes memory.
+	bool may_be_stateful = voice->purity == ANALYSIS_STATEFUL;
+	bool is_stateful = may_be_stateful && voice->checkpoints->is_stateful;
+	bool seek_pending = voice->seek_pending;
+	voice->seek_pending = false;
+	bool reversed = is_stateful && (state->v & 0x8000) && render_reversed(voice, state);
+	if (!reversed) {
+		// Reverse playback left memory at the end of its span
+		bool was_reversed = voice->reverse.num_frames > 0;
+		voice->reverse.num_frames = 0;
+		if (is_stateful && (seek_pending || was_reversed)) {
+			rewind_voice(voice, state, state->t);
+		}
+		render_frames(voice->vm, &voice->lanes, state, voice->left, voice->right, voice->num_frames);
+		if (may_be_stateful) {
+			checkpoints_update(voice->checkpoints, voice->vm, state);
+		}
+	}
+
+	if (fading) {
+		if (parallel) {
+			worker_wait(&fade->worker);
+		} else {
+			render_fade(voice);
+		}
+		mix_fade(voice);
+	}
+	voice->render_ticks += stm_since(start);
+	trace_end("render_voice", start);
+}
+
+static void
+process_audio_command(const audio_cmd_t* cmd) {
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		audio_voice_t* voice = &audio_voices[i];
+		bytebeat_voice_t* state = &voice->devices.bytebeat.voices[i];
+
+		if (cmd->cmds & AUDIO_CMD_LOAD_ROM) {
+			if (
+				voice->has_rom
+				&& cmd->crossfade_frames > 0
+				&& bytebeat_voice_is_active(&voice->devices.bytebeat, i)
+			) {
+				start_crossfade(voice, cmd->crossfade_frames);
 			}
-		} break;
-		case SAPP_EVENTTYPE_MOUSE_SCROLL:
-			mouse->scroll_x = (int16_t)event->scroll_x;
-			mouse->scroll_y = -(int16_t)event->scroll_y;
-			update_mouse = true;
-			break;
-		case SAPP_EVENTTYPE_MOUSE_MOVE: {
-			mouse->x = event->mouse_x;
-			mouse->y = event->mouse_y;
-			update_mouse = true;
-		} break;
-		case SAPP_EVENTTYPE_KEY_DOWN:
-		case SAPP_EVENTTYPE_KEY_UP: {
-			bool down = event->type == SAPP_EVENTTYPE_KEY_DOWN;
-			int button = -1;
-			char ch = 0;
-			switch (event->key_code) {
-				case SAPP_KEYCODE_LEFT_CONTROL:
-				case SAPP_KEYCODE_RIGHT_CONTROL:
-					button = BUXN_CONTROLLER_BTN_A;
-					break;
-				case SAPP_KEYCODE_LEFT_ALT:
-				case SAPP_KEYCODE_RIGHT_ALT:
-					button = BUXN_CONTROLLER_BTN_B;
-					break;
-				case SAPP_KEYCODE_LEFT_SHIFT:
-				case SAPP_KEYCODE_RIGHT_SHIFT:
-					button = BUXN_CONTROLLER_BTN_SELECT;
-					break;
-				case SAPP_KEYCODE_HOME:
-					button = BUXN_CONTROLLER_BTN_START;
-					break;
-				case SAPP_KEYCODE_UP:
-					button = BUXN_CONTROLLER_BTN_UP;
-					break;
-				case SAPP_KEYCODE_DOWN:
-					button = BUXN_CONTROLLER_BTN_DOWN;
-					break;
-				case SAPP_KEYCODE_LEFT:
-					button = BUXN_CONTROLLER_BTN_LEFT;
-					break;
-				case SAPP_KEYCODE_RIGHT:
-					button = BUXN_CONTROLLER_BTN_RIGHT;
-					break;
-				case SAPP_KEYCODE_ENTER:
-					ch = '\r';
-					break;
-				case SAPP_KEYCODE_ESCAPE:
-					ch = 27;
-					break;
-				case SAPP_KEYCODE_BACKSPACE:
-					ch = 8;
-					break;
-				case SAPP_KEYCODE_TAB:
-					ch = '\t';
-					break;
-				case SAPP_KEYCODE_DELETE:
-					ch = 127;
-					break;
-				default:
-					break;
+			voice->has_rom = true;
+			standby_voice_t* standby = cmd->standby_voices[i];
+			if (standby != NULL) {
+				adopt_standby_voice(voice, standby);
 			}
-			if (button >= 0) {
-				buxn_controller_send_button(main_thread_vm, controller, 0, button, down);
+
+			buxn_vm_reset(voice->vm, BUXN_VM_RESET_SOFT);
+			memcpy(
+				voice->vm->memory + BUXN_RESET_VECTOR,
+				cmd->rom.content,
+				cmd->rom.size
+			);
+
+			// Standby VMs were compiled with the patches of this command
+			if (standby == NULL) {
+				demote_voice(voice);
 			}
-			if (ch > 0 && down) {
-				buxn_controller_send_char(main_thread_vm, controller, ch);
+			memset(voice->read_zp, 0, sizeof(voice->read_zp));
+			lanes_reset(&voice->lanes);
+			checkpoints_clear(voice->checkpoints);
+			voice->reverse.num_frames = 0;
+		}
+
+		if (cmd->cmds & AUDIO_CMD_SYNC_ZERO_PAGE) {
+			for (int j = 0; j < 256; ++j) {
+				if (cmd->zero_page_mask[j / 32] & (1u << (j % 32))) {
+					voice->vm->memory[j] = cmd->zero_page[j];
+				}
+			}
+			// Rendered frames would not hear the new values
+			voice->reverse.num_frames = 0;
+		}
+
+		if (cmd->cmds & AUDIO_CMD_SYNC_BYTEBEAT) {
+			const bytebeat_voice_t* update = &cmd->bytebeat.voices[i];
+
+			if (update->sync_bits & BYTEBEAT_SYNC_VECTOR) {
+				state->vector = update->vector;
+				AUDIO_LOG_DEBUG("Updated .Bytebeat/vector of voice %d", i);
+			}
+
+			if (update->sync_bits & BYTEBEAT_SYNC_T) {
+				state->t = update->t;
+				voice->seek_pending = true;
+				AUDIO_LOG_DEBUG("Updated .Bytebeat/t of voice %d", i);
+			}
+
+			if (update->sync_bits & BYTEBEAT_SYNC_V) {
+				state->v = update->v;
+				AUDIO_LOG_DEBUG("Updated .Bytebeat/v of voice %d", i);
+			}
+
+			if (update->sync_bits & BYTEBEAT_SYNC_GAIN) {
+				state->gain = update->gain;
+				AUDIO_LOG_DEBUG("Updated .Bytebeat/gain of voice %d", i);
+			}
+
+			if (cmd->bytebeat.sync_bits & BYTEBEAT_SYNC_OPTIONS) {
+				voice->devices.bytebeat.options = cmd->bytebeat.options;
+			}
+		}
+
+		if (cmd->cmds & AUDIO_CMD_SYNC_SAMPLER) {
+			memcpy(voice->devices.sampler.banks, cmd->sample_banks, sizeof(cmd->sample_banks));
+		}
+
+		if (cmd->cmds & AUDIO_CMD_SYNC_PURITY) {
+			if (voice->purity != cmd->purity[i]) {
+				// Checkpoints are not kept up to date for pure vectors
+				checkpoints_clear(voice->checkpoints);
+				voice->reverse.num_frames = 0;
+			}
+			voice->purity = cmd->purity[i];
+			for (int j = 0; j < (int)sizeof(voice->read_zp); ++j) {
+				voice->read_zp[j] |= cmd->read_zp[i][j];
 			}
-		} break;
-		case SAPP_EVENTTYPE_CHAR: {
-			uint32_t ch = event->char_code;
-			if (ch <= 127) {
-				// Sync the modifiers in case we missed their release due to
-				// focus change
-				buxn_controller_set_button(
-					controller,
-					0,
-					BUXN_CONTROLLER_BTN_A,
-					(event->modifiers & SAPP_MODIFIER_CTRL) != 0
-				);
-				buxn_controller_set_button(
-					controller,
-					0,
-					BUXN_CONTROLLER_BTN_B,
-					(event->modifiers & SAPP_MODIFIER_ALT) != 0
-				);
-				buxn_controller_set_button(
-					controller,
-					0,
-					BUXN_CONTROLLER_BTN_SELECT,
-					(event->modifiers & SAPP_MODIFIER_SHIFT) != 0
-				);
-				// Send the actual character
-				buxn_controller_send_char(main_thread_vm, controller, ch);
+		}
+
+		if (cmd->cmds & AUDIO_CMD_PATCH_ROM) {
+			for (int j = 0; j < cmd->num_patches; ++j) {
+				const analysis_patch_t* patch = &cmd->patches[j];
+				memcpy(voice->vm->memory + patch->addr, patch->bytes, patch->size);
 			}
-		} break;
-		case SAPP_EVENTTYPE_FILES_DROPPED:
-			if (sapp_get_num_dropped_files() > 0) {
-				input_file = sapp_get_dropped_file_path(0);
-				ubeat_asm_set_entry_file(input_file);
-				try_reload_formula();
+
+			// Compiled code is regenerated on the tier worker from the
+			// patched memory when it folded a byte which changed
+			bool is_stale = false;
+			for (int j = 0; j < (int)sizeof(voice->read_zp); ++j) {
+				is_stale |= (voice->read_zp[j] & cmd->patched_zp[j]) != 0;
 			}
-			break;
-		default: break;
+			if (is_stale && !(cmd->cmds & AUDIO_CMD_LOAD_ROM)) {
+				demote_voice(voice);
+			}
+			lanes_reset(&voice->lanes);
+			checkpoints_clear(voice->checkpoints);
+			voice->reverse.num_frames = 0;
+		}
 	}
 
-	if (update_mouse) {
-		buxn_mouse_update(main_thread_vm);
-		mouse->scroll_x = mouse->scroll_y = 0;
+	if (cmd->cmds & AUDIO_CMD_PATCH_ROM) {
+		audio_zp_folds.num_sites = cmd->num_restores;
+		memcpy(audio_zp_folds.originals, cmd->patches, sizeof(cmd->patches[0]) * cmd->num_restores);
+	} else if (cmd->cmds & AUDIO_CMD_LOAD_ROM) {
+		audio_zp_folds.num_sites = 0;
 	}
-}
 
-static void
-blit_layer_texture(layer_texture_t* texture, float width, float height) {
-	sgl_texture(texture->view, screen_sampler);
-	sgl_c1i(0xffffffff);
-	sgl_begin_quads();
-	{
-		sgl_v2f_t2f(0.f, 0.f, 0.f, 0.f);
-		sgl_v2f_t2f(width, 0.f, 1.f, 0.f);
-		sgl_v2f_t2f(width, height, 1.f, 1.f);
-		sgl_v2f_t2f(0.f, height, 0.f, 1.f);
+	if (cmd->cmds & AUDIO_CMD_LOAD_ROM) {
+		AUDIO_LOG_DEBUG("Loaded new rom: %d bytes", cmd->rom.size);
 	}
-	sgl_end();
-}
-
-static void
-frame(void) {
-	bytebeat_t* bytebeat = &main_thread_devices.bytebeat;
-	audio_cmd_t* cmd = NULL;
 
-	if (bytebeat->sync_bits != 0) {
-		cmd = cmd == NULL ? tribuf_begin_send(&audio_cmd_buf) : cmd;
-		cmd->bytebeat = *bytebeat;
-		cmd->cmds |= AUDIO_CMD_SYNC_BYTEBEAT;
-		bytebeat->sync_bits = 0;
+	if (cmd->cmds & AUDIO_CMD_SYNC_ZERO_PAGE) {
+		AUDIO_LOG_DEBUG("Synced zero page");
 	}
 
-	static uint8_t last_zero_page[256] = { 0 };
-	if (memcmp(last_zero_page, main_thread_vm->memory, sizeof(last_zero_page))) {
-		cmd = cmd == NULL ? tribuf_begin_send(&audio_cmd_buf) : cmd;
-		memcpy(cmd->zero_page, main_thread_vm->memory, sizeof(cmd->zero_page));
-		cmd->cmds |= AUDIO_CMD_SYNC_ZERO_PAGE;
-		memcpy(last_zero_page, main_thread_vm->memory, sizeof(cmd->zero_page));
+	if (cmd->cmds & AUDIO_CMD_PATCH_ROM) {
+		AUDIO_LOG_DEBUG(
+			"Specialized zero page: %d patches (generation %u)",
+			cmd->num_patches, cmd->patch_generation
+		);
 	}
 
-	if (cmd != NULL) {
-		tribuf_end_send(&audio_cmd_buf);
+	if (cmd->cmds & AUDIO_CMD_SYNC_FX) {
+		for (int i = 0; i < FX_MAX_SLOTS; ++i) {
+			if (cmd->fx.sync_bits & (1 << i)) {
+				fx_chain_configure(&fx_chain, i, cmd->fx.slots[i]);
+			}
+		}
+		AUDIO_LOG_DEBUG("Updated .Fx");
 	}
 
-	try_reload_formula();
-	tribuf_try_swap(&audio_cmd_buf);
-
-	audio_state_t* audio_state_ptr = tribuf_begin_recv(&audio_state_buf);
-	if (audio_state_ptr != NULL) {
-		last_audio_state = *audio_state_ptr;
-		tribuf_end_recv(&audio_state_buf);
+	if (cmd->cmds & AUDIO_CMD_SYNC_SAMPLER) {
+		AUDIO_LOG_DEBUG("Updated .Sampler");
 	}
+}
 
-	float width = sapp_widthf();
-	float height = sapp_heightf();
-	bool playing_forward = bytebeat->v < UINT16_MAX / 2;
-	uint8_t bytebeat_opts = bytebeat_options(main_thread_vm);
+// Soft clip above the knee so the output never leaves [-1, 1].
+// The curve is continuous with the identity at the knee and its slope tends
+// to 0 at the limit.
+static void
+limit_block(float* restrict buffer, int num_frames) {
+	const float range = 1.f - LIMITER_KNEE;
+	for (int i = 0; i < num_frames; ++i) {
+		float x = buffer[i];
+		float magnitude = fabsf(x);
+		float over = (magnitude - LIMITER_KNEE) / range;
+		float limited = LIMITER_KNEE + range * over / (1.f + over);
+		buffer[i] = magnitude > LIMITER_KNEE ? copysignf(limited, x) : x;
+	}
+}
 
-	sgl_defaults();
-	sgl_viewport(0, 0, sapp_width(), sapp_height(), true);
-	sgl_ortho(0.f, sapp_widthf(), sapp_heightf(), 0.f, -1.f, 1.f);
+// Mix all voices and apply effects.
+// The hash of the output is updated when it is not NULL.
+static void
+render_audio(float* buffer, int num_frames, int num_channels, uint64_t* hash) {
+	for (int offset = 0; offset < num_frames; offset += AUDIO_BLOCK_SIZE) {
+		int block_size = num_frames - offset;
+		block_size = block_size > AUDIO_BLOCK_SIZE ? AUDIO_BLOCK_SIZE : block_size;
 
-	// Screen
-	uint32_t palette[4];
-	buxn_system_palette(main_thread_vm, palette);
-	if (
-		palette[0] != 0xff000000
-		||
-		palette[1] != 0xff000000
-		||
-		palette[2] != 0xff000000
-		||
-		palette[3] != 0xff000000
-	) {
-		if (
-			(int)width != main_thread_devices.screen->width
-			||
-			(int)height != main_thread_devices.screen->height
-		) {
-			buxn_screen_info_t screen_info = buxn_screen_info(width, height);
-			main_thread_devices.screen = realloc(main_thread_devices.screen, screen_info.screen_mem_size);
-			buxn_screen_resize(main_thread_devices.screen, width, height);
-			init_layer_texture(&background_texture, width, height, screen_info, "ubeat.screen.background");
-			init_layer_texture(&foreground_texture, width, height, screen_info, "ubeat.screen.foreground");
+		bool active[BYTEBEAT_MAX_VOICES];
+		for (int i = 1; i < BYTEBEAT_MAX_VOICES; ++i) {
+			audio_voice_t* voice = &audio_voices[i];
+			active[i] = bytebeat_voice_is_active(&voice->devices.bytebeat, i);
+			if (active[i]) {
+				voice->num_frames = block_size;
+				worker_start_job(&voice->worker, render_voice, voice);
+			}
 		}
 
-		uint64_t now = stm_now();
-		double time_diff = stm_us(stm_diff(now, last_frame));
-		last_frame = now;
-		frame_time_accumulator += time_diff;
-
-		bool should_redraw = frame_time_accumulator >= FRAME_TIME_US;
-		while (frame_time_accumulator >= FRAME_TIME_US) {
-			frame_time_accumulator -= FRAME_TIME_US;
-			buxn_screen_update(main_thread_vm);
-		}
-
-		if (should_redraw) {
-			if (buxn_screen_render(
-				main_thread_devices.screen,
-				BUXN_SCREEN_LAYER_BACKGROUND,
-				palette,
-				background_texture.cpu
-			)) {
-				sg_update_image(
-					background_texture.gpu,
-					&(sg_image_data) {
-						.subimage[0][0] = {
-							.ptr = background_texture.cpu,
-							.size = background_texture.size,
-						},
-					}
+		active[0] = true;
+		audio_voices[0].num_frames = block_size;
+		render_voice(&audio_voices[0]);
+
+		float left[AUDIO_BLOCK_SIZE];
+		float right[AUDIO_BLOCK_SIZE];
+		memset(left, 0, sizeof(float) * block_size);
+		memset(right, 0, sizeof(float) * block_size);
+
+		// Kept as simple loops over planar buffers so they can be vectorized
+		for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+			if (!active[i]) { continue; }
+			if (i > 0) { worker_wait(&audio_voices[i].worker); }
+
+			audio_voice_t* voice = &audio_voices[i];
+			voice_tier_t* tier = &voice->tier;
+			if (tier->num_logged_promotions != tier->num_promotions) {
+				tier->num_logged_promotions = tier->num_promotions;
+				AUDIO_LOG_DEBUG(
+					"Voice %d is now compiled (%.3f ms)",
+					i, stm_ms(tier->warmup_ticks)
 				);
 			}
 
-			palette[0] = 0; // Foreground treats color0 as transparent
-			if (buxn_screen_render(
-				main_thread_devices.screen,
-				BUXN_SCREEN_LAYER_FOREGROUND,
-				palette,
-				foreground_texture.cpu
-			)) {
-				sg_update_image(
-					foreground_texture.gpu,
-					&(sg_image_data) {
-						.subimage[0][0] = {
-							.ptr = foreground_texture.cpu,
-							.size = foreground_texture.size,
-						},
-					}
-				);
+			float scale = (float)voice->devices.bytebeat.voices[i].gain / (255.f * 32768.f);
+			for (int j = 0; j < block_size; ++j) {
+				left[j] += (float)voice->left[j] * scale;
+			}
+			for (int j = 0; j < block_size; ++j) {
+				right[j] += (float)voice->right[j] * scale;
 			}
 		}
 
-		sgl_enable_texture();
-		sgl_push_pipeline();
-		sgl_load_pipeline(screen_pipeline);
-		blit_layer_texture(&background_texture, width, height);
-		blit_layer_texture(&foreground_texture, width, height);
-		sgl_pop_pipeline();
-		sgl_disable_texture();
-	}
-
-	// Bytebeat visual
-	if (bytebeat_opts & (BYTEBEAT_OPTS_SHOW_WAVEFORM | BYTEBEAT_OPTS_SHOW_FFT)) {
-		sgl_begin_points();
-		{
-			sgl_point_size(2.f);
+		uint64_t trace_start = trace_begin();
+		fx_chain_process(&fx_chain, 0, left, block_size);
+		fx_chain_process(&fx_chain, 1, right, block_size);
+		trace_end("fx_chain_process", trace_start);
 
-			if (playing_forward) {
-				sgl_c4b(0, 0, 255, 255);
-			} else {
-				sgl_c4b(0, 255, 255, 255);
-			}
+		limit_block(left, block_size);
+		limit_block(right, block_size);
 
-			double time_diff_s = stm_sec(stm_now()) - stm_sec(last_audio_state.timestamp);
-			uint16_t t = last_audio_state.t + (uint16_t)(time_diff_s * (double)SAMPLING_RATE) * (double)last_audio_state.v;
-			uint16_t old_t = bytebeat->t;
-			devices_t* devices = main_thread_vm->config.userdata;
-			buxn_jit_t* jit = devices->jit;
-			for (uint16_t i = 0; i < SAMPLING_RATE; ++i) {
-				uint8_t byte = bytebeat_render(main_thread_vm, jit, bytebeat, t + i);
-
-				if (bytebeat_opts & BYTEBEAT_OPTS_SHOW_WAVEFORM) {
-					sgl_v2f(
-						(float)i / (float)SAMPLING_RATE * width,
-						height - height * (float)byte / 255.f
-					);
-				}
+		// Planar so the hash does not depend on the number of channels
+		if (hash != NULL) {
+			*hash = session_hash(*hash, left, sizeof(float) * block_size);
+			*hash = session_hash(*hash, right, sizeof(float) * block_size);
+		}
 
-				if (i < (float)FFT_SIZE) {
-					fft_in[(int)i][0] = (float)byte / 255.f * 2.f - 1.f;
-					fft_in[(int)i][1] = 0.f;
-				}
+		float* out = buffer + offset * num_channels;
+		if (num_channels == 1) {
+			for (int i = 0; i < block_size; ++i) {
+				out[i] = (left[i] + right[i]) * 0.5f;
 			}
-			bytebeat->t = old_t;
-		}
-		sgl_end();
-
-		if (bytebeat_opts & BYTEBEAT_OPTS_SHOW_FFT) {
-			am_fft_1d(fft, fft_in, fft_out);
-			sgl_begin_line_strip();
-			for (int i = 0; i < FFT_SIZE / 2; ++i) {
-				float amplitude = sqrtf(fft_out[i][0] * fft_out[i][0] + fft_out[i][1] * fft_out[i][1]) / (float)FFT_SIZE;
-
-				float lerp_factor = sqrtf(amplitude);
-				if (playing_forward) {
-					sgl_c3f(
-						lerp(lerp_factor, 0.f, 1.f),
-						lerp(lerp_factor, 1.f, 0.f),
-						lerp(lerp_factor, 1.f, 0.f)
-					);
-				} else {
-					sgl_c3f(
-						lerp(lerp_factor, 1.f, 1.f),
-						0.f,
-						lerp(lerp_factor, 1.f, 0.f)
-					);
-				}
-				sgl_v2f(
-					(float)i / ((float)FFT_SIZE / 2.f) * width + 1.f,
-					height - height * amplitude
-				);
+		} else {
+			for (int i = 0; i < block_size; ++i) {
+				out[i * num_channels + 0] = left[i];
+				out[i * num_channels + 1] = right[i];
 			}
-			sgl_end();
 		}
+
+		capture_write(&capture, out, block_size, num_channels);
 	}
+}
 
-	// Actual rendering
-	sg_begin_pass(&(sg_pass){
-		.swapchain = sglue_swapchain(),
-		.action.colors[0] = {
-			.load_action = SG_LOADACTION_CLEAR,
-		},
-	});
-	sgl_draw();
-	sg_end_pass();
-	sg_commit();
+// Writes are delayed by exactly one callback: a write received some time
+// after the previous callback started lands that long into this one.
+// Latency is then constant and jitter does not depend on the buffer size.
+static int
+control_write_offset(uint64_t timestamp, int num_frames) {
+	if (timestamp <= last_callback_start) { return 0; }
 
-	if (audio_state_ptr != NULL) {
-		bytebeat->t = last_audio_state.t;
-		bytebeat->v = last_audio_state.v;
-	}
+	double delay = stm_sec(timestamp - last_callback_start);
+	int offset = (int)(delay * SAMPLING_RATE);
+	return offset < num_frames ? offset : num_frames;
 }
 
+// Loads which folded the written byte are restored right away instead of
+// waiting for the main thread to specialize the zero page again
 static void
-audio(float* buffer, int num_frames, int num_channels) {
-	bytebeat_t* bytebeat = &audio_thread_devices.bytebeat;
+unpatch_zp_folds(audio_voice_t* voice, uint8_t address) {
+	bool unpatched = false;
+	for (int i = 0; i < audio_zp_folds.num_sites; ++i) {
+		const analysis_patch_t* original = &audio_zp_folds.originals[i];
+		if (!analysis_patch_folds(original, address)) { continue; }
 
-	// Process commands
-	audio_cmd_t* cmd = tribuf_begin_recv(&audio_cmd_buf);
-	if (cmd != NULL) {
-		if (cmd->cmds & AUDIO_CMD_LOAD_ROM) {
-			buxn_vm_reset(audio_thread_vm, BUXN_VM_RESET_SOFT);
-			memcpy(
-				audio_thread_vm->memory + BUXN_RESET_VECTOR,
-				cmd->rom.content,
-				cmd->rom.size
-			);
+		uint8_t* site = voice->vm->memory + original->addr;
+		if (memcmp(site, original->bytes, original->size) != 0) {
+			memcpy(site, original->bytes, original->size);
+			unpatched = true;
+		}
+	}
+	if (!unpatched) { return; }
 
-			reset_jit(audio_thread_vm);
+	// Only voices which read the byte may have compiled the folded loads
+	if (voice->read_zp[address / 8] & (1 << (address % 8))) {
+		demote_voice(voice);
+	}
+	lanes_reset(&voice->lanes);
+	checkpoints_clear(voice->checkpoints);
+}
 
-			BLOG_DEBUG("Loaded new rom: %d bytes", cmd->rom.size);
+static void
+apply_control_write(const control_write_t* write) {
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		audio_voice_t* voice = &audio_voices[i];
+		if (write->target == CONTROL_WRITE_ZERO_PAGE) {
+			voice->vm->memory[write->address] = (uint8_t)write->value;
+			unpatch_zp_folds(voice, write->address);
+			voice->reverse.num_frames = 0;
+			continue;
 		}
+		if (write->voice != i) { continue; }
 
-		if (cmd->cmds & AUDIO_CMD_SYNC_ZERO_PAGE) {
-			memcpy(
-				audio_thread_vm->memory,
-				cmd->zero_page,
-				sizeof(cmd->zero_page)
-			);
-			BLOG_DEBUG("Synced zero page");
+		bytebeat_voice_t* state = &voice->devices.bytebeat.voices[i];
+		switch ((control_target_t)write->target) {
+			case CONTROL_WRITE_T:
+				state->t = write->value;
+				voice->seek_pending = true;
+				break;
+			case CONTROL_WRITE_V:
+				state->v = write->value;
+				break;
+			case CONTROL_WRITE_VECTOR:
+				state->vector = write->value;
+				break;
+			case CONTROL_WRITE_GAIN:
+				state->gain = (uint8_t)write->value;
+				break;
+			case CONTROL_WRITE_ZERO_PAGE:
+				break;
 		}
+	}
+}
 
-		if (cmd->cmds & AUDIO_CMD_SYNC_BYTEBEAT) {
-			if (cmd->bytebeat.sync_bits & BYTEBEAT_SYNC_VECTOR) {
-				bytebeat->vector = cmd->bytebeat.vector;
-				BLOG_DEBUG("Updated .Bytebeat/vector");
-			}
+static void
+audio(float* buffer, int num_frames, int num_channels) {
+	trace_set_thread_name("audio");
+	uint64_t audio_trace_start = trace_begin();
+	uint64_t callback_start = stm_now();
 
-			if (cmd->bytebeat.sync_bits & BYTEBEAT_SYNC_T) {
-				bytebeat->t = cmd->bytebeat.t;
-				BLOG_DEBUG("Updated .Bytebeat/t");
-			}
+	// The audio thread is created by the backend so it can only be set up
+	// from the inside
+	if (realtime && !audio_thread_promoted) {
+		audio_thread_promoted = true;
+		realtime_prefault_stack();
+		int error = realtime_promote_thread(pthread_self());
+		if (error == 0) {
+			AUDIO_LOG_INFO("Audio thread is now real-time");
+		} else {
+			AUDIO_LOG_WARN("Could not raise the priority of the audio thread: %s", realtime_describe_error(error));
+		}
+	}
 
-			if (cmd->bytebeat.sync_bits & BYTEBEAT_SYNC_V) {
-				bytebeat->v = cmd->bytebeat.v;
-				BLOG_DEBUG("Updated .Bytebeat/v");
-			}
+	bool recording = atomic_load_explicit(&recording_session, memory_order_relaxed);
+
+	// Process commands
+	uint64_t trace_start = trace_begin();
+	audio_cmd_t* cmd = tribuf_begin_recv(&audio_cmd_buf);
+	if (cmd != NULL) {
+		process_audio_command(cmd);
+		applied_cmd_sequence = cmd->sequence;
+		if (recording) {
+			session_event_t event = {
+				.type = SESSION_RECORD_CONSUMED,
+				.sequence = cmd->sequence,
+				.position = atomic_load_explicit(&audio_position, memory_order_relaxed),
+			};
+			ring_write(&session_event_ring, &event, sizeof(event));
 		}
 
 		cmd->cmds = 0;
+		memset(cmd->zero_page_mask, 0, sizeof(cmd->zero_page_mask));
+		memset(cmd->patched_zp, 0, sizeof(cmd->patched_zp));
+		memset(cmd->standby_voices, 0, sizeof(cmd->standby_voices));
 		tribuf_end_recv(&audio_cmd_buf);
+		trace_end("process_commands", trace_start);
 	}
 
 	// Send state update
+	trace_start = trace_begin();
 	audio_state_t* audio_state = tribuf_begin_send(&audio_state_buf);
-	audio_state->t = bytebeat->t;
-	audio_state->v = bytebeat->v;
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		bytebeat_voice_t* state = &audio_voices[i].devices.bytebeat.voices[i];
+		audio_state->voices[i].t = state->t;
+		audio_state->voices[i].v = state->v;
+		audio_state->voices[i].render_ticks = audio_voices[i].render_ticks;
+		audio_state->voices[i].interpreted = audio_voices[i].devices.interpreted;
+		audio_state->voices[i].num_promotions = audio_voices[i].tier.num_promotions;
+		audio_state->voices[i].warmup_ticks = audio_voices[i].tier.warmup_ticks;
+	}
 	audio_state->timestamp = stm_now();
+	audio_state->cmd_sequence = applied_cmd_sequence;
+	audio_state->crossfading = false;
+	for (int i = 0; i < BYTEBEAT_MAX_VOICES; ++i) {
+		audio_state->crossfading |= audio_voices[i].fade.remaining > 0;
+	}
 	tribuf_end_send(&audio_state_buf);
+	trace_end("tribuf_send", trace_start);
+
+	// Render audio, stopping wherever a control write lands
+	uint64_t output_hash = atomic_load_explicit(&audio_output_hash, memory_order_relaxed);
+	uint64_t* hash = recording ? &output_hash : NULL;
+	int offset = 0;
+	control_write_t write;
+	while (control_is_running(&control) && control_read(&control.audio_ring, &write)) {
+		int write_offset = control_write_offset(write.timestamp, num_frames);
+		if (write_offset > offset) {
+			render_audio(buffer + offset * num_channels, write_offset - offset, num_channels, hash);
+			offset = write_offset;
+		}
+		apply_control_write(&write);
+		if (recording) {
+			session_event_t event = {
+				.type = SESSION_RECORD_CONTROL,
+				.position = atomic_load_explicit(&audio_position, memory_order_relaxed) + (uint64_t)offset,
+				.write = write,
+			};
+			ring_write(&session_event_ring, &event, sizeof(event));
+		}
+	}
+	render_audio(buffer + offset * num_channels, num_frames - offset, num_channels, hash);
+	atomic_store_explicit(&audio_output_hash, output_hash, memory_order_release);
+	atomic_fetch_add_explicit(&audio_position, num_frames, memory_order_release);
+	last_callback_start = callback_start;
 
-	// Render audio
-	devices_t* devices = audio_thread_vm->config.userdata;
-	buxn_jit_t* jit = devices->jit;
-	for (int i = 0; i < num_frames; ++i, bytebeat->t += bytebeat->v) {
-		uint8_t byte = bytebeat_render(audio_thread_vm, jit, bytebeat, bytebeat->t);
-		buffer[i] = (float)byte / 255.f * 2.f - 1.f;
+	// Keep the highest load until the main thread reads it
+	double duration = (double)num_frames / (double)SAMPLING_RATE;
+	unsigned load = (unsigned)(stm_sec(stm_since(callback_start)) / duration * 1000.0);
+	last_callback_load = load;
+	unsigned peak_load = atomic_load_explicit(&audio_peak_load, memory_order_relaxed);
+	while (
+		load > peak_load
+		&& !atomic_compare_exchange_weak_explicit(
+			&audio_peak_load, &peak_load, load,
+			memory_order_relaxed, memory_order_relaxed
+		)
+	) {
 	}
+
+	trace_end("audio", audio_trace_start);
 }
 
 // }}}
@@ -802,6 +4488,10 @@ buxn_vm_dei(buxn_vm_t* vm, uint8_t address) {
 			return bytebeat_dei(vm, &devices->bytebeat, address);
 		case BUXN_DEVICE_FPU:
 			return buxn_fpu_dei(vm, &devices->fpu, address);
+		case FX_SLOT:
+			return fx_dei(vm, &devices->fx, address);
+		case SAMPLER_BANK:
+			return sampler_dei(vm, &devices->sampler, address);
 		default:
 			return vm->device[address];
 	}
@@ -834,28 +4524,56 @@ buxn_vm_deo(buxn_vm_t* vm, uint8_t address) {
 		case BUXN_DEVICE_FPU:
 			buxn_fpu_deo(vm, &devices->fpu, address);
 			break;
+		case FX_SLOT:
+			fx_deo(vm, &devices->fx, address);
+			break;
+		case SAMPLER_BANK:
+			sampler_deo(vm, &devices->sampler, address);
+			break;
 	}
 }
 
-void
-buxn_system_debug(struct buxn_vm_s* vm, uint8_t value) {
-	if (value == 0) { return; }
+static void
+write_console(devices_t* devices, bool is_error, const char* data, size_t size) {
+	// Output of a warm-up run would be a duplicate
+	if (devices->is_shadow) { return; }
 
-	fprintf(stderr, "WST");
-	for (uint8_t i = 0; i < vm->wsp; ++i) {
-		fprintf(stderr, " %02hhX", vm->ws[i]);
+	ring_t* ring = is_error ? devices->console_err : devices->console_out;
+	if (ring != NULL) {
+		// Audio thread VMs must not block on stdio
+		ring_write(ring, data, size);
+	} else {
+		FILE* file = is_error ? stderr : console_out_file();
+		fwrite(data, 1, size, file);
+		fflush(file);
 	}
-	fprintf(stderr, "\n");
+}
 
-	fprintf(stderr, "RST");
-	for (uint8_t i = 0; i < vm->rsp; ++i) {
-		fprintf(stderr, " %02hhX", vm->rs[i]);
+static void
+write_stack(devices_t* devices, const char* name, const uint8_t* stack, uint8_t size) {
+	char text[4 + 3 * 256 + 2];
+	int length = snprintf(text, sizeof(text), "%s", name);
+	for (uint8_t i = 0; i < size; ++i) {
+		length += snprintf(text + length, sizeof(text) - length, " %02hhX", stack[i]);
 	}
-	fprintf(stderr, "\n");
+	length += snprintf(text + length, sizeof(text) - length, "\n");
+	write_console(devices, true, text, length);
+}
+
+void
+buxn_system_debug(struct buxn_vm_s* vm, uint8_t value) {
+	if (value == 0) { return; }
+
+	devices_t* devices = vm->config.userdata;
+	write_stack(devices, "WST", vm->ws, vm->wsp);
+	write_stack(devices, "RST", vm->rs, vm->rsp);
 }
 
 void
 buxn_system_set_metadata(struct buxn_vm_s* vm, uint16_t address) {
+	devices_t* devices = vm->config.userdata;
+	if (devices->is_shadow) { return; }
+
 	buxn_metadata_t metadata = buxn_metadata_parse_from_memory(vm, address);
 	if (metadata.content == NULL) {
 		BLOG_WARN("ROM tried to set invalid metadata");
@@ -866,10 +4584,15 @@ buxn_system_set_metadata(struct buxn_vm_s* vm, uint16_t address) {
 	while (ch < metadata.content + metadata.content_len && *ch != '\n') {
 		++ch;
 	}
-	char old_char = *ch;
-	*ch = '\0';
-	sapp_set_window_title(metadata.content);
-	*ch = old_char;
+	// The window belongs to the GL thread, the title is sent with the next
+	// frame
+	if (!headless) {
+		int length = (int)(ch - metadata.content);
+		length = length < WINDOW_TITLE_SIZE - 1 ? length : WINDOW_TITLE_SIZE - 1;
+		memcpy(window_title, metadata.content, length);
+		window_title[length] = '\0';
+		window_title_changed = true;
+	}
 }
 
 void
@@ -879,18 +4602,14 @@ buxn_system_theme_changed(struct buxn_vm_s* vm) {
 
 void
 buxn_console_handle_write(struct buxn_vm_s* vm, buxn_console_t* device, char c) {
-	(void)vm;
 	(void)device;
-	fputc(c, stdout);
-	fflush(stdout);
+	write_console(vm->config.userdata, false, &c, 1);
 }
 
 void
 buxn_console_handle_error(struct buxn_vm_s* vm, buxn_console_t* device, char c) {
-	(void)vm;
 	(void)device;
-	fputc(c, stderr);
-	fflush(stdout);
+	write_console(vm->config.userdata, true, &c, 1);
 }
 
 buxn_screen_t*
@@ -905,7 +4624,9 @@ buxn_screen_request_resize(
 
 void*
 buxn_jit_alloc(void* mem_ctx, size_t size, size_t alignment) {
-	return barena_memalign(mem_ctx, size, alignment);
+	jit_state_t* jit_state = mem_ctx;
+	jit_state->num_bytes += size;
+	return barena_memalign(&jit_state->arena, size, alignment);
 }
 
 // }}}
@@ -953,6 +4674,20 @@ parse_log_level(void* userdata, const char* value) {
 	return NULL;
 }
 
+static const char*
+parse_sink(void* userdata, const char* value) {
+	headless_sink_t* sink = userdata;
+	if        (strcmp(value, "null") == 0) {
+		*sink = HEADLESS_SINK_NULL;
+	} else if (strcmp(value, "stdout") == 0) {
+		*sink = HEADLESS_SINK_STDOUT;
+	} else {
+		return "Invalid sink";
+	}
+
+	return NULL;
+}
+
 int
 main(int argc, const char* argv[]) {
 	blog_level_t log_level = BLOG_LEVEL_INFO;
@@ -982,10 +4717,150 @@ main(int argc, const char* argv[]) {
 			.short_name = 'h',
 			.parser = barg_int(&height),
 		},
+		{
+			.name = "buffer-frames",
+			.summary = "Size of the audio buffer",
+			.description = "A larger buffer tolerates more expensive tunes at the cost of latency. The backend picks a default when it is not set. With --adaptive-buffer, this is the minimum size.",
+			.value_name = "frames",
+			.parser = barg_int(&buffer_frames),
+		},
+		{
+			.name = "packets",
+			.summary = "Number of audio packets",
+			.description = "Only used by backends which buffer audio in packets",
+			.value_name = "count",
+			.parser = barg_int(&num_packets),
+		},
+		{
+			.name = "adaptive-buffer",
+			.summary = "Resize the audio buffer based on the cost of the tune",
+			.boolean = true,
+			.parser = barg_boolean(&adaptive_buffer),
+		},
+		{
+			.name = "record",
+			.summary = "Record the output to a WAV file",
+			.description = "Recording can also be toggled with F5",
+			.value_name = "file",
+			.parser = barg_str(&record_file),
+		},
+		{
+			.name = "no-cache",
+			.summary = "Always assemble instead of loading a cached rom",
+			.boolean = true,
+			.parser = barg_boolean(&no_cache),
+		},
+		{
+			.name = "no-lanes",
+			.summary = "Always render one frame at a time",
+			.description = "Pure vectors are otherwise rendered 16 frames at a time. This is mostly useful as a baseline for --bench.",
+			.boolean = true,
+			.parser = barg_boolean(&no_lanes),
+		},
+		{
+			.name = "standby",
+			.summary = "Number of tunes from the playlist which are prepared ahead",
+			.description = "The tunes following the current one are assembled and compiled in the background so switching to them is instant. Defaults to 2.",
+			.value_name = "n",
+			.parser = barg_int(&standby_tunes),
+		},
+		{
+			.name = "standby-jit",
+			.summary = "Limit on the compiled code kept for tunes prepared ahead",
+			.description = "Defaults to 16384 KB.",
+			.value_name = "KB",
+			.parser = barg_int(&standby_jit_kb),
+		},
+		{
+			.name = "composite-screen",
+			.summary = "Merge the screen layers on the CPU and upload a single texture",
+			.description = "This halves texture uploads and draws on large windows. Only rows which changed are merged.",
+			.boolean = true,
+			.parser = barg_boolean(&composite_screen),
+		},
+		{
+			.name = "headless",
+			.summary = "Run without a window or an audio device",
+			.description = "Audio is rendered on a timer and sent to --sink. Stop with Ctrl+C or --duration.",
+			.boolean = true,
+			.parser = barg_boolean(&headless),
+		},
+		{
+			.name = "sink",
+			.summary = "Where audio goes when headless",
+			.description = "Accepted values are: 'null', 'stdout'. 'stdout' writes interleaved signed 16-bit little endian stereo. Use --record to write a WAV file.",
+			.value_name = "sink",
+			.parser = {
+				.parse = parse_sink,
+				.userdata = &headless_sink,
+			},
+		},
+		{
+			.name = "duration",
+			.summary = "Stop after this many seconds when headless",
+			.value_name = "seconds",
+			.parser = barg_int(&duration),
+		},
+		{
+			.name = "crossfade",
+			.summary = "Length of the crossfade between the previous and the new rom after a reload",
+			.description = "The previous rom keeps playing while it fades out. 0 switches immediately.",
+			.value_name = "ms",
+			.parser = barg_int(&crossfade_ms),
+		},
+		{
+			.name = "bench",
+			.summary = "Render this many seconds of audio as fast as possible and report the throughput",
+			.description = "Runs without a window or an audio device. The main thread VM is updated once per audio buffer.",
+			.value_name = "seconds",
+			.parser = barg_int(&bench_seconds),
+		},
+		{
+			.name = "control",
+			.summary = "Listen for OSC control messages",
+			.description = "Either a UDP port on the loopback interface or the path of a Unix datagram socket",
+			.value_name = "endpoint",
+			.parser = barg_str(&control_endpoint),
+		},
+		{
+			.name = "session",
+			.summary = "Record the session",
+			.description = "Every command sent to the audio thread is logged to the given file so the session can be replayed with --replay",
+			.value_name = "file",
+			.parser = barg_str(&session_file),
+		},
+		{
+			.name = "replay",
+			.summary = "Replay a recorded session without a window and report timings",
+			.description = "The output is checked against the live session. Combine with --trace to record a trace of the replay.",
+			.value_name = "file",
+			.parser = barg_str(&replay_file),
+		},
+		{
+			.name = "realtime",
+			.summary = "Lock memory and run the audio threads with a real-time priority",
+			.description = "This may require raising `ulimit -l` and `ulimit -r`",
+			.boolean = true,
+			.parser = barg_boolean(&realtime),
+		},
+		{
+			.name = "trace",
+			.summary = "Record a trace",
+			.description = "Trace events are written to the given file on exit or when F4 is pressed",
+			.value_name = "file",
+			.parser = barg_str(&trace_file),
+		},
+		{
+			.name = "profile",
+			.summary = "Start the profiler",
+			.description = "Collapsed stacks are written to the given file on exit",
+			.value_name = "file",
+			.parser = barg_str(&profile_file),
+		},
 		barg_opt_help(),
 	};
 	barg_t barg = {
-		.usage = "ubeat [options] [input.tal]",
+		.usage = "ubeat [options] [input.tal|input.rom]...",
 		.summary = "Start the live coding session",
 		.opts = opts,
 		.num_opts = sizeof(opts) / sizeof(opts[0]),
@@ -998,9 +4873,16 @@ main(int argc, const char* argv[]) {
 	}
 	int num_args = argc - result.arg_index;
 
-	if (num_args == 1) {
+	if (num_args >= 1) {
 		input_file = argv[result.arg_index];
 	}
+	if (num_args > MAX_PLAYLIST_TUNES) {
+		fprintf(stderr, "Only the first %d tunes are played\n", MAX_PLAYLIST_TUNES);
+		num_args = MAX_PLAYLIST_TUNES;
+	}
+	for (int i = 0; i < num_args; ++i) {
+		playlist.tunes[playlist.num_tunes++].path = argv[result.arg_index + i];
+	}
 
 	blog_init(&(blog_options_t){
 		.current_depth_in_project = 0,
@@ -1011,6 +4893,29 @@ main(int argc, const char* argv[]) {
 		.with_colors = true,
 	});
 
+	if (replay_file != NULL) {
+		return replay_session(replay_file);
+	}
+
+	if (bench_seconds > 0) {
+		headless = true;
+	}
+
+	if (headless) {
+		if (input_file == NULL) {
+			BLOG_ERROR("An input file is required when headless");
+			return 1;
+		}
+		if (adaptive_buffer) {
+			BLOG_WARN("--adaptive-buffer is ignored when headless");
+			adaptive_buffer = false;
+		}
+		if (bench_seconds > 0) {
+			return run_bench(width, height);
+		}
+		return run_headless(width, height);
+	}
+
 	sapp_run(&(sapp_desc){
 		.init_cb = init,
 		.frame_cb = frame,
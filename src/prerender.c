@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include "prerender.h"
+#include <blog.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ring.h"
+#include "realtime.h"
+
+static struct {
+	prerender_desc_t desc;
+	pthread_t thread;
+	atomic_bool running;
+	// Posted by the device callback whenever it takes from the FIFO
+	sem_t space;
+	atomic_int target_frames;
+	atomic_uint_fast64_t num_underruns;
+
+	ring_t fifo;
+	void* fifo_storage;
+	float* block;
+	// Device callback only
+	bool callback_promoted;
+} prerender = { 0 };
+
+static size_t
+prerender_frame_size(void) {
+	return sizeof(float) * (size_t)prerender.desc.num_channels;
+}
+
+static void*
+prerender_entry(void* userdata) {
+	(void)userdata;
+	const prerender_desc_t* desc = &prerender.desc;
+	size_t block_size = prerender_frame_size() * (size_t)desc->block_frames;
+	while (atomic_load_explicit(&prerender.running, memory_order_relaxed)) {
+		int target_frames = atomic_load_explicit(&prerender.target_frames, memory_order_relaxed);
+		if (ring_num_readable(&prerender.fifo) >= prerender_frame_size() * (size_t)target_frames) {
+			while (sem_wait(&prerender.space) != 0) { }
+			continue;
+		}
+
+		desc->stream_cb(prerender.block, desc->block_frames, desc->num_channels);
+		ring_write(&prerender.fifo, prerender.block, block_size);
+	}
+
+	return NULL;
+}
+
+bool
+prerender_setup(const prerender_desc_t* desc) {
+	prerender.desc = *desc;
+	atomic_store(&prerender.target_frames, desc->block_frames);
+	atomic_store(&prerender.num_underruns, 0);
+	prerender.callback_promoted = false;
+
+	// Rendering stops once the target is reached so the FIFO never holds
+	// more than the largest target plus one block
+	size_t max_size = prerender_frame_size() * (size_t)(desc->max_frames + desc->block_frames);
+	size_t capacity = 1;
+	while (capacity < max_size) { capacity *= 2; }
+	size_t block_size = prerender_frame_size() * (size_t)desc->block_frames;
+	prerender.fifo_storage = malloc(capacity);
+	prerender.block = malloc(block_size);
+	if (desc->realtime) {
+		realtime_prefault(prerender.fifo_storage, capacity);
+		realtime_prefault(prerender.block, block_size);
+	}
+	ring_init(&prerender.fifo, prerender.fifo_storage, capacity);
+	sem_init(&prerender.space, 0, 0);
+
+	atomic_store(&prerender.running, true);
+	if (pthread_create(&prerender.thread, NULL, prerender_entry, NULL) != 0) {
+		BLOG_ERROR("Could not start the render thread");
+		atomic_store(&prerender.running, false);
+		sem_destroy(&prerender.space);
+		free(prerender.fifo_storage);
+		free(prerender.block);
+		return false;
+	}
+	pthread_setname_np(prerender.thread, "ubeat.render");
+
+	return true;
+}
+
+void
+prerender_shutdown(void) {
+	if (!atomic_load(&prerender.running)) { return; }
+
+	atomic_store(&prerender.running, false);
+	sem_post(&prerender.space);
+	pthread_join(prerender.thread, NULL);
+	sem_destroy(&prerender.space);
+	free(prerender.fifo_storage);
+	free(prerender.block);
+}
+
+void
+prerender_set_target(int num_frames) {
+	atomic_store_explicit(&prerender.target_frames, num_frames, memory_order_relaxed);
+	sem_post(&prerender.space);
+}
+
+int
+prerender_target(void) {
+	return atomic_load_explicit(&prerender.target_frames, memory_order_relaxed);
+}
+
+void
+prerender_read(float* buffer, int num_frames, int num_channels) {
+	// The device thread is created by the backend so it can only be set up
+	// from the inside.
+	// Failures are already reported for the render thread.
+	if (prerender.desc.realtime && !prerender.callback_promoted) {
+		prerender.callback_promoted = true;
+		realtime_prefault_stack();
+		realtime_promote_thread(pthread_self());
+	}
+
+	size_t size = sizeof(float) * (size_t)num_frames * (size_t)num_channels;
+	size_t num_read = ring_read(&prerender.fifo, buffer, size);
+	if (num_read < size) {
+		memset((uint8_t*)buffer + num_read, 0, size - num_read);
+		atomic_fetch_add_explicit(&prerender.num_underruns, 1, memory_order_relaxed);
+	}
+	sem_post(&prerender.space);
+}
+
+uint64_t
+prerender_num_underruns(void) {
+	return atomic_load_explicit(&prerender.num_underruns, memory_order_relaxed);
+}
@@ -0,0 +1,46 @@
+#ifndef UBEAT_PRERENDER_H
+#define UBEAT_PRERENDER_H
+
+// Render audio ahead of the device into a FIFO from a thread of its own.
+// The device callback only copies out of the FIFO so how far ahead audio is
+// rendered can change while the device keeps running.
+// Like sokol_audio, there is a single global stream.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+	int num_channels;
+	// Frames rendered per call of stream_cb
+	int block_frames;
+	// Largest target
+	int max_frames;
+	bool realtime;
+	void (*stream_cb)(float* buffer, int num_frames, int num_channels);
+} prerender_desc_t;
+
+bool
+prerender_setup(const prerender_desc_t* desc);
+
+// The device must be stopped first
+void
+prerender_shutdown(void);
+
+// How many frames to keep ahead of the device.
+// When it shrinks, the FIFO drains on its own instead of dropping audio.
+void
+prerender_set_target(int num_frames);
+
+int
+prerender_target(void);
+
+// The stream callback of the device.
+// Missing frames are filled with silence.
+void
+prerender_read(float* buffer, int num_frames, int num_channels);
+
+// Number of reads which found the FIFO short
+uint64_t
+prerender_num_underruns(void);
+
+#endif
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include "profiler.h"
+#include <blog.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+// Between two samples of a replay
+#define PROFILER_INTERVAL_NS 50000
+#define PROFILER_MAX_SAMPLES 256
+// Values of t rendered between two reads of the clock
+#define PROFILER_BATCH_SIZE 16
+#define PROFILER_MAX_LABELS 256
+#define PROFILER_NS_PER_S 1000000000ll
+
+#define PROFILER_JSR 0x0e
+#define PROFILER_JSR2 0x2e
+#define PROFILER_JSI 0x60
+#define PROFILER_LIT 0x80
+#define PROFILER_LIT2 0xa0
+
+#ifndef sigev_notify_thread_id
+#	define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+typedef struct {
+	uint8_t rsp;
+	uint8_t rs[256];
+} profiler_raw_sample_t;
+
+// Written by the signal handler, which runs on the replaying thread
+static buxn_vm_t* volatile profiler_target = NULL;
+static volatile sig_atomic_t profiler_num_raw_samples = 0;
+static profiler_raw_sample_t profiler_raw_samples[PROFILER_MAX_SAMPLES];
+
+static void
+profiler_on_timer(int signum) {
+	(void)signum;
+	buxn_vm_t* vm = profiler_target;
+	int index = profiler_num_raw_samples;
+	if (vm == NULL || index >= PROFILER_MAX_SAMPLES) { return; }
+
+	profiler_raw_sample_t* sample = &profiler_raw_samples[index];
+	sample->rsp = vm->rsp;
+	memcpy(sample->rs, vm->rs, sample->rsp);
+	profiler_num_raw_samples = index + 1;
+}
+
+static long long
+profiler_now_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * PROFILER_NS_PER_S + now.tv_nsec;
+}
+
+// CPU time clocks are only checked on scheduler ticks, which is too coarse.
+// The replay keeps the thread busy so wall time is close enough.
+static bool
+profiler_ensure_timer(profiler_t* profiler) {
+	pid_t thread = gettid();
+	if (profiler->has_timer && profiler->timer_thread == thread) { return true; }
+	if (profiler->timer_failed) { return false; }
+
+	if (profiler->has_timer) {
+		timer_delete(profiler->timer);
+		profiler->has_timer = false;
+	}
+
+	struct sigevent event = {
+		.sigev_notify = SIGEV_THREAD_ID,
+		.sigev_signo = SIGPROF,
+	};
+	event.sigev_notify_thread_id = thread;
+	if (timer_create(CLOCK_MONOTONIC, &event, &profiler->timer) != 0) {
+		BLOG_ERROR("Could not create the profiler timer");
+		profiler->timer_failed = true;
+		return false;
+	}
+
+	profiler->has_timer = true;
+	profiler->timer_thread = thread;
+	return true;
+}
+
+static int
+profiler_find_symbol(const profiler_t* profiler, uint16_t addr) {
+	return profiler->symtab != NULL ? ubeat_symtab_find(profiler->symtab, addr) : -1;
+}
+
+// The subroutine called by the instruction before a return address.
+// Returns -1 when it is not a call to a constant address, in which case the
+// value was put on the return stack for another reason.
+static int
+profiler_callee(buxn_vm_t* vm, uint16_t ret) {
+	const uint8_t* memory = vm->memory;
+	if (memory[(uint16_t)(ret - 3)] == PROFILER_JSI) {
+		return (uint16_t)(ret + buxn_vm_mem_load2(vm, ret - 2));
+	} else if (
+		memory[(uint16_t)(ret - 1)] == PROFILER_JSR2
+		&& memory[(uint16_t)(ret - 4)] == PROFILER_LIT2
+	) {
+		return buxn_vm_mem_load2(vm, ret - 3);
+	} else if (
+		memory[(uint16_t)(ret - 1)] == PROFILER_JSR
+		&& memory[(uint16_t)(ret - 3)] == PROFILER_LIT
+	) {
+		return (uint16_t)(ret + (int8_t)memory[(uint16_t)(ret - 2)]);
+	} else {
+		return -1;
+	}
+}
+
+static profiler_stack_t
+profiler_decode(
+	const profiler_t* profiler,
+	buxn_vm_t* vm,
+	uint16_t vector,
+	const profiler_raw_sample_t* sample
+) {
+	// Unused frames must stay zeroed as the whole stack is hashed
+	profiler_stack_t stack = { 0 };
+	stack.frames[stack.depth++] = (int16_t)profiler_find_symbol(profiler, vector);
+
+	for (int i = 0; i + 1 < sample->rsp;) {
+		uint16_t ret = (uint16_t)(sample->rs[i] << 8 | sample->rs[i + 1]);
+		int callee = profiler_callee(vm, ret);
+		if (callee < 0) {
+			++i;
+			continue;
+		}
+
+		// Deep stacks lose their middle frames but keep the leaf
+		int frame = stack.depth < PROFILER_MAX_DEPTH ? stack.depth++ : PROFILER_MAX_DEPTH - 1;
+		stack.frames[frame] = (int16_t)profiler_find_symbol(profiler, (uint16_t)callee);
+		i += 2;
+	}
+
+	return stack;
+}
+
+void
+profiler_init(profiler_t* profiler) {
+	memset(profiler, 0, sizeof(*profiler));
+	bhash_init(&profiler->stacks, bhash_config_default());
+
+	struct sigaction action = {
+		.sa_handler = profiler_on_timer,
+		.sa_flags = SA_RESTART,
+	};
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, NULL);
+}
+
+void
+profiler_cleanup(profiler_t* profiler) {
+	if (profiler->has_timer) {
+		timer_delete(profiler->timer);
+	}
+	bhash_cleanup(&profiler->stacks);
+}
+
+void
+profiler_reset(profiler_t* profiler, const ubeat_symtab_t* symtab) {
+	bhash_clear(&profiler->stacks);
+	profiler->symtab = symtab;
+	profiler->total_samples = 0;
+	profiler->total_seconds = 0.0;
+}
+
+void
+profiler_sample(
+	profiler_t* profiler,
+	buxn_vm_t* vm,
+	bytebeat_voice_t* voice,
+	uint8_t options,
+	double budget_s,
+	double seconds
+) {
+	if (!profiler_ensure_timer(profiler)) { return; }
+
+	profiler_num_raw_samples = 0;
+	profiler_target = vm;
+	struct itimerspec interval = {
+		.it_interval = { .tv_nsec = PROFILER_INTERVAL_NS },
+		.it_value = { .tv_nsec = PROFILER_INTERVAL_NS },
+	};
+	timer_settime(profiler->timer, 0, &interval, NULL);
+
+	long long budget_ns = (long long)(budget_s * (double)PROFILER_NS_PER_S);
+	long long start = profiler_now_ns();
+	uint16_t t = voice->t;
+	do {
+		for (int i = 0; i < PROFILER_BATCH_SIZE; ++i) {
+			bytebeat_render(vm, NULL, voice, options, t);
+			t += voice->v;
+		}
+	} while (profiler_now_ns() - start < budget_ns);
+
+	timer_settime(profiler->timer, 0, &(struct itimerspec){ 0 }, NULL);
+	profiler_target = NULL;
+	atomic_signal_fence(memory_order_acquire);
+
+	int num_samples = profiler_num_raw_samples;
+	for (int i = 0; i < num_samples; ++i) {
+		profiler_stack_t key = profiler_decode(profiler, vm, voice->vector, &profiler_raw_samples[i]);
+		bhash_alloc_result_t result = bhash_alloc(&profiler->stacks, key);
+		if (result.is_new) {
+			profiler->stacks.values[result.index] = (profiler_cost_t){ 0 };
+		}
+		++profiler->stacks.values[result.index].pending_samples;
+	}
+	if (num_samples == 0) { return; }
+
+	// Split the measured time between the stacks of this replay
+	for (bhash_index_t i = 0; i < bhash_len(&profiler->stacks); ++i) {
+		profiler_cost_t* cost = &profiler->stacks.values[i];
+		cost->seconds += seconds * (double)cost->pending_samples / (double)num_samples;
+		cost->samples += cost->pending_samples;
+		cost->pending_samples = 0;
+	}
+	profiler->total_samples += (uint64_t)num_samples;
+	profiler->total_seconds += seconds;
+}
+
+static int
+profiler_entry_cmp(const void* lhs, const void* rhs) {
+	const profiler_entry_t* lentry = lhs;
+	const profiler_entry_t* rentry = rhs;
+	if (lentry->seconds > rentry->seconds) {
+		return -1;
+	} else if (lentry->seconds < rentry->seconds) {
+		return 1;
+	} else {
+		return 0;
+	}
+}
+
+int
+profiler_top(const profiler_t* profiler, profiler_entry_t* entries, int max_entries) {
+	profiler_entry_t labels[PROFILER_MAX_LABELS];
+	int num_labels = 0;
+
+	for (bhash_index_t i = 0; i < bhash_len(&profiler->stacks); ++i) {
+		const profiler_stack_t* stack = &profiler->stacks.keys[i];
+		int symbol = stack->frames[stack->depth - 1];
+
+		int j = 0;
+		while (j < num_labels && labels[j].symbol != symbol) { ++j; }
+		if (j == num_labels) {
+			if (num_labels == PROFILER_MAX_LABELS) { continue; }
+			labels[num_labels++] = (profiler_entry_t){ .symbol = symbol };
+		}
+		labels[j].seconds += profiler->stacks.values[i].seconds;
+	}
+
+	qsort(labels, num_labels, sizeof(labels[0]), profiler_entry_cmp);
+
+	int num_entries = num_labels < max_entries ? num_labels : max_entries;
+	memcpy(entries, labels, sizeof(labels[0]) * num_entries);
+	return num_entries;
+}
+
+const char*
+profiler_symbol_name(const profiler_t* profiler, int symbol) {
+	if (profiler->symtab == NULL || symbol < 0 || symbol >= profiler->symtab->num_symbols) {
+		return "(unknown)";
+	} else {
+		return profiler->symtab->symbols[symbol].name;
+	}
+}
+
+void
+profiler_write_collapsed(const profiler_t* profiler, FILE* file) {
+	for (bhash_index_t i = 0; i < bhash_len(&profiler->stacks); ++i) {
+		const profiler_stack_t* stack = &profiler->stacks.keys[i];
+		long long us = llround(profiler->stacks.values[i].seconds * 1000000.0);
+		if (us <= 0) { continue; }
+
+		for (int j = 0; j < stack->depth; ++j) {
+			fprintf(file, j == 0 ? "%s" : ";%s", profiler_symbol_name(profiler, stack->frames[j]));
+		}
+		fprintf(file, " %lld\n", us);
+	}
+}
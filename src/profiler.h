@@ -0,0 +1,96 @@
+#ifndef UBEAT_PROFILER_H
+#define UBEAT_PROFILER_H
+
+// Sampling profiler for bytebeat vectors.
+// Compiled code cannot report where it is, so the vector is replayed on a
+// copy of the VM with the buxn interpreter while a timer interrupts it at a
+// fixed rate.
+// Each interrupt records the return stack, which is decoded into a call stack
+// of labels.
+// The render time measured on the audio thread is then split between call
+// stacks in proportion to the number of samples which landed in each.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <bhash.h>
+#include <buxn/vm/vm.h>
+#include "asm.h"
+#include "bytebeat.h"
+
+#define PROFILER_MAX_DEPTH 16
+
+typedef struct {
+	// Indices into the symbol table, outermost first.
+	// -1 when the address is not covered by any label.
+	int16_t depth;
+	int16_t frames[PROFILER_MAX_DEPTH];
+} profiler_stack_t;
+
+typedef struct {
+	uint64_t samples;
+	uint64_t pending_samples;  // Of the current replay
+	double seconds;
+} profiler_cost_t;
+
+typedef struct {
+	int symbol;
+	double seconds;
+} profiler_entry_t;
+
+typedef BHASH_TABLE(profiler_stack_t, profiler_cost_t) profiler_stack_table_t;
+
+typedef struct {
+	const ubeat_symtab_t* symtab;
+	profiler_stack_table_t stacks;
+
+	uint64_t total_samples;
+	double total_seconds;
+
+	// The timer only interrupts the thread which created it
+	bool has_timer;
+	bool timer_failed;
+	pid_t timer_thread;
+	timer_t timer;
+} profiler_t;
+
+void
+profiler_init(profiler_t* profiler);
+
+void
+profiler_cleanup(profiler_t* profiler);
+
+// Discard all samples.
+// Symbols are only valid for one rom so this must be called after a reload.
+void
+profiler_reset(profiler_t* profiler, const ubeat_symtab_t* symtab);
+
+// Replay the vector of a voice for about budget_s seconds starting from
+// voice->t and attribute the given render time to the sampled call stacks.
+// The vector may change memory so vm should be a copy of the voice VM.
+void
+profiler_sample(
+	profiler_t* profiler,
+	buxn_vm_t* vm,
+	bytebeat_voice_t* voice,
+	uint8_t options,
+	double budget_s,
+	double seconds
+);
+
+// Total time spent in each label excluding callees, most expensive first.
+// Returns the number of entries.
+int
+profiler_top(const profiler_t* profiler, profiler_entry_t* entries, int max_entries);
+
+const char*
+profiler_symbol_name(const profiler_t* profiler, int symbol);
+
+// Write one line per call stack in the collapsed format of flamegraph.pl.
+// Counts are in microseconds.
+void
+profiler_write_collapsed(const profiler_t* profiler, FILE* file);
+
+#endif
@@ -0,0 +1,71 @@
+#define _GNU_SOURCE
+#include "realtime.h"
+#include <blog.h>
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define REALTIME_PRIORITY 70
+#define REALTIME_STACK_SIZE (256 * 1024)
+
+bool
+realtime_lock_memory(void) {
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		int error = errno;
+		if (error == ENOMEM || error == EPERM) {
+			BLOG_WARN(
+				"Could not lock memory: %s. Raise the limit with `ulimit -l unlimited`",
+				strerror(error)
+			);
+		} else {
+			BLOG_WARN("Could not lock memory: %s", strerror(error));
+		}
+		return false;
+	}
+
+	BLOG_INFO("Locked memory");
+	return true;
+}
+
+void
+realtime_prefault(void* ptr, size_t size) {
+	volatile char* bytes = ptr;
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t step = page_size > 0 ? (size_t)page_size : 4096;
+	// Write the same value back so untouched pages get their own copy
+	for (size_t i = 0; i < size; i += step) {
+		bytes[i] = bytes[i];
+	}
+	if (size > 0) {
+		bytes[size - 1] = bytes[size - 1];
+	}
+}
+
+void
+realtime_prefault_stack(void) {
+	volatile char stack[REALTIME_STACK_SIZE];
+	realtime_prefault((void*)stack, sizeof(stack));
+}
+
+int
+realtime_promote_thread(pthread_t thread) {
+	int max_priority = sched_get_priority_max(SCHED_FIFO);
+	struct sched_param param = {
+		.sched_priority = REALTIME_PRIORITY < max_priority ? REALTIME_PRIORITY : max_priority,
+	};
+	return pthread_setschedparam(thread, SCHED_FIFO, &param);
+}
+
+const char*
+realtime_describe_error(int error) {
+	switch (error) {
+		case EPERM:
+			return "permission denied, grant CAP_SYS_NICE or raise the limit with `ulimit -r`";
+		case EINVAL:
+			return "SCHED_FIFO is not supported";
+		default:
+			return strerror(error);
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef UBEAT_REALTIME_H
+#define UBEAT_REALTIME_H
+
+// Helpers to keep the audio threads from being preempted or page faulting
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Lock all current and future memory of the process.
+// Failures are logged.
+bool
+realtime_lock_memory(void);
+
+// Touch every page of a block of memory so it is mapped before it is needed
+void
+realtime_prefault(void* ptr, size_t size);
+
+// Touch the stack of the calling thread
+void
+realtime_prefault_stack(void);
+
+// Switch a thread to a real-time scheduling policy.
+// Returns 0 or an errno value.
+int
+realtime_promote_thread(pthread_t thread);
+
+// Explain why a thread could not be promoted
+const char*
+realtime_describe_error(int error);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef RING_H
+#define RING_H
+
+// A bounded single-producer single-consumer byte ring.
+// Writes are all or nothing so a record is either fully visible to the
+// consumer or counted as dropped.
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef struct {
+	atomic_size_t head;  // Only written by the producer
+	atomic_size_t tail;  // Only written by the consumer
+	atomic_size_t num_dropped;  // In bytes
+
+	uint8_t* data;
+	size_t capacity;
+} ring_t;
+
+static inline void
+ring_init(ring_t* ring, void* storage, size_t capacity) {
+	// Capacity must be a power of 2
+	ring->head = 0;
+	ring->tail = 0;
+	ring->num_dropped = 0;
+	ring->data = storage;
+	ring->capacity = capacity;
+}
+
+static inline bool
+ring_write(ring_t* ring, const void* data, size_t size) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (ring->capacity - (head - tail) < size) {
+		atomic_fetch_add_explicit(&ring->num_dropped, size, memory_order_relaxed);
+		return false;
+	}
+
+	size_t offset = head & (ring->capacity - 1);
+	size_t first_part = ring->capacity - offset;
+	first_part = first_part < size ? first_part : size;
+	memcpy(ring->data + offset, data, first_part);
+	memcpy(ring->data, (const uint8_t*)data + first_part, size - first_part);
+
+	atomic_store_explicit(&ring->head, head + size, memory_order_release);
+	return true;
+}
+
+// Returns the number of bytes read
+static inline size_t
+ring_read(ring_t* ring, void* data, size_t size) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	size = head - tail < size ? head - tail : size;
+
+	size_t offset = tail & (ring->capacity - 1);
+	size_t first_part = ring->capacity - offset;
+	first_part = first_part < size ? first_part : size;
+	memcpy(data, ring->data + offset, first_part);
+	memcpy((uint8_t*)data + first_part, ring->data, size - first_part);
+
+	atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+	return size;
+}
+
+// Number of bytes waiting to be read.
+// The consumer may read at any time so this is only an upper bound for the
+// producer.
+static inline size_t
+ring_num_readable(ring_t* ring) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	return head - tail;
+}
+
+static inline size_t
+ring_num_dropped(ring_t* ring) {
+	return atomic_load_explicit(&ring->num_dropped, memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,285 @@
+#define _GNU_SOURCE
+#include "sampler.h"
+#include <blog.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// How far ahead of the playhead pages are requested
+#define SAMPLER_PREFETCH_SECONDS 1
+#define SAMPLER_MIN_PREFETCH (64 * 1024)
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+static inline uint16_t
+read_u16le(const uint8_t* bytes) {
+	return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static inline uint32_t
+read_u32le(const uint8_t* bytes) {
+	return (uint32_t)bytes[0]
+		| ((uint32_t)bytes[1] << 8)
+		| ((uint32_t)bytes[2] << 16)
+		| ((uint32_t)bytes[3] << 24);
+}
+
+static bool
+is_wave(const uint8_t* data, size_t size) {
+	return size >= 12
+		&& memcmp(data, "RIFF", 4) == 0
+		&& memcmp(data + 8, "WAVE", 4) == 0;
+}
+
+// Walk the chunks to find the format and the data
+static bool
+parse_wave(sample_bank_t* bank, const uint8_t* data, size_t size) {
+	bool has_format = false;
+	size_t offset = 12;
+	while (offset + 8 <= size) {
+		const uint8_t* chunk = data + offset;
+		size_t chunk_size = read_u32le(chunk + 4);
+		size_t body = offset + 8;
+		if (chunk_size > size - body) {
+			// Truncated files often only have a wrong data size
+			chunk_size = size - body;
+		}
+
+		if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16) {
+			uint16_t format = read_u16le(chunk + 8);
+			uint16_t num_channels = read_u16le(chunk + 10);
+			uint32_t rate = read_u32le(chunk + 12);
+			uint16_t bits = read_u16le(chunk + 22);
+			if (format != WAVE_FORMAT_PCM && format != WAVE_FORMAT_EXTENSIBLE) {
+				BLOG_ERROR("%s: Unsupported WAV format %04x", bank->path, format);
+				return false;
+			}
+			if (bits != 8 && bits != 16) {
+				BLOG_ERROR("%s: Unsupported bit depth %d", bank->path, bits);
+				return false;
+			}
+			if (num_channels == 0) {
+				BLOG_ERROR("%s: No channels", bank->path);
+				return false;
+			}
+
+			bank->num_channels = num_channels;
+			bank->rate = rate;
+			bank->bytes_per_sample = bits / 8;
+			bank->frame_size = num_channels * bank->bytes_per_sample;
+			has_format = true;
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			if (!has_format) {
+				BLOG_ERROR("%s: Data comes before format", bank->path);
+				return false;
+			}
+
+			bank->frames = data + body;
+			size_t num_frames = chunk_size / bank->frame_size;
+			bank->num_frames = num_frames > UINT32_MAX ? UINT32_MAX : (uint32_t)num_frames;
+			return true;
+		}
+
+		// Chunks are padded to an even size
+		offset = body + chunk_size + (chunk_size & 1);
+	}
+
+	BLOG_ERROR("%s: No data chunk", bank->path);
+	return false;
+}
+
+sample_bank_t*
+sample_bank_open(const char* path, uint32_t raw_rate) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		BLOG_ERROR("Could not open %s", path);
+		return NULL;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size == 0) {
+		BLOG_ERROR("%s is empty", path);
+		close(fd);
+		return NULL;
+	}
+
+	size_t size = (size_t)info.st_size;
+	void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		BLOG_ERROR("Could not map %s", path);
+		return NULL;
+	}
+	// Reads follow the playhead, which may jump anywhere.
+	// Readahead is driven by sample_bank_prefetch instead.
+	madvise(data, size, MADV_RANDOM);
+
+	sample_bank_t* bank = malloc(sizeof(sample_bank_t));
+	*bank = (sample_bank_t){
+		.path = strdup(path),
+		.mapping = data,
+		.mapping_size = size,
+	};
+
+	if (is_wave(data, size)) {
+		if (!parse_wave(bank, data, size)) {
+			sample_bank_close(bank);
+			return NULL;
+		}
+	} else {
+		bank->frames = data;
+		bank->num_frames = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+		bank->rate = raw_rate;
+		bank->num_channels = 1;
+		bank->bytes_per_sample = 1;
+		bank->frame_size = 1;
+	}
+
+	// Get the start ready since that is where most tunes begin
+	bank->prefetched_offset = SIZE_MAX;
+	sample_bank_prefetch(bank);
+
+	BLOG_INFO(
+		"Mapped %s: %u frames, %d channel(s), %d-bit, %u Hz",
+		path, bank->num_frames, bank->num_channels, bank->bytes_per_sample * 8, bank->rate
+	);
+	return bank;
+}
+
+void
+sample_bank_close(sample_bank_t* bank) {
+	munmap((void*)bank->mapping, bank->mapping_size);
+	free(bank->path);
+	free(bank);
+}
+
+void
+sample_bank_prefetch(sample_bank_t* bank) {
+	uint32_t playhead = atomic_load_explicit(&bank->playhead, memory_order_relaxed);
+	size_t window = (size_t)bank->rate * bank->frame_size * SAMPLER_PREFETCH_SECONDS;
+	if (window < SAMPLER_MIN_PREFETCH) { window = SAMPLER_MIN_PREFETCH; }
+
+	size_t offset = (size_t)(bank->frames - bank->mapping) + (size_t)playhead * bank->frame_size;
+	// Only ask again once half of the window has been played or after a seek
+	if (
+		offset >= bank->prefetched_offset
+		&& offset < bank->prefetched_offset + window / 2
+	) {
+		return;
+	}
+
+	size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = offset & ~(page_size - 1);
+	if (start >= bank->mapping_size) { return; }
+	size_t end = offset + window;
+	end = end > bank->mapping_size ? bank->mapping_size : end;
+	// Pages before the previous window have already been requested
+	if (start < bank->prefetched_end && offset >= bank->prefetched_offset) {
+		start = bank->prefetched_end & ~(page_size - 1);
+	}
+
+	if (end > start) {
+		madvise((uint8_t*)bank->mapping + start, end - start, MADV_WILLNEED);
+	}
+	bank->prefetched_offset = offset;
+	bank->prefetched_end = end;
+}
+
+void
+sampler_init(sampler_t* device, uint32_t raw_rate, bool can_open) {
+	*device = (sampler_t){
+		.can_open = can_open,
+		.raw_rate = raw_rate,
+	};
+}
+
+static inline sample_bank_t*
+sampler_current_bank(buxn_vm_t* vm, sampler_t* device) {
+	return device->banks[buxn_vm_dev_load(vm, SAMPLER_BANK) % SAMPLER_MAX_BANKS];
+}
+
+uint8_t
+sampler_dei(buxn_vm_t* vm, sampler_t* device, uint8_t address) {
+	sample_bank_t* bank = sampler_current_bank(vm, device);
+	switch (address) {
+		case SAMPLER_VALUE:
+		case SAMPLER_VALUE + 1: {
+			if (bank == NULL) { return 0; }
+			uint32_t index = ((uint32_t)buxn_vm_dev_load2(vm, SAMPLER_INDEX_HI) << 16)
+				| buxn_vm_dev_load2(vm, SAMPLER_INDEX);
+			uint16_t value = (uint16_t)sample_bank_read(
+				bank, index, buxn_vm_dev_load(vm, SAMPLER_CHANNEL)
+			);
+			return address == SAMPLER_VALUE ? (uint8_t)(value >> 8) : (uint8_t)(value & 0xff);
+		}
+		case SAMPLER_LENGTH_HI:
+			return bank != NULL ? (uint8_t)(bank->num_frames >> 24) : 0;
+		case SAMPLER_LENGTH_HI + 1:
+			return bank != NULL ? (uint8_t)(bank->num_frames >> 16) : 0;
+		case SAMPLER_LENGTH:
+			return bank != NULL ? (uint8_t)(bank->num_frames >> 8) : 0;
+		case SAMPLER_LENGTH + 1:
+			return bank != NULL ? (uint8_t)(bank->num_frames & 0xff) : 0;
+		case SAMPLER_RATE:
+		case SAMPLER_RATE + 1: {
+			if (bank == NULL) { return 0; }
+			uint16_t rate = bank->rate > 0xffff ? 0xffff : (uint16_t)bank->rate;
+			return address == SAMPLER_RATE ? (uint8_t)(rate >> 8) : (uint8_t)(rate & 0xff);
+		}
+		default:
+			return vm->device[address];
+	}
+}
+
+static void
+sampler_retire(sampler_t* device, int index) {
+	sample_bank_t* bank = device->banks[index];
+	if (bank != NULL) {
+		bank->next_retired = device->retired;
+		device->retired = bank;
+		device->banks[index] = NULL;
+	}
+	device->sync_bits |= 1 << index;
+}
+
+void
+sampler_deo(buxn_vm_t* vm, sampler_t* device, uint8_t address) {
+	// File access would stall the audio thread
+	if (address != SAMPLER_NAME + 1 || !device->can_open) { return; }
+
+	char path[SAMPLER_MAX_PATH];
+	uint16_t addr = buxn_vm_dev_load2(vm, SAMPLER_NAME);
+	int length = 0;
+	while (length < SAMPLER_MAX_PATH - 1) {
+		char ch = (char)vm->memory[(uint16_t)(addr + length)];
+		if (ch == '\0') { break; }
+		path[length++] = ch;
+	}
+	path[length] = '\0';
+
+	int index = buxn_vm_dev_load(vm, SAMPLER_BANK) % SAMPLER_MAX_BANKS;
+	sampler_retire(device, index);
+	if (length > 0) {
+		device->banks[index] = sample_bank_open(path, device->raw_rate);
+	}
+}
+
+void
+sampler_clear(sampler_t* device) {
+	for (int i = 0; i < SAMPLER_MAX_BANKS; ++i) {
+		if (device->banks[i] != NULL) {
+			sampler_retire(device, i);
+		}
+	}
+}
+
+sample_bank_t*
+sampler_take_retired(sampler_t* device) {
+	sample_bank_t* retired = device->retired;
+	device->retired = NULL;
+	return retired;
+}
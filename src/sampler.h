@@ -0,0 +1,114 @@
+#ifndef UBEAT_SAMPLER_H
+#define UBEAT_SAMPLER_H
+
+// Sample banks: WAV or raw PCM files mapped into memory.
+// Only the main thread VM can open a file.
+// Audio thread VMs read straight from the mapping, the main thread touches
+// the pages ahead of where they read so they rarely fault.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <buxn/vm/vm.h>
+
+#define SAMPLER_BANK 0xf0
+#define SAMPLER_CHANNEL 0xf1
+#define SAMPLER_NAME 0xf2
+#define SAMPLER_INDEX_HI 0xf4
+#define SAMPLER_INDEX 0xf6
+#define SAMPLER_VALUE 0xf8
+#define SAMPLER_LENGTH_HI 0xfa
+#define SAMPLER_LENGTH 0xfc
+#define SAMPLER_RATE 0xfe
+
+#define SAMPLER_MAX_BANKS 16
+#define SAMPLER_MAX_PATH 256
+
+typedef struct sample_bank_s sample_bank_t;
+
+struct sample_bank_s {
+	char* path;
+
+	const uint8_t* mapping;
+	size_t mapping_size;
+
+	const uint8_t* frames;
+	uint32_t num_frames;
+	uint32_t rate;
+	uint16_t num_channels;
+	uint16_t bytes_per_sample;  // 1 for unsigned 8-bit, 2 for signed 16-bit
+	uint16_t frame_size;
+
+	// Last frame read by any VM
+	atomic_uint_least32_t playhead;
+	// Main thread only
+	size_t prefetched_offset;
+	size_t prefetched_end;
+
+	sample_bank_t* next_retired;
+	uint32_t retire_sequence;  // Set by the owner of the retired list
+};
+
+// Device state, as seen by a VM
+typedef struct {
+	sample_bank_t* banks[SAMPLER_MAX_BANKS];
+
+	// Only set for the main thread VM
+	bool can_open;
+	uint32_t raw_rate;  // Of files without a header
+	uint16_t sync_bits;  // One bit per bank
+	// Banks replaced since the last sync, which may still be in use by
+	// the audio thread
+	sample_bank_t* retired;
+} sampler_t;
+
+void
+sampler_init(sampler_t* device, uint32_t raw_rate, bool can_open);
+
+uint8_t
+sampler_dei(buxn_vm_t* vm, sampler_t* device, uint8_t address);
+
+void
+sampler_deo(buxn_vm_t* vm, sampler_t* device, uint8_t address);
+
+// Retire all banks so a new rom starts from an empty set
+void
+sampler_clear(sampler_t* device);
+
+// Detach the list of retired banks
+sample_bank_t*
+sampler_take_retired(sampler_t* device);
+
+// Files with a RIFF/WAVE header must be 8 or 16-bit PCM.
+// Anything else is treated as unsigned 8-bit mono at raw_rate.
+sample_bank_t*
+sample_bank_open(const char* path, uint32_t raw_rate);
+
+void
+sample_bank_close(sample_bank_t* bank);
+
+// Ask the kernel to page in the data following the last read
+void
+sample_bank_prefetch(sample_bank_t* bank);
+
+// Returns a signed 16-bit sample or 0 when out of range.
+// A channel past the last one reads the last one so mono banks can be
+// played in stereo.
+static inline int16_t
+sample_bank_read(sample_bank_t* bank, uint32_t index, uint8_t channel) {
+	if (index >= bank->num_frames) { return 0; }
+	atomic_store_explicit(&bank->playhead, index, memory_order_relaxed);
+
+	if (channel >= bank->num_channels) { channel = (uint8_t)(bank->num_channels - 1); }
+	const uint8_t* sample = bank->frames
+		+ (size_t)index * bank->frame_size
+		+ (size_t)channel * bank->bytes_per_sample;
+	if (bank->bytes_per_sample == 2) {
+		return (int16_t)(uint16_t)(sample[0] | (sample[1] << 8));
+	} else {
+		return (int16_t)((sample[0] - 0x80) * 256);
+	}
+}
+
+#endif
@@ -0,0 +1,116 @@
+#include "session.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define SESSION_MAGIC "UBEATSES"
+#define SESSION_VERSION 5
+
+// Fields are written one by one in little endian so the file has no padding
+// and does not depend on the host
+#define SESSION_HEADER_SIZE (8 + 4 + 4)
+#define SESSION_RECORD_SIZE (4 + 4 + 8 + 8 + 4)
+
+bool
+session_open_write(session_t* session, const char* path, int sample_rate) {
+	*session = (session_t){ .sample_rate = sample_rate };
+	session->file = fopen(path, "wb");
+	if (session->file == NULL) { return false; }
+
+	uint8_t header[SESSION_HEADER_SIZE];
+	uint8_t* out = header;
+	memcpy(out, SESSION_MAGIC, 8);
+	out += 8;
+	session_put_u32(&out, SESSION_VERSION);
+	session_put_u32(&out, (uint32_t)sample_rate);
+	return fwrite(header, sizeof(header), 1, session->file) == 1;
+}
+
+bool
+session_open_read(session_t* session, const char* path) {
+	*session = (session_t){ 0 };
+	session->file = fopen(path, "rb");
+	if (session->file == NULL) { return false; }
+
+	uint8_t header[SESSION_HEADER_SIZE];
+	const uint8_t* in = header + 8;
+	if (
+		fread(header, sizeof(header), 1, session->file) != 1
+		|| memcmp(header, SESSION_MAGIC, 8) != 0
+		|| session_get_u32(&in) != SESSION_VERSION
+	) {
+		fclose(session->file);
+		session->file = NULL;
+		return false;
+	}
+
+	session->sample_rate = (int)session_get_u32(&in);
+	return true;
+}
+
+void
+session_close(session_t* session) {
+	if (session->file != NULL) {
+		fclose(session->file);
+	}
+	free(session->payload);
+	*session = (session_t){ 0 };
+}
+
+void
+session_write(session_t* session, const session_record_t* record, const void* payload) {
+	uint8_t bytes[SESSION_RECORD_SIZE];
+	uint8_t* out = bytes;
+	session_put_u32(&out, record->type);
+	session_put_u32(&out, record->sequence);
+	session_put_u64(&out, record->position);
+	session_put_u64(&out, record->hash);
+	session_put_u32(&out, record->payload_size);
+	fwrite(bytes, sizeof(bytes), 1, session->file);
+	if (record->payload_size > 0) {
+		fwrite(payload, record->payload_size, 1, session->file);
+	}
+}
+
+bool
+session_read(session_t* session, session_record_t* record, const void** payload) {
+	uint8_t bytes[SESSION_RECORD_SIZE];
+	if (fread(bytes, sizeof(bytes), 1, session->file) != 1) { return false; }
+
+	const uint8_t* in = bytes;
+	record->type = session_get_u32(&in);
+	record->sequence = session_get_u32(&in);
+	record->position = session_get_u64(&in);
+	record->hash = session_get_u64(&in);
+	record->payload_size = session_get_u32(&in);
+
+	if (record->payload_size > session->payload_capacity) {
+		void* new_payload = realloc(session->payload, record->payload_size);
+		if (new_payload == NULL) { return false; }
+		session->payload = new_payload;
+		session->payload_capacity = record->payload_size;
+	}
+
+	if (
+		record->payload_size > 0
+		&& fread(session->payload, record->payload_size, 1, session->file) != 1
+	) {
+		return false;
+	}
+
+	*payload = session->payload;
+	return true;
+}
+
+bool
+session_read_at(session_t* session, long offset, session_record_t* record, const void** payload) {
+	long current = ftell(session->file);
+	bool success = fseek(session->file, offset, SEEK_SET) == 0
+		&& session_read(session, record, payload);
+	fseek(session->file, current, SEEK_SET);
+	return success;
+}
+
+long
+session_tell(session_t* session) {
+	return ftell(session->file);
+}
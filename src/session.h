@@ -0,0 +1,121 @@
+#ifndef UBEAT_SESSION_H
+#define UBEAT_SESSION_H
+
+// A log of the commands received by the audio thread, used to replay a live
+// session offline.
+// Commands are logged by the main thread when they are sent.
+// The audio thread reports the sample position at which it applied each
+// command and that is logged as a separate record, along with every control
+// write it applied.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+	SESSION_RECORD_COMMAND = 1,
+	SESSION_RECORD_CONSUMED = 2,
+	SESSION_RECORD_END = 3,
+	SESSION_RECORD_CONTROL = 4,
+} session_record_type_t;
+
+typedef struct {
+	uint32_t type;
+	uint32_t sequence;
+	uint64_t position;  // In samples
+	uint64_t hash;  // Of the output up to position, only for SESSION_RECORD_END
+	uint32_t payload_size;
+} session_record_t;
+
+typedef struct {
+	FILE* file;
+	int sample_rate;
+
+	// Reading
+	void* payload;
+	uint32_t payload_capacity;
+} session_t;
+
+bool
+session_open_write(session_t* session, const char* path, int sample_rate);
+
+bool
+session_open_read(session_t* session, const char* path);
+
+void
+session_close(session_t* session);
+
+void
+session_write(session_t* session, const session_record_t* record, const void* payload);
+
+// The payload is valid until the next read
+bool
+session_read(session_t* session, session_record_t* record, const void** payload);
+
+// Read the record at an offset from session_tell without moving the cursor
+bool
+session_read_at(session_t* session, long offset, session_record_t* record, const void** payload);
+
+long
+session_tell(session_t* session);
+
+// Payloads are encoded with these as well so that a session does not depend
+// on the host
+static inline void
+session_put_u16(uint8_t** out, uint16_t value) {
+	*(*out)++ = (uint8_t)value;
+	*(*out)++ = (uint8_t)(value >> 8);
+}
+
+static inline void
+session_put_u32(uint8_t** out, uint32_t value) {
+	for (int i = 0; i < 4; ++i) {
+		*(*out)++ = (uint8_t)(value >> (i * 8));
+	}
+}
+
+static inline void
+session_put_u64(uint8_t** out, uint64_t value) {
+	for (int i = 0; i < 8; ++i) {
+		*(*out)++ = (uint8_t)(value >> (i * 8));
+	}
+}
+
+static inline uint16_t
+session_get_u16(const uint8_t** in) {
+	uint16_t value = (uint16_t)((*in)[0] | (*in)[1] << 8);
+	*in += 2;
+	return value;
+}
+
+static inline uint32_t
+session_get_u32(const uint8_t** in) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; ++i) {
+		value |= (uint32_t)*(*in)++ << (i * 8);
+	}
+	return value;
+}
+
+static inline uint64_t
+session_get_u64(const uint8_t** in) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i) {
+		value |= (uint64_t)*(*in)++ << (i * 8);
+	}
+	return value;
+}
+
+// FNV-1a
+static inline uint64_t
+session_hash(uint64_t hash, const void* data, size_t size) {
+	const uint8_t* bytes = data;
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+#define SESSION_HASH_INIT 0xcbf29ce484222325ull
+
+#endif
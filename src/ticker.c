@@ -0,0 +1,89 @@
+#define _GNU_SOURCE
+#include "ticker.h"
+#include <blog.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+#define TICKER_NS_PER_S 1000000000ll
+
+static long long
+ticker_ns(const struct timespec* time) {
+	return (long long)time->tv_sec * TICKER_NS_PER_S + time->tv_nsec;
+}
+
+static void*
+ticker_entry(void* userdata) {
+	ticker_t* ticker = userdata;
+	trace_set_thread_name(ticker->name);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long long deadline = ticker_ns(&now);
+	while (atomic_load_explicit(&ticker->running, memory_order_relaxed)) {
+		ticker->fn(ticker->userdata);
+		atomic_fetch_add_explicit(&ticker->num_ticks, 1, memory_order_relaxed);
+
+		deadline += ticker->period_ns;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long long late_ns = ticker_ns(&now) - deadline;
+		if (late_ns >= 0) {
+			// Keep to the original schedule so the rate stays the same on
+			// average
+			long long num_missed = late_ns / ticker->period_ns;
+			atomic_fetch_add_explicit(&ticker->num_overruns, 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&ticker->num_skipped, (uint_fast64_t)num_missed, memory_order_relaxed);
+			deadline += (num_missed + 1) * ticker->period_ns;
+		}
+
+		struct timespec wakeup = {
+			.tv_sec = deadline / TICKER_NS_PER_S,
+			.tv_nsec = deadline % TICKER_NS_PER_S,
+		};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeup, NULL) != 0) { }
+	}
+
+	return NULL;
+}
+
+bool
+ticker_start(ticker_t* ticker, const char* name, double period_s, ticker_fn_t fn, void* userdata) {
+	*ticker = (ticker_t){
+		.name = name,
+		.period_ns = (long long)(period_s * (double)TICKER_NS_PER_S),
+		.fn = fn,
+		.userdata = userdata,
+	};
+
+	atomic_store(&ticker->running, true);
+	if (pthread_create(&ticker->thread, NULL, ticker_entry, ticker) != 0) {
+		BLOG_ERROR("Could not start %s", name);
+		atomic_store(&ticker->running, false);
+		return false;
+	}
+
+	// Thread names are limited to 16 bytes including the terminator
+	char thread_name[16];
+	strncpy(thread_name, name, sizeof(thread_name) - 1);
+	thread_name[sizeof(thread_name) - 1] = '\0';
+	pthread_setname_np(ticker->thread, thread_name);
+
+	return true;
+}
+
+void
+ticker_stop(ticker_t* ticker) {
+	if (!atomic_load(&ticker->running)) { return; }
+
+	atomic_store(&ticker->running, false);
+	pthread_join(ticker->thread, NULL);
+}
+
+ticker_stats_t
+ticker_stats(ticker_t* ticker) {
+	return (ticker_stats_t){
+		.num_ticks = atomic_load_explicit(&ticker->num_ticks, memory_order_relaxed),
+		.num_overruns = atomic_load_explicit(&ticker->num_overruns, memory_order_relaxed),
+		.num_skipped = atomic_load_explicit(&ticker->num_skipped, memory_order_relaxed),
+	};
+}
@@ -0,0 +1,47 @@
+#ifndef UBEAT_TICKER_H
+#define UBEAT_TICKER_H
+
+// A thread which calls a function at a fixed rate.
+// When a tick runs late, the missed ticks are skipped instead of being run
+// back to back.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void (*ticker_fn_t)(void* userdata);
+
+typedef struct {
+	pthread_t thread;
+	atomic_bool running;
+
+	const char* name;
+	long long period_ns;
+	ticker_fn_t fn;
+	void* userdata;
+
+	atomic_uint_fast64_t num_ticks;
+	// Ticks which took longer than the period
+	atomic_uint_fast64_t num_overruns;
+	// Ticks which were never run because an earlier one was late
+	atomic_uint_fast64_t num_skipped;
+} ticker_t;
+
+typedef struct {
+	uint64_t num_ticks;
+	uint64_t num_overruns;
+	uint64_t num_skipped;
+} ticker_stats_t;
+
+bool
+ticker_start(ticker_t* ticker, const char* name, double period_s, ticker_fn_t fn, void* userdata);
+
+// Waits for the current tick to finish
+void
+ticker_stop(ticker_t* ticker);
+
+ticker_stats_t
+ticker_stats(ticker_t* ticker);
+
+#endif
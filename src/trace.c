@@ -0,0 +1,156 @@
+#include "trace.h"
+#include <sokol_time.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define TRACE_MAX_THREADS 16
+#define TRACE_BUFFER_SIZE 16384
+
+typedef struct {
+	const char* name;
+	uint64_t start;
+	uint64_t end;
+} trace_event_t;
+
+typedef struct {
+	_Atomic(const char*) thread_name;
+	atomic_uint_fast64_t head;
+	trace_event_t events[TRACE_BUFFER_SIZE];
+} trace_buffer_t;
+
+static bool trace_enabled = false;
+static trace_buffer_t* trace_buffers = NULL;
+static atomic_int trace_num_buffers = 0;
+static _Thread_local trace_buffer_t* trace_thread_buffer = NULL;
+static _Thread_local bool trace_thread_has_no_buffer = false;
+
+static trace_buffer_t*
+trace_get_buffer(void) {
+	if (trace_thread_buffer != NULL || trace_thread_has_no_buffer) {
+		return trace_thread_buffer;
+	}
+
+	// Buffers are allocated up front so that the audio thread never mallocs
+	int index = atomic_fetch_add_explicit(&trace_num_buffers, 1, memory_order_relaxed);
+	if (index >= TRACE_MAX_THREADS) {
+		trace_thread_has_no_buffer = true;
+		return NULL;
+	}
+
+	trace_thread_buffer = &trace_buffers[index];
+	return trace_thread_buffer;
+}
+
+void
+trace_init(bool enabled) {
+	if (!enabled) { return; }
+
+	trace_buffers = calloc(TRACE_MAX_THREADS, sizeof(trace_buffer_t));
+	trace_enabled = trace_buffers != NULL;
+}
+
+void
+trace_cleanup(void) {
+	trace_enabled = false;
+	free(trace_buffers);
+	trace_buffers = NULL;
+}
+
+bool
+trace_is_enabled(void) {
+	return trace_enabled;
+}
+
+void
+trace_set_thread_name(const char* name) {
+	if (!trace_enabled) { return; }
+
+	trace_buffer_t* buffer = trace_get_buffer();
+	if (buffer == NULL) { return; }
+
+	atomic_store_explicit(&buffer->thread_name, name, memory_order_relaxed);
+}
+
+uint64_t
+trace_begin(void) {
+	return trace_enabled ? stm_now() : 0;
+}
+
+void
+trace_end(const char* name, uint64_t start) {
+	if (!trace_enabled) { return; }
+
+	trace_buffer_t* buffer = trace_get_buffer();
+	if (buffer == NULL) { return; }
+
+	uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+	buffer->events[head % TRACE_BUFFER_SIZE] = (trace_event_t){
+		.name = name,
+		.start = start,
+		.end = stm_now(),
+	};
+	atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+}
+
+bool
+trace_write(const char* path) {
+	if (!trace_enabled) { return false; }
+
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) { return false; }
+
+	trace_event_t* events = malloc(sizeof(trace_event_t) * TRACE_BUFFER_SIZE);
+	if (events == NULL) {
+		fclose(file);
+		return false;
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	bool first_event = true;
+	int num_buffers = atomic_load_explicit(&trace_num_buffers, memory_order_relaxed);
+	num_buffers = num_buffers > TRACE_MAX_THREADS ? TRACE_MAX_THREADS : num_buffers;
+	for (int tid = 0; tid < num_buffers; ++tid) {
+		trace_buffer_t* buffer = &trace_buffers[tid];
+
+		// The owner keeps writing while this is copied.
+		// Events which may have been overwritten during the copy are dropped.
+		uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+		uint64_t first = head > TRACE_BUFFER_SIZE ? head - TRACE_BUFFER_SIZE : 0;
+		for (uint64_t i = first; i < head; ++i) {
+			events[i - first] = buffer->events[i % TRACE_BUFFER_SIZE];
+		}
+		atomic_thread_fence(memory_order_acquire);
+		uint64_t new_head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+		uint64_t valid = new_head > TRACE_BUFFER_SIZE ? new_head - TRACE_BUFFER_SIZE : 0;
+		valid = valid > first ? valid : first;
+
+		const char* thread_name = atomic_load_explicit(&buffer->thread_name, memory_order_relaxed);
+		fprintf(
+			file,
+			"%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first_event ? "" : ",\n",
+			tid,
+			thread_name != NULL ? thread_name : "unknown"
+		);
+		first_event = false;
+
+		for (uint64_t i = valid; i < head; ++i) {
+			const trace_event_t* event = &events[i - first];
+			fprintf(
+				file,
+				",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				event->name,
+				tid,
+				stm_us(event->start),
+				stm_us(stm_diff(event->end, event->start))
+			);
+		}
+	}
+	fprintf(file, "\n]}\n");
+
+	free(events);
+	bool success = ferror(file) == 0;
+	fclose(file);
+	return success;
+}
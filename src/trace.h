@@ -0,0 +1,36 @@
+#ifndef UBEAT_TRACE_H
+#define UBEAT_TRACE_H
+
+// Record timed spans from every thread and export them in the trace event
+// format of chrome://tracing and Perfetto.
+// Each thread appends to its own ring buffer so recording never blocks.
+// Only the most recent events of each thread are kept.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void
+trace_init(bool enabled);
+
+void
+trace_cleanup(void);
+
+bool
+trace_is_enabled(void);
+
+// The name must outlive the tracer
+void
+trace_set_thread_name(const char* name);
+
+// Returns the start of a span, to be passed to trace_end
+uint64_t
+trace_begin(void);
+
+// The name must outlive the tracer
+void
+trace_end(const char* name, uint64_t start);
+
+bool
+trace_write(const char* path);
+
+#endif
@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+#include "worker.h"
+#include <blog.h>
+#include <string.h>
+#include "trace.h"
+
+static void*
+worker_entry(void* userdata) {
+	worker_t* worker = userdata;
+	trace_set_thread_name(worker->name);
+
+	while (true) {
+		while (sem_wait(&worker->start) != 0) { }
+		if (!worker->running) { break; }
+
+		worker->fn(worker->userdata);
+		sem_post(&worker->done);
+	}
+
+	return NULL;
+}
+
+void
+worker_init(worker_t* worker, const char* name) {
+	*worker = (worker_t){ .name = name, .running = true };
+	sem_init(&worker->start, 0, 0);
+	sem_init(&worker->done, 0, 0);
+
+	if (pthread_create(&worker->thread, NULL, worker_entry, worker) != 0) {
+		BLOG_ERROR("Could not start worker %s", name);
+		worker->running = false;
+		return;
+	}
+
+	// Thread names are limited to 16 bytes including the terminator
+	char thread_name[16];
+	strncpy(thread_name, name, sizeof(thread_name) - 1);
+	thread_name[sizeof(thread_name) - 1] = '\0';
+	pthread_setname_np(worker->thread, thread_name);
+}
+
+void
+worker_cleanup(worker_t* worker) {
+	if (worker->running) {
+		worker->running = false;
+		sem_post(&worker->start);
+		pthread_join(worker->thread, NULL);
+	}
+
+	sem_destroy(&worker->done);
+	sem_destroy(&worker->start);
+}
+
+void
+worker_start_job(worker_t* worker, worker_fn_t fn, void* userdata) {
+	if (!worker->running) {
+		// Fallback to running on the calling thread
+		fn(userdata);
+		sem_post(&worker->done);
+		return;
+	}
+
+	worker->fn = fn;
+	worker->userdata = userdata;
+	sem_post(&worker->start);
+}
+
+void
+worker_wait(worker_t* worker) {
+	while (sem_wait(&worker->done) != 0) { }
+}
+
+bool
+worker_try_wait(worker_t* worker) {
+	return sem_trywait(&worker->done) == 0;
+}
@@ -0,0 +1,39 @@
+#ifndef UBEAT_WORKER_H
+#define UBEAT_WORKER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+
+typedef void (*worker_fn_t)(void* userdata);
+
+// A thread which runs one job at a time on behalf of another thread
+typedef struct {
+	pthread_t thread;
+	sem_t start;
+	sem_t done;
+
+	const char* name;
+	worker_fn_t fn;
+	void* userdata;
+	bool running;
+} worker_t;
+
+void
+worker_init(worker_t* worker, const char* name);
+
+void
+worker_cleanup(worker_t* worker);
+
+// Must be followed by a matching worker_wait
+void
+worker_start_job(worker_t* worker, worker_fn_t fn, void* userdata);
+
+void
+worker_wait(worker_t* worker);
+
+// Returns whether the job has finished, in which case it counts as waited for
+bool
+worker_try_wait(worker_t* worker);
+
+#endif